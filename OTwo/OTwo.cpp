@@ -1,1442 +1,670 @@
 ﻿#include <iostream>
 #include <fstream>
 #include <cstdint>
-
-#include "defines.h"
+#include <cstdlib>
+#include <chrono>
+#include <algorithm>
+#include <iomanip>
+#include <memory>
+#include <optional>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "batch.h"
+#include "console.h"
+#include "cpu.h"
+#include "inputqueue.h"
+#include "machine.h"
 #include "memory.h"
-
-class CPU
+#include "profiler.h"
+#include "timer.h"
+#include "timetravel.h"
+#include "trace.h"
+#include "warmstart.h"
+
+#ifdef OTWO_AOT_PROGRAM
+extern const CompiledProgram compiledProgram;
+#endif
+
+// Runs every job in the list across the given number of threads (zero
+// for all cores) and prints each result as its job finishes.
+static int RunBatchMode(const char *path, unsigned threads, bool lockstep)
 {
-
-public:
-	CPU(Memory *memory)
-		: memory(memory)
-	{
-		Reset();
-		PC = 0x400;
-	}
-
-	~CPU()
-	{
-	}
-
-	void Reset()
-	{
-		uint16_t rv = memory->ReadWord(0xFFFC);
-		PC = rv;
-		I = 1;
-		B = 0;
-		D = 0;
-		S = 0xFD;
-	}
-
-	inline uint8_t FetchInstruction()
-	{
-		return memory->ReadByte(PC++);
-	}
-
-	inline uint8_t FetchByte()
-	{
-		return memory->ReadByte(PC++);
-	}
-
-	inline uint16_t FetchWord()
-	{
-		auto res = memory->ReadWord(PC);
-		PC += 2;
-		return res;
-	}
-
-	inline uint8_t FetchByteZP()
-	{
-		auto zp_index = FetchByte();
-		return memory->ReadByte(zp_index);
-	}
-
-	inline uint8_t FetchByteZPX()
-	{
-		auto zp_index = FetchByte();
-		return memory->ReadByte(zp_index + X);
-	}
-
-	inline uint8_t FetchByteZPY()
-	{
-		auto zp_index = FetchByte();
-		return memory->ReadByte(zp_index + Y);
-	}
-
-	inline uint8_t FetchByteAbsolute()
-	{
-		auto index = FetchWord();
-		return memory->ReadByte(index);
-	}
-
-	inline uint8_t FetchByteAbsoluteX()
-	{
-		auto index = FetchWord();
-		return memory->ReadByte(index + X);
-	}
-
-	inline uint8_t FetchByteAbsoluteY()
-	{
-		auto index = FetchWord();
-		return memory->ReadByte(index + Y);
-	}
-
-	inline uint8_t FetchByteIndirectX()
-	{
-		auto zp_index = FetchByte() + X;
-
-		uint16_t effective_address = memory->ReadByte(zp_index % 256) |
-									 (memory->ReadByte((zp_index + 1) % 256) << 8);
-
-		return memory->ReadByte(effective_address);
-	}
-
-	inline uint8_t FetchByteIndirectY()
-	{
-		auto zp_index = FetchByte();
-
-		uint16_t base_address = memory->ReadByte(zp_index) |
-								(memory->ReadByte((zp_index + 1) % 256) << 8);
-
-		uint16_t effective_address = base_address + Y;
-
-		return memory->ReadByte(effective_address);
-	}
-
-	uint16_t FetchIndirectAddress()
-	{
-		uint16_t ptr = FetchWord();
-		uint16_t lsb = memory->ReadByte(ptr);
-		uint16_t msb = memory->ReadByte((ptr & 0xFF00) | ((ptr + 1) & 0x00FF)); // Handle page boundary
-		return (msb << 8) | lsb;
-	}
-
-	void WriteZPLastPC(uint8_t value)
-	{
-		// we move back one place to get the zp address from instruction stream
-		memory->WriteByte(memory->ReadByte(PC - 1), value);
-	}
-
-	void WriteZPXLastPC(uint8_t value)
-	{
-		// we move back one place to get the zp address from instruction stream
-		memory->WriteByte(memory->ReadByte(PC - 1) + X, value);
-	}
-
-	void WriteAbsoluteLastPC(uint8_t value)
-	{
-		memory->WriteByte(memory->ReadWord(PC - 2), value);
-	}
-
-	void WriteAbsoluteXLastPC(uint8_t value)
-	{
-		memory->WriteByte(memory->ReadWord(PC - 2) + X, value);
-	}
-
-	void StackPush(uint8_t value)
+	std::ifstream file(path);
+	if (!file)
 	{
-		memory->WriteByte(0x100 + S, value);
-		if (S == 0x00)
-			S = 0xFF;
-		else
-			S--;
+		std::cout << "Failed to open " << path << std::endl;
+		return 1;
 	}
 
-	uint8_t StackPop()
+	std::vector<BatchJob> jobs;
+	std::string error;
+	if (!ParseBatchJobs(file, jobs, error))
 	{
-		if (S == 0xFF)
-			S = 0x00;
-		else
-			S++;
-		return memory->ReadByte(0x100 + S);
+		std::cout << path << ": " << error << std::endl;
+		return 1;
 	}
 
-	inline void ADC(uint8_t itx)
-	{
-		uint8_t n1 = 0;
-
-		switch (itx)
+	bool allLoaded = true;
+	RunBatch(jobs, threads, [&](const BatchResult &result)
+			 {
+		std::cout << result.index << ": ";
+		if (!result.loaded)
 		{
-		case ADC_IMM:
-			n1 = FetchByte();
-			break;
-		case ADC_ZP:
-			n1 = FetchByteZP();
-			break;
-		case ADC_ZPX:
-			n1 = FetchByteZPX();
-			break;
-		case ADC_ABS:
-			n1 = FetchByteAbsolute();
-			break;
-		case ADC_ABSX:
-			n1 = FetchByteAbsoluteX();
-			break;
-		case ADC_ABSY:
-			n1 = FetchByteAbsoluteY();
-			break;
-		case ADC_INDX:
-			n1 = FetchByteIndirectX();
-			break;
-		case ADC_INDY:
-			n1 = FetchByteIndirectY();
-			break;
+			allLoaded = false;
+			std::cout << "failed to load" << std::endl;
+			return;
 		}
-		auto n2 = A;
-		uint16_t r = n1 + n2 + C;
-		A = r & 0xFF;
-		C = (r > 0xFF) ? 1 : 0;
-		Z = (A == 0) ? 1 : 0;
-		V = (((n1 > 0) && (n2 > 0) && (r < 0)) || ((n1 < 0) && (n2 < 0) && (r > 0))) ? 1 : 0;
-		N = (A & 0b01000000) ? 1 : 0;
-	}
-
-	inline void SBC(uint8_t itx)
-	{
-		uint8_t n1 = 0;
+		std::cout << StopReasonName(result.run.reason) << " at " << std::hex << result.run.address << std::dec;
+		if (!result.captured.empty())
+			std::cout << "; " << result.captured;
+		std::cout << std::endl; }, lockstep);
+	return allLoaded ? 0 : 1;
+}
 
-		switch (itx)
-		{
-		case SBC_IMM:
-			n1 = FetchByte();
-			break;
-		case SBC_ZP:
-			n1 = FetchByteZP();
-			break;
-		case SBC_ZPX:
-			n1 = FetchByteZPX();
-			break;
-		case SBC_ABS:
-			n1 = FetchByteAbsolute();
-			break;
-		case SBC_ABSX:
-			n1 = FetchByteAbsoluteX();
-			break;
-		case SBC_ABSY:
-			n1 = FetchByteAbsoluteY();
-			break;
-		case SBC_INDX:
-			n1 = FetchByteIndirectX();
-			break;
-		case SBC_INDY:
-			n1 = FetchByteIndirectY();
-			break;
+// Runs the functional test with RunFor, which takes blocks, fused pairs and
+// translated code, in chunks of random size, and steps a second machine
+// through the same instructions with Step, which only dispatches through
+// the handler table. Reports the first chunk after which the registers,
+// counters or memory differ. Blocks are translated on their second run
+// rather than once hot, so the translator sees nearly every block.
+static int RunCheckMode(uint64_t maxCycles, uint64_t seed, bool jit)
+{
+	Machine fast;
+	Machine reference;
+	for (Memory *memory : { &fast.memory, &reference.memory })
+	{
+		if (!memory->LoadImages({ { "6502_functional_test.bin", 0x0000, true } }))
+		{
+			std::cout << "Failed to load memory" << std::endl;
+			return 1;
+		}
+	}
+	fast.cpu.EnableJit(jit, 2);
+
+	// Mostly short chunks, so that differences show up close to where they
+	// start, with long ones in between to keep translated blocks chained.
+	std::mt19937_64 random(seed);
+	std::uniform_int_distribution<uint64_t> shortChunk(1, 200);
+	std::uniform_int_distribution<uint64_t> longChunk(1, 200000);
+	uint64_t chunks = 0;
+	while (fast.cpu.Cycles() < maxCycles)
+	{
+		uint64_t cycles = std::min(random() % 8 == 0 ? longChunk(random) : shortChunk(random), maxCycles - fast.cpu.Cycles());
+		uint64_t startCycles = fast.cpu.Cycles();
+		RunResult fastResult = fast.cpu.RunFor(cycles);
+		RunResult referenceResult{};
+		for (uint64_t i = 0; i < fastResult.instructions; i++)
+			referenceResult = reference.cpu.Step();
+		chunks++;
+
+		CPUState a = fast.cpu.GetState();
+		CPUState b = reference.cpu.GetState();
+		bool same = a.PC == b.PC && a.A == b.A && a.X == b.X && a.Y == b.Y && a.S == b.S && a.P == b.P &&
+					a.cycles == b.cycles && a.instructions == b.instructions;
+		long differentByte = -1;
+		for (uint32_t address = 0; address < 0x10000 && differentByte < 0; address++)
+		{
+			if (fast.memory.Peek(address) != reference.memory.Peek(address))
+				differentByte = address;
+		}
+		bool stopped = fastResult.reason != StopReason::BudgetExhausted;
+		if (stopped && (referenceResult.reason != fastResult.reason || referenceResult.address != fastResult.address))
+			same = false;
+		if (!same || differentByte >= 0)
+		{
+			std::cout << "Differs after the chunk of " << cycles << " cycles from cycle " << startCycles << ":\n" << std::hex;
+			for (const CPUState *state : { &a, &b })
+			{
+				std::cout << (state == &a ? "  RunFor: " : "  Step:   ") << "PC=" << state->PC << " A=" << int(state->A)
+						  << " X=" << int(state->X) << " Y=" << int(state->Y) << " S=" << int(state->S)
+						  << " P=" << int(state->P) << std::dec << " cycles=" << state->cycles
+						  << " instructions=" << state->instructions << std::hex << '\n';
+			}
+			if (differentByte >= 0)
+				std::cout << "  memory at " << differentByte << ": " << int(fast.memory.Peek(differentByte)) << " vs "
+						  << int(reference.memory.Peek(differentByte)) << '\n';
+			std::cout << std::dec;
+			return 1;
 		}
-		auto n2 = A;
-		uint16_t r = n1 + (~n2) + C;
-		A = r & 0xFF;
-		C = (r > 0xFF) ? 1 : 0;
-		Z = (A == 0) ? 1 : 0;
-	}
-
-	inline void AND(uint8_t itx)
-	{
-		uint8_t val = 0;
-		switch (itx)
+		if (stopped)
 		{
-		case AND_IMM:
-			val = FetchByte();
-			break;
-		case AND_ZP:
-			val = FetchByteZP();
-			break;
-		case AND_ZPX:
-			val = FetchByteZPX();
-			break;
-		case AND_ABS:
-			val = FetchByteAbsolute();
-			break;
-		case AND_ABSX:
-			val = FetchByteAbsoluteX();
-			break;
-		case AND_ABSY:
-			val = FetchByteAbsoluteY();
-			break;
-		case AND_INDX:
-			val = FetchByteIndirectX();
-			break;
-		case AND_INDY:
-			val = FetchByteIndirectY();
+			std::cout << "Stopped at " << std::hex << fastResult.address << ": " << StopReasonName(fastResult.reason)
+					  << std::dec << '\n';
 			break;
 		}
-		A &= val;
-		N = (A & 0b01000000) ? 1 : 0;
-		Z = (A == 0) ? 1 : 0;
 	}
+	std::cout << "Same state after each of " << chunks << " chunks, " << fast.cpu.Cycles() << " cycles" << std::endl;
+	return 0;
+}
 
-	inline void ORA(uint8_t itx)
+// Runs the functional test in chunks, saving the machine after each one and
+// now and then loading one of the last few saves, into the same machine or
+// a fresh one forked from the image. Each load must give back the saved
+// registers and memory, and the run must end where an uninterrupted one
+// does after the same number of instructions.
+static int RunSnapshotCheckMode(uint64_t maxCycles, uint64_t seed, bool jit)
+{
+	Machine loader;
+	if (!loader.memory.LoadImages({ { "6502_functional_test.bin", 0x0000, true } }))
 	{
-		uint8_t val = 0;
-		switch (itx)
-		{
-		case ORA_IMM:
-			val = FetchByte();
-			break;
-		case ORA_ZP:
-			val = FetchByteZP();
-			break;
-		case ORA_ZPX:
-			val = FetchByteZPX();
-			break;
-		case ORA_ABS:
-			val = FetchByteAbsolute();
-			break;
-		case ORA_ABSX:
-			val = FetchByteAbsoluteX();
-			break;
-		case ORA_ABSY:
-			val = FetchByteAbsoluteY();
-			break;
-		case ORA_INDX:
-			val = FetchByteIndirectX();
-			break;
-		case ORA_INDY:
-			val = FetchByteIndirectY();
-			break;
-		}
-		A |= val;
-		N = (A & 0b01000000) ? 1 : 0;
-		Z = (A == 0) ? 1 : 0;
+		std::cout << "Failed to load memory" << std::endl;
+		return 1;
 	}
-
-	inline void EOR(uint8_t itx)
+	std::shared_ptr<const Memory::BaseImage> base = loader.memory.Share();
+	auto fork = [&base, jit]
 	{
-		uint8_t val = 0;
-		switch (itx)
-		{
-		case EOR_IMM:
-			val = FetchByte();
-			break;
-		case EOR_ZP:
-			val = FetchByteZP();
-			break;
-		case EOR_ZPX:
-			val = FetchByteZPX();
-			break;
-		case EOR_ABS:
-			val = FetchByteAbsolute();
-			break;
-		case EOR_ABSX:
-			val = FetchByteAbsoluteX();
-			break;
-		case EOR_ABSY:
-			val = FetchByteAbsoluteY();
-			break;
-		case EOR_INDX:
-			val = FetchByteIndirectX();
-			break;
-		case EOR_INDY:
-			val = FetchByteIndirectY();
-			break;
-		}
-		A ^= val;
-		N = (A & 0b01000000) ? 1 : 0;
-		Z = (A == 0) ? 1 : 0;
-	}
-
-	inline void LDA(uint8_t itx)
+		auto machine = std::make_unique<Machine>(base);
+		machine->cpu.EnableJit(jit, 2);
+		return machine;
+	};
+	auto capture = [](const Machine &machine)
 	{
-		uint8_t val = 0;
-		switch (itx)
+		CPUState state = machine.cpu.GetState();
+		std::vector<uint8_t> bytes = { uint8_t(state.PC), uint8_t(state.PC >> 8), state.A, state.X, state.Y, state.S, state.P };
+		for (int shift = 0; shift < 64; shift += 8)
 		{
-		case LDA_IMM:
-			val = FetchByte();
-			break;
-		case LDA_ZP:
-			val = FetchByteZP();
-			break;
-		case LDA_ZPX:
-			val = FetchByteZPX();
-			break;
-		case LDA_ABS:
-			val = FetchByteAbsolute();
-			break;
-		case LDA_ABSX:
-			val = FetchByteAbsoluteX();
-			break;
-		case LDA_ABSY:
-			val = FetchByteAbsoluteY();
-			break;
-		case LDA_INDX:
-			val = FetchByteIndirectX();
-			break;
-		case LDA_INDY:
-			val = FetchByteIndirectY();
-			break;
+			bytes.push_back(uint8_t(state.cycles >> shift));
+			bytes.push_back(uint8_t(state.instructions >> shift));
 		}
-		A = val;
-		N = (A & 0b01000000) ? 1 : 0;
-		Z = (A == 0) ? 1 : 0;
-	}
+		for (uint32_t address = 0; address < 0x10000; address++)
+			bytes.push_back(machine.memory.Peek(address));
+		return bytes;
+	};
 
-	inline void LDX(uint8_t itx)
+	struct Saved
 	{
-		uint8_t val = 0;
-		switch (itx)
-		{
-		case LDX_IMM:
-			val = FetchByte();
-			break;
-		case LDX_ZP:
-			val = FetchByteZP();
-			break;
-		case LDX_ZPY:
-			val = FetchByteZPY();
-			break;
-		case LDX_ABS:
-			val = FetchByteAbsolute();
-			break;
-		case LDX_ABSY:
-			val = FetchByteAbsoluteY();
+		MachineState state;
+		std::vector<uint8_t> bytes;
+	};
+	std::vector<Saved> saves;
+	std::unique_ptr<Machine> machine = fork();
+	std::mt19937_64 random(seed);
+	std::uniform_int_distribution<uint64_t> chunk(1, 200000);
+	uint64_t loads = 0;
+	uint64_t forks = 0;
+	RunResult result{};
+	while (machine->cpu.Cycles() < maxCycles)
+	{
+		result = machine->cpu.RunFor(std::min(chunk(random), maxCycles - machine->cpu.Cycles()));
+		if (result.reason != StopReason::BudgetExhausted)
 			break;
-		}
-		X = val;
-		N = (X & 0b01000000) ? 1 : 0;
-		Z = (X == 0) ? 1 : 0;
-	}
+		saves.push_back({ machine->SaveState(), capture(*machine) });
+		if (random() % 16 != 0)
+			continue;
 
-	inline void LDY(uint8_t itx)
-	{
-		uint8_t val = 0;
-		switch (itx)
+		// Back by up to eight saves, dropping the ones after it.
+		saves.resize(saves.size() - random() % std::min<size_t>(saves.size(), 8));
+		if (random() % 2 == 0)
 		{
-		case LDY_IMM:
-			val = FetchByte();
-			break;
-		case LDY_ZP:
-			val = FetchByteZP();
-			break;
-		case LDY_ZPX:
-			val = FetchByteZPX();
-			break;
-		case LDY_ABS:
-			val = FetchByteAbsolute();
-			break;
-		case LDY_ABSX:
-			val = FetchByteAbsoluteX();
-			break;
+			machine = fork();
+			forks++;
 		}
-		Y = val;
-		N = (Y & 0b01000000) ? 1 : 0;
-		Z = (Y == 0) ? 1 : 0;
-	}
-
-	void JMP(uint8_t itx)
-	{
-		uint16_t address = 0;
-		switch (itx)
+		machine->LoadState(saves.back().state);
+		loads++;
+		if (capture(*machine) != saves.back().bytes)
 		{
-		case JMP_ABS:
-			address = FetchWord();
-			break;
-		case JMP_IND:
-			address = FetchIndirectAddress();
-			break;
+			std::cout << "Loading the save at cycle " << saves.back().state.cpu.cycles
+					  << " does not give back the machine" << std::endl;
+			return 1;
 		}
-
-		PC = address;
 	}
 
-	void PHA()
+	std::unique_ptr<Machine> reference = fork();
+	RunResult referenceResult = reference->cpu.RunFor(UINT64_MAX, machine->cpu.GetState().instructions);
+	bool stopped = result.reason != StopReason::BudgetExhausted;
+	if (capture(*machine) != capture(*reference) ||
+		(stopped && (referenceResult.reason != result.reason || referenceResult.address != result.address)))
 	{
-		StackPush(A);
-		PC++;
+		std::cout << "Differs from an uninterrupted run after " << machine->cpu.GetState().instructions
+				  << " instructions" << std::endl;
+		return 1;
 	}
+	std::cout << "Same state after " << loads << " loads, " << forks << " into fresh machines, "
+			  << machine->cpu.Cycles() << " cycles" << std::endl;
+	return 0;
+}
 
-	void PHP()
+// Decodes a trace of the functional test and checks each record against a
+// machine that steps the interpreter from the start. After a gap, the
+// machine steps on to the cycle the next record was taken at.
+static int RunTraceCheckMode(const char *path)
+{
+	TraceReader reader(path);
+	if (!reader.IsOpen())
 	{
-		uint8_t P = 0;
-		P |= C ? 0b00000001 : 0;
-		P |= Z ? 0b00000010 : 0;
-		P |= I ? 0b00000100 : 0;
-		P |= D ? 0b00001000 : 0;
-		P |= B ? 0b00010000 : 0;
-		P |= V ? 0b01000000 : 0;
-		P |= N ? 0b10000000 : 0;
-		StackPush(P);
-		PC++;
+		std::cout << "Failed to open the trace " << path << std::endl;
+		return 1;
 	}
-
-	void ASL(uint8_t itx)
+	Machine reference;
+	if (!reference.memory.LoadImages({ { "6502_functional_test.bin", 0x0000, true } }))
 	{
-		uint8_t _val = 0;
-		uint8_t val = 0;
-		switch (itx)
-		{
-		case ASL_ACC:
-		{
-			_val = A;
-			val = _val << 1;
-			A = val;
-		}
-		break;
-		case ASL_ZP:
-		{
-			_val = FetchByteZP();
-			val = _val << 1;
-			WriteZPLastPC(val);
-		}
-		break;
-		case ASL_ZPX:
-		{
-			_val = FetchByteZPX();
-			val = _val << 1;
-			WriteZPXLastPC(val);
-		}
-		break;
-		case ASL_ABS:
-		{
-			_val = FetchByteAbsolute();
-			val = _val << 1;
-			WriteAbsoluteLastPC(val);
-		}
-		break;
-		case ASL_ABSX:
-		{
-			_val = FetchByteAbsoluteX();
-			val = _val << 1;
-			WriteAbsoluteXLastPC(val);
-		}
-		break;
-		}
-
-		C = (_val & 0b10000000) ? 1 : 0;
-		N = (val & 0b10000000) ? 1 : 0;
-		Z = (val == 0) ? 1 : 0;
+		std::cout << "Failed to load memory" << std::endl;
+		return 1;
 	}
 
-	void LSR(uint8_t itx)
+	uint64_t records = 0;
+	uint64_t gaps = 0;
+	TraceRecord record;
+	while (reader.Next(record))
 	{
-		uint8_t _val = 0;
-		uint8_t val = 0;
-		switch (itx)
-		{
-		case LSR_ACC:
-		{
-			_val = A;
-			val = _val >> 1;
-			A = val;
-		}
-		break;
-		case LSR_ZP:
+		if (record.gap)
 		{
-			_val = FetchByteZP();
-			val = _val >> 1;
-			WriteZPLastPC(val);
+			gaps++;
+			while (reference.cpu.Cycles() < record.cycles)
+				reference.cpu.Step();
 		}
-		break;
-		case LSR_ZPX:
+		CPUState state = reference.cpu.GetState();
+		uint8_t opcode = reference.memory.Peek(state.PC);
+		if (record.pc != state.PC || record.opcode != opcode || record.a != state.A || record.x != state.X ||
+			record.y != state.Y || record.s != state.S || record.p != state.P || record.cycles != state.cycles)
 		{
-			_val = FetchByteZPX();
-			val = _val >> 1;
-			WriteZPXLastPC(val);
+			std::cout << "Record " << records << " differs:\n" << std::hex;
+			std::cout << "  trace: PC=" << record.pc << " opcode=" << int(record.opcode) << " A=" << int(record.a)
+					  << " X=" << int(record.x) << " Y=" << int(record.y) << " S=" << int(record.s)
+					  << " P=" << int(record.p) << std::dec << " cycles=" << record.cycles << std::hex << '\n';
+			std::cout << "  Step:  PC=" << state.PC << " opcode=" << int(opcode) << " A=" << int(state.A)
+					  << " X=" << int(state.X) << " Y=" << int(state.Y) << " S=" << int(state.S)
+					  << " P=" << int(state.P) << std::dec << " cycles=" << state.cycles << std::endl;
+			return 1;
 		}
-		break;
-		case LSR_ABS:
-		{
-			_val = FetchByteAbsolute();
-			val = _val >> 1;
-			WriteAbsoluteLastPC(val);
-		}
-		break;
-		case LSR_ABSX:
-		{
-			_val = FetchByteAbsoluteX();
-			val = _val >> 1;
-			WriteAbsoluteXLastPC(val);
-		}
-		break;
-		}
-
-		C = (_val & 0b00000001) ? 1 : 0;
-		N = 0;
-		Z = (val == 0) ? 1 : 0;
+		reference.cpu.Step();
+		records++;
 	}
-
-	void ROL(uint8_t itx)
+	if (records == 0)
 	{
-		uint8_t _val = 0;
-		uint8_t val = 0;
-		switch (itx)
-		{
-		case ROL_ACC:
-		{
-			_val = A;
-			val = (_val << 1) | C;
-			A = val;
-		}
-		break;
-		case ROL_ZP:
-		{
-			_val = FetchByteZP();
-			val = (_val << 1) | C;
-			WriteZPLastPC(val);
-		}
-		break;
-		case ROL_ZPX:
-		{
-			_val = FetchByteZPX();
-			val = (_val << 1) | C;
-			WriteZPXLastPC(val);
-		}
-		break;
-		case ROL_ABS:
-		{
-			_val = FetchByteAbsolute();
-			val = (_val << 1) | C;
-			WriteAbsoluteLastPC(val);
-		}
-		break;
-		case ROL_ABSX:
-		{
-			_val = FetchByteAbsoluteX();
-			val = (_val << 1) | C;
-			WriteAbsoluteXLastPC(val);
-		}
-		break;
-		}
-
-		C = (_val & 0b10000000) ? 1 : 0;
-		N = (val & 0b10000000) ? 1 : 0;
-		Z = (val == 0) ? 1 : 0;
+		std::cout << "The trace has no records" << std::endl;
+		return 1;
 	}
+	std::cout << records << " records match, after " << gaps << " gaps" << std::endl;
+	return 0;
+}
 
-	void ROR(uint8_t itx)
+// Runs the functional test under TimeTravel, keeping up to memoryCap bytes
+// of checkpoints, then reads debugger commands from stdin, one per line:
+//
+//   step [n]       runs n instructions, 1 by default
+//   continue       runs to a breakpoint, a trap or the cycle budget
+//   back [n]       goes back n instructions, 1 by default
+//   rc             goes back to the last breakpoint hit (reverse-continue)
+//   seek <n>       goes to the point after n instructions since power-on
+//   break <addr>   sets a breakpoint; clear <addr> removes it
+//   check <n>      goes back n instructions and forward n again, and
+//                  reports whether the registers and memory are as before
+//   quit
+//
+// Each command prints where the machine is after it. The machine runs
+// without devices, since going back replays reads.
+static int RunRewindMode(size_t memoryCap, int argc, char **argv)
+{
+	DebugMachine machine;
+	if (!machine.memory.LoadImages({ { "6502_functional_test.bin", 0x0000, true } }))
 	{
-		uint8_t _val = 0;
-		uint8_t val = 0;
-		switch (itx)
-		{
-		case ROR_ACC:
-		{
-			_val = A;
-			val = (_val >> 1) | (C << 7);
-			A = val;
-		}
-		break;
-		case ROR_ZP:
-		{
-			_val = FetchByteZP();
-			val = (_val >> 1) | (C << 7);
-			WriteZPLastPC(val);
-		}
-		break;
-		case ROR_ZPX:
-		{
-			_val = FetchByteZPX();
-			val = (_val >> 1) | (C << 7);
-			WriteZPXLastPC(val);
-		}
-		break;
-		case ROR_ABS:
-		{
-			_val = FetchByteAbsolute();
-			val = (_val >> 1) | (C << 7);
-			WriteAbsoluteLastPC(val);
-		}
-		break;
-		case ROR_ABSX:
-		{
-			_val = FetchByteAbsoluteX();
-			val = (_val >> 1) | (C << 7);
-			WriteAbsoluteXLastPC(val);
-		}
-		break;
-		}
-
-		C = (_val & 0b00000001) ? 1 : 0;
-		N = (val & 0b10000000) ? 1 : 0;
-		Z = (val == 0) ? 1 : 0;
+		std::cout << "Failed to load memory" << std::endl;
+		return 1;
 	}
+	uint64_t maxCycles = UINT64_MAX;
+	if (argc > 1 && std::strtoull(argv[1], nullptr, 0) != 0)
+		maxCycles = std::strtoull(argv[1], nullptr, 0);
+	long successTrap = argc > 2 ? std::strtol(argv[2], nullptr, 0) : -1;
 
-	void PLP()
-	{
-		uint8_t P = StackPop();
-		C = (P & 0b00000001) == 1 ? 1 : 0;
-		Z = (P & 0b00000010) == 1 ? 1 : 0;
-		I = (P & 0b00000100) == 1 ? 1 : 0;
-		D = (P & 0b00001000) == 1 ? 1 : 0;
-		B = (P & 0b00010000) == 1 ? 1 : 0;
-		V = (P & 0b01000000) == 1 ? 1 : 0;
-		N = (P & 0b10000000) == 1 ? 1 : 0;
-		PC++;
-	}
+	DebugCPU &cpu = machine.cpu;
+	TimeTravel timeTravel(machine, memoryCap);
+	auto remaining = [&] { return cpu.Cycles() < maxCycles ? maxCycles - cpu.Cycles() : 0; };
+	auto printStop = [](const RunResult &result)
+	{ std::cout << "Stopped at " << std::hex << result.address << ": " << StopReasonName(result.reason) << std::dec << '\n'; };
 
-	void PLA()
-	{
-		auto _A = StackPop();
-		A = _A;
-		Z = (A == 0) ? 1 : 0;
-		N = (A & 0b10000000) ? 1 : 0;
-	}
+	auto start = std::chrono::steady_clock::now();
+	RunResult first = timeTravel.RunFor(remaining());
+	std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+	printStop(first);
+	std::cout << cpu.Cycles() << " cycles in " << elapsed.count() << " s, " << timeTravel.CheckpointCount()
+			  << " checkpoints in " << timeTravel.MemoryUsed() << " bytes" << std::endl;
 
-	void BCC()
+	// The registers and the whole of memory, to compare points in the run.
+	auto capture = [&]
 	{
-		if (C == 0)
+		std::vector<uint8_t> bytes(0x10000);
+		for (uint32_t address = 0; address < 0x10000; address++)
+			bytes[address] = machine.memory.Peek(address);
+		CPUState state = cpu.GetState();
+		for (uint64_t value : { uint64_t(state.PC), uint64_t(state.A), uint64_t(state.X), uint64_t(state.Y),
+								uint64_t(state.S), uint64_t(state.P), state.cycles, state.instructions })
 		{
-			int8_t rel_offset = (int8_t)FetchByte();
-			PC += rel_offset;
+			for (int i = 0; i < 8; i++)
+				bytes.push_back(uint8_t(value >> (8 * i)));
 		}
-	}
+		return bytes;
+	};
 
-	void BCS()
+	bool checksPassed = true;
+	std::string line;
+	while (std::getline(std::cin, line))
 	{
-		if (C == 1)
-		{
-			int8_t rel_offset = (int8_t)FetchByte();
-			PC += rel_offset;
-		}
-	}
+		std::istringstream words(line);
+		std::string command;
+		if (!(words >> command))
+			continue;
+		uint64_t count = 1;
+		words >> std::setbase(0) >> count;
 
-	void BEQ()
-	{
-		if (Z == 1)
+		if (command == "quit")
+			break;
+		else if (command == "step")
+			printStop(timeTravel.RunFor(remaining(), count));
+		else if (command == "continue")
+			printStop(timeTravel.RunFor(remaining()));
+		else if (command == "back")
 		{
-			int8_t rel_offset = (int8_t)FetchByte();
-			PC += rel_offset;
+			if (!timeTravel.ReverseStep(count))
+				std::cout << "Not that far back; the oldest checkpoint is at instruction "
+						  << timeTravel.OldestInstruction() << '\n';
 		}
-	}
-
-	void BNE()
-	{
-		if (Z == 0)
+		else if (command == "rc")
 		{
-			int8_t rel_offset = (int8_t)FetchByte();
-			PC += rel_offset;
+			if (!timeTravel.ReverseContinue())
+				std::cout << "No breakpoint hit since the oldest checkpoint\n";
 		}
-	}
-
-	void BPL()
-	{
-		if (N == 0)
+		else if (command == "seek")
 		{
-			int8_t rel_offset = (int8_t)FetchByte();
-			PC += rel_offset;
+			if (!timeTravel.Seek(count))
+				std::cout << "Instruction " << count << " is not between the oldest checkpoint and the latest run\n";
 		}
-	}
-
-	void BMI()
-	{
-		if (N == 1)
+		else if (command == "break" || command == "clear")
+			cpu.SetBreakpoint(uint16_t(count), command == "break");
+		else if (command == "check")
 		{
-			int8_t rel_offset = (int8_t)FetchByte();
-			PC += rel_offset;
-		}
-	}
-
-	void BVC()
-	{
-		if (V == 0)
-		{
-			int8_t rel_offset = (int8_t)FetchByte();
-			PC += rel_offset;
+			std::vector<uint8_t> before = capture();
+			bool same = timeTravel.ReverseStep(count);
+			if (same)
+			{
+				RunResult result = timeTravel.RunFor(UINT64_MAX, count);
+				same = result.instructions == count && capture() == before;
+			}
+			std::cout << (same ? "Same" : "Not the same") << " after going back and forward " << count
+					  << " instructions\n";
+			checksPassed = checksPassed && same;
 		}
-	}
-
-	void BVS()
-	{
-		if (V == 1)
+		else
 		{
-			int8_t rel_offset = (int8_t)FetchByte();
-			PC += rel_offset;
+			std::cout << "Unknown command " << command << '\n';
+			continue;
 		}
+		std::cout << std::hex << "PC=" << cpu.ProgramCounter() << " A=" << int(cpu.Accumulator())
+				  << " X=" << int(cpu.IndexX()) << " Y=" << int(cpu.IndexY()) << " S=" << int(cpu.StackPointer())
+				  << " P=" << int(cpu.Status()) << std::dec << " at instruction " << cpu.Instructions() << std::endl;
 	}
 
-	void BIT(uint8_t itx)
-	{
-		uint8_t val = 0;
-		switch (itx)
-		{
-		case BIT_ZP:
-			val = FetchByteZP();
-			break;
-		case BIT_ABS:
-			val = FetchByteAbsolute();
-			break;
-		}
+	if (!checksPassed)
+		return 1;
+	if (successTrap >= 0)
+		return (first.reason == StopReason::Trap && first.address == successTrap) ? 0 : 1;
+	return 0;
+}
 
-		Z = ((val & A) == 0) ? 1 : 0;
-		N = (val & 0b10000000) ? 1 : 0;
-		V = (val & 0b01000000) ? 1 : 0;
-	}
+// Devices mapped over the image, each onto the page at its address.
+struct Devices
+{
+	Console *console = nullptr;
+	uint16_t consoleAddress = 0;
+	InputQueue *input = nullptr;
+	uint16_t inputAddress = 0;
+	Timer *timer = nullptr;
+	uint16_t timerAddress = 0;
+};
 
-	void BRK()
+// Runs the image, by default the functional test, on the machine, with the
+// arguments left after main's options.
+template <typename Policy>
+static int RunImage(BasicMachine<Policy> &machine, int argc, char **argv, const Memory::Image &image,
+					std::optional<WarmStart> &warm, Tracer *tracer, Profiler *profiler, const Devices &devices, bool jit)
+{
+	Memory &memory = machine.memory;
+	if (!memory.LoadImages({ image }))
 	{
-		uint8_t pclo = PC & 0xFF;
-		uint8_t pchi = PC >> 8;
-		StackPush(pchi);
-		StackPush(pclo);
-		uint8_t P = 0;
-		P |= C ? 0b00000001 : 0;
-		P |= Z ? 0b00000010 : 0;
-		P |= I ? 0b00000100 : 0;
-		P |= D ? 0b00001000 : 0;
-		P |= B ? 0b00010000 : 0;
-		P |= V ? 0b01000000 : 0;
-		P |= N ? 0b10000000 : 0;
-		StackPush(P);
-		PC = memory->ReadWord(0xFFFE);
-		B = 1;
+		std::cout << "Failed to load memory" << std::endl;
+		return 1;
 	}
-
-	void CMP(uint8_t itx)
+	if ((devices.console && !devices.console->Attach(machine, devices.consoleAddress)) ||
+		(devices.input && !devices.input->Attach(machine, devices.inputAddress)) ||
+		(devices.timer && !devices.timer->Attach(machine, devices.timerAddress)))
 	{
-		uint8_t val = 0;
-		switch (itx)
-		{
-		case CMP_IMM:
-			val = FetchByte();
-			break;
-		case CMP_ZP:
-			val = FetchByteZP();
-			break;
-		case CMP_ZPX:
-			val = FetchByteZPX();
-			break;
-		case CMP_ABS:
-			val = FetchByteAbsolute();
-			break;
-		case CMP_ABSX:
-			val = FetchByteAbsoluteX();
-			break;
-		case CMP_ABSY:
-			val = FetchByteAbsoluteY();
-			break;
-		case CMP_INDX:
-			val = FetchByteIndirectX();
-			break;
-		case CMP_INDY:
-			val = FetchByteIndirectY();
-			break;
-		}
-
-		Z = (A == val) ? 1 : 0;
-		C = (A >= val) ? 1 : 0;
-		N = ((A - val) & 0b10000000) ? 1 : 0;
+		std::cout << "Device addresses must be page-aligned" << std::endl;
+		return 1;
 	}
 
-	void CPX(uint8_t itx)
-	{
-		uint8_t val = 0;
-		switch (itx)
-		{
-		case CPX_IMM:
-			val = FetchByte();
-			break;
-		case CPX_ZP:
-			val = FetchByteZP();
-			break;
-		case CPX_ABS:
-			val = FetchByteAbsolute();
-			break;
-		}
-
-		Z = (X == val) ? 1 : 0;
-		C = (X >= val) ? 1 : 0;
-		N = ((X - val) & 0b10000000) ? 1 : 0;
-	}
+	// int i = 0;
+	// memory.WriteByte(0xFF + i++, LDA_IMM);
+	// memory.WriteByte(0xFF + i++, 0x32);
+	// memory.WriteByte(0xFF + i++, ADC_IMM);
+	// memory.WriteByte(0xFF + i++, 0x23);
 
-	void CPY(uint8_t itx)
-	{
-		uint8_t val = 0;
-		switch (itx)
-		{
-		case CPY_IMM:
-			val = FetchByte();
-			break;
-		case CPY_ZP:
-			val = FetchByteZP();
-			break;
-		case CPY_ABS:
-			val = FetchByteAbsolute();
-			break;
-		}
+	// An optional cycle budget makes the run finish and report its speed.
+	// Test ROMs signal the result by trapping in a self-loop; when the
+	// address of the success trap is given, the exit status reports it.
+	uint64_t maxCycles = UINT64_MAX;
+	if (argc > 1 && std::strtoull(argv[1], nullptr, 0) != 0)
+		maxCycles = std::strtoull(argv[1], nullptr, 0);
+	long successTrap = -1;
+	if (argc > 2)
+		successTrap = std::strtol(argv[2], nullptr, 0);
+
+	BasicCPU<Policy> &cpu = machine.cpu;
+	if (!jit)
+		cpu.EnableJit(false);
+	if constexpr (Policy::Tracing)
+	{
+		if (tracer)
+			cpu.SetTracer(tracer);
+	}
+	if constexpr (Policy::Profiling)
+	{
+		if (profiler)
+			cpu.SetProfiler(profiler);
+	}
+#ifdef OTWO_AOT_PROGRAM
+	if constexpr (BasicCPU<Policy>::NativeCode)
+		cpu.LoadCompiledProgram(compiledProgram);
+#endif
+
+	if (warm && warm->Resume(machine, maxCycles))
+		std::cout << "Resumed from a warm start at cycle " << cpu.Cycles() << std::endl;
+
+	auto start = std::chrono::steady_clock::now();
+	uint64_t startCycles = cpu.Cycles();
+	RunResult result;
+	do
+	{
+		result = warm ? warm->RunFor(machine, maxCycles - cpu.Cycles()) : cpu.RunFor(maxCycles - cpu.Cycles());
+		if (result.reason == StopReason::UnknownOpcode)
+			std::cout << "Unknown instruction : " << std::hex << (int)memory.Peek(result.address)
+					  << " at " << result.address << '\n';
+	} while (result.reason == StopReason::UnknownOpcode && cpu.Cycles() < maxCycles);
+	std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+	if (devices.console)
+		devices.console->Flush();
+	if (devices.console && devices.console->WriteCalls() > 0)
+		std::cout << devices.console->BytesWritten() << " bytes written to the console in "
+				  << devices.console->WriteCalls() << " writes" << std::endl;
+	if (tracer && tracer->Dropped() > 0)
+		std::cout << tracer->Dropped() << " trace records dropped" << std::endl;
+
+	if (warm && warm->Saved())
+		std::cout << "Saved a warm start" << std::endl;
+	std::cout << "Stopped at " << std::hex << result.address << ": " << StopReasonName(result.reason) << std::endl;
+
+	double cyclesPerSecond = (cpu.Cycles() - startCycles) / elapsed.count();
+	std::cout << std::dec << cpu.Cycles() - startCycles << " cycles in " << elapsed.count() << " s: "
+			  << cyclesPerSecond << " cycles/s (" << cyclesPerSecond / 1e6 << "x a 1 MHz 6502)" << std::endl;
+
+	if (successTrap >= 0)
+		return (result.reason == StopReason::Trap && result.address == successTrap) ? 0 : 1;
 
-		Z = (Y == val) ? 1 : 0;
-		C = (Y >= val) ? 1 : 0;
-		N = ((Y - val) & 0b10000000) ? 1 : 0;
-	}
+	return 0;
+}
 
-	void DEC(uint8_t itx)
-	{
-		uint8_t val = 0;
-		switch (itx)
-		{
-		case DEC_ZP:
-		{
-			val = FetchByteZP() - 1;
-			WriteZPLastPC(val);
-		}
-		break;
-		case DEC_ZPX:
-		{
-			val = FetchByteZPX() - 1;
-			WriteZPXLastPC(val);
-		}
-		break;
-		case DEC_ABS:
-		{
-			val = FetchByteAbsolute() - 1;
-			WriteAbsoluteLastPC(val);
-		}
-		break;
-		case DEC_ABSX:
-		{
-			val = FetchByteAbsoluteX() - 1;
-			WriteAbsoluteXLastPC(val);
-		}
-		break;
+int main(int argc, char **argv)
+{
+	// OTwo --batch <job list> [threads]; see batch.h for the format.
+	// --lockstep takes the same arguments and runs jobs with the same
+	// start and budget in lockstep.
+	if (argc > 2 && (std::string(argv[1]) == "--batch" || std::string(argv[1]) == "--lockstep"))
+		return RunBatchMode(argv[2], argc > 3 ? std::strtoul(argv[3], nullptr, 0) : 0, std::string(argv[1]) == "--lockstep");
+
+	// OTwo --warm <pc> [...] saves the machine the first time it reaches pc
+	// and resumes from there on later runs; see warmstart.h. --trace <file>
+	// writes every instruction to a binary trace; see trace.h. --profile
+	// <file> prints the hottest addresses and opcodes, writes the folded
+	// call stacks to the file and the opcode pair counts for OTwoFuse to
+	// <file>.pairs; see profiler.h. --console <address> maps a buffered
+	// output device for the program onto stdout; see console.h. --input
+	// <address> maps an input device fed from stdin, on IRQ line 0; see
+	// inputqueue.h. --timer <address> maps a device that schedules events
+	// for the program, on IRQ line 1; see timer.h. --image
+	// <file>[@address][:rom] runs that image instead of the functional test,
+	// mapped as in a batch job list. --no-jit interprets everything, for testing the
+	// interpreter on a build that has the translator. --check <cycles>
+	// [seed] compares RunFor against stepping for that many cycles.
+	// --rewind <megabytes> runs under time travel and then takes debugger
+	// commands from stdin; see RunRewindMode. --check-trace <file> checks a
+	// trace of the functional test against stepping. --check-snapshots
+	// <cycles> [seed] saves and loads machines along a run.
+	std::optional<WarmStart> warm;
+	std::optional<Tracer> tracer;
+	std::optional<Profiler> profiler;
+	std::string profilePath;
+	std::optional<Console> console;
+	std::optional<InputQueue> input;
+	std::optional<Timer> timer;
+	std::thread inputReader;
+	Devices devices;
+	bool jit = true;
+	size_t rewindCap = 0;
+	// The functional test keeps its variables inside the image, so it is
+	// mapped writable (copy-on-write).
+	Memory::Image image{ "6502_functional_test.bin", 0x0000, true };
+	while ((argc > 1 && std::string(argv[1]) == "--no-jit") ||
+		   (argc > 2 && (std::string(argv[1]) == "--warm" || std::string(argv[1]) == "--trace" ||
+						 std::string(argv[1]) == "--profile" || std::string(argv[1]) == "--console" ||
+						 std::string(argv[1]) == "--input" || std::string(argv[1]) == "--rewind" ||
+						 std::string(argv[1]) == "--timer" || std::string(argv[1]) == "--image")))
+	{
+		if (std::string(argv[1]) == "--no-jit")
+		{
+			jit = false;
+			argc--;
+			argv++;
+			continue;
+		}
+		if (std::string(argv[1]) == "--warm")
+			warm.emplace(std::strtoul(argv[2], nullptr, 0));
+		else if (std::string(argv[1]) == "--trace")
+			tracer.emplace(argv[2]);
+		else if (std::string(argv[1]) == "--console")
+		{
+			uint64_t address;
+			if (!ParseNumber(argv[2], 0xFFFF, address))
+			{
+				std::cout << "Bad console address " << argv[2] << std::endl;
+				return 1;
+			}
+			console.emplace();
+			devices.console = &*console;
+			devices.consoleAddress = uint16_t(address);
 		}
-
-		Z = (val == 0) ? 1 : 0;
-		N = (val & 0b10000000) ? 1 : 0;
-	}
-
-	void INC(uint8_t itx)
-	{
-		uint8_t val = 0;
-		switch (itx)
-		{
-		case INC_ZP:
+		else if (std::string(argv[1]) == "--input")
 		{
-			val = FetchByteZP() + 1;
-			WriteZPLastPC(val);
+			uint64_t address;
+			if (!ParseNumber(argv[2], 0xFFFF, address))
+			{
+				std::cout << "Bad input address " << argv[2] << std::endl;
+				return 1;
+			}
+			input.emplace();
+			devices.input = &*input;
+			devices.inputAddress = uint16_t(address);
 		}
-		break;
-		case INC_ZPX:
+		else if (std::string(argv[1]) == "--timer")
 		{
-			val = FetchByteZPX() + 1;
-			WriteZPXLastPC(val);
+			uint64_t address;
+			if (!ParseNumber(argv[2], 0xFFFF, address))
+			{
+				std::cout << "Bad timer address " << argv[2] << std::endl;
+				return 1;
+			}
+			timer.emplace();
+			devices.timer = &*timer;
+			devices.timerAddress = uint16_t(address);
 		}
-		break;
-		case INC_ABS:
+		else if (std::string(argv[1]) == "--image")
 		{
-			val = FetchByteAbsolute() + 1;
-			WriteAbsoluteLastPC(val);
+			if (!ParseImage(argv[2], image))
+			{
+				std::cout << "Bad image " << argv[2] << std::endl;
+				return 1;
+			}
 		}
-		break;
-		case INC_ABSX:
+		else if (std::string(argv[1]) == "--rewind")
+			rewindCap = std::max<size_t>(std::strtoull(argv[2], nullptr, 0), 1) << 20;
+		else
 		{
-			val = FetchByteAbsoluteX() + 1;
-			WriteAbsoluteXLastPC(val);
+			profiler.emplace();
+			profilePath = argv[2];
 		}
-		break;
-		}
-
-		Z = (val == 0) ? 1 : 0;
-		N = (val & 0b10000000) ? 1 : 0;
+		argc -= 2;
+		argv += 2;
 	}
-
-	void JSR()
+	if (argc > 2 && std::string(argv[1]) == "--check")
+		return RunCheckMode(std::strtoull(argv[2], nullptr, 0), argc > 3 ? std::strtoull(argv[3], nullptr, 0) : 1, jit);
+	if (argc > 2 && std::string(argv[1]) == "--check-snapshots")
+		return RunSnapshotCheckMode(std::strtoull(argv[2], nullptr, 0), argc > 3 ? std::strtoull(argv[3], nullptr, 0) : 1,
+									jit);
+	if (argc > 2 && std::string(argv[1]) == "--check-trace")
+		return RunTraceCheckMode(argv[2]);
+	if (rewindCap > 0)
+		return RunRewindMode(rewindCap, argc, argv);
+	if (tracer && !tracer->IsOpen())
 	{
-		uint16_t pc = PC - 1;
-		StackPush(pc >> 8);
-		StackPush(pc & 0xFF);
-
-		PC = FetchWord();
+		std::cout << "Failed to open the trace file" << std::endl;
+		return 1;
 	}
 
-	void RTS()
-	{
-		uint16_t pc = StackPop() << 8 | StackPop();
-		PC = pc + 1;
-	}
+	if (input)
+		inputReader = std::thread([&input] { input->Feed(0); });
 
-	void RTI()
+	// Tracing and profiling are compiled out of the CPU that plain runs use.
+	Profiler *profiling = profiler ? &*profiler : nullptr;
+	int status;
+	if (tracer)
 	{
-		uint8_t P = StackPop();
-		C = (P & 0b00000001) == 1 ? 1 : 0;
-		Z = (P & 0b00000010) == 1 ? 1 : 0;
-		I = (P & 0b00000100) == 1 ? 1 : 0;
-		D = (P & 0b00001000) == 1 ? 1 : 0;
-		B = (P & 0b00010000) == 1 ? 1 : 0;
-		V = (P & 0b01000000) == 1 ? 1 : 0;
-		N = (P & 0b10000000) == 1 ? 1 : 0;
-
-		PC = StackPop() << 8 | StackPop();
+		DebugMachine machine;
+		status = RunImage(machine, argc, argv, image, warm, &*tracer, profiling, devices, jit);
 	}
-
-	void STA(uint8_t itx)
+	else if (profiler)
 	{
-		switch (itx)
-		{
-		case STA_ZP:
-		{
-			uint8_t val = FetchByteZP();
-			memory->WriteByte(val, A);
-		}
-		break;
-		case STA_ZPX:
-		{
-			uint8_t val = FetchByteZPX();
-			memory->WriteByte(val, A);
-		}
-		break;
-		case STA_ABS:
-		{
-			uint8_t val = FetchByteAbsolute();
-			memory->WriteByte(val, A);
-		}
-		break;
-		case STA_ABSX:
-		{
-			uint8_t val = FetchByteAbsoluteX();
-			memory->WriteByte(val, A);
-		}
-		break;
-		case STA_ABSY:
-		{
-			uint8_t val = FetchByteAbsoluteY();
-			memory->WriteByte(val, A);
-		}
-		break;
-		case STA_INDX:
-		{
-			uint8_t val = FetchByteIndirectX();
-			memory->WriteByte(val, A);
-		}
-		break;
-		case STA_INDY:
-		{
-			uint8_t val = FetchByteIndirectY();
-			memory->WriteByte(val, A);
-		}
-		break;
-		}
+		ProfileMachine machine;
+		status = RunImage(machine, argc, argv, image, warm, nullptr, profiling, devices, jit);
 	}
-
-	void STX(uint8_t itx)
+	else
 	{
-		switch (itx)
-		{
-		case STX_ZP:
-		{
-			uint8_t val = FetchByteZP();
-			memory->WriteByte(val, X);
-		}
-		break;
-		case STX_ZPY:
-		{
-			uint8_t val = FetchByteZPY();
-			memory->WriteByte(val, X);
-		}
-		break;
-		case STX_ABS:
-		{
-			uint8_t val = FetchByteAbsolute();
-			memory->WriteByte(val, X);
-		}
-		break;
-		}
+		Machine machine;
+		status = RunImage(machine, argc, argv, image, warm, nullptr, nullptr, devices, jit);
 	}
 
-	void STY(uint8_t itx)
+	if (input)
 	{
-		switch (itx)
-		{
-		case STY_ZP:
-		{
-			uint8_t val = FetchByteZP();
-			memory->WriteByte(val, Y);
-		}
-		break;
-		case STY_ZPX:
-		{
-			uint8_t val = FetchByteZPX();
-			memory->WriteByte(val, Y);
-		}
-		break;
-		case STY_ABS:
-		{
-			uint8_t val = FetchByteAbsolute();
-			memory->WriteByte(val, Y);
-		}
-		break;
-		}
+		input->Stop();
+		inputReader.join();
 	}
 
-	void Run()
+	if (profiler)
 	{
-		while (true)
-		{
-			auto itx = FetchInstruction();
-
-			switch (itx)
-			{
-			case ADC_IMM:
-			case ADC_ZP:
-			case ADC_ZPX:
-			case ADC_ABS:
-			case ADC_ABSX:
-			case ADC_ABSY:
-			case ADC_INDX:
-			case ADC_INDY:
-				ADC(itx);
-				break;
-
-			case SBC_IMM:
-			case SBC_ZP:
-			case SBC_ZPX:
-			case SBC_ABS:
-			case SBC_ABSX:
-			case SBC_ABSY:
-			case SBC_INDX:
-			case SBC_INDY:
-				SBC(itx);
-				break;
-
-			case LDA_IMM:
-			case LDA_ZP:
-			case LDA_ZPX:
-			case LDA_ABS:
-			case LDA_ABSX:
-			case LDA_ABSY:
-			case LDA_INDX:
-			case LDA_INDY:
-				LDA(itx);
-				break;
-
-			case LDX_IMM:
-			case LDX_ZP:
-			case LDX_ZPY:
-			case LDX_ABS:
-			case LDX_ABSY:
-				LDX(itx);
-				break;
-
-			case LDY_IMM:
-			case LDY_ZP:
-			case LDY_ZPX:
-			case LDY_ABS:
-			case LDY_ABSX:
-				LDY(itx);
-				break;
-
-			case AND_IMM:
-			case AND_ZP:
-			case AND_ZPX:
-			case AND_ABS:
-			case AND_ABSX:
-			case AND_ABSY:
-			case AND_INDX:
-			case AND_INDY:
-				AND(itx);
-				break;
-
-			case ORA_IMM:
-			case ORA_ZP:
-			case ORA_ZPX:
-			case ORA_ABS:
-			case ORA_ABSX:
-			case ORA_ABSY:
-			case ORA_INDX:
-			case ORA_INDY:
-				ORA(itx);
-				break;
-
-			case EOR_IMM:
-			case EOR_ZP:
-			case EOR_ZPX:
-			case EOR_ABS:
-			case EOR_ABSX:
-			case EOR_ABSY:
-			case EOR_INDX:
-			case EOR_INDY:
-				EOR(itx);
-				break;
-
-			case NOP_IMP:
-				break;
-
-			case JMP_ABS:
-			case JMP_IND:
-				JMP(itx);
-				break;
-
-			case PHA_IMP:
-				PHA();
-				break;
-			case PHP_IMP:
-				PHP();
-				break;
-			case PLA_IMP:
-				PLA();
-				break;
-			case PLP_IMP:
-				PLP();
-				break;
-
-			case ASL_ACC:
-			case ASL_ZP:
-			case ASL_ZPX:
-			case ASL_ABS:
-			case ASL_ABSX:
-				ASL(itx);
-				break;
-
-			case LSR_ACC:
-			case LSR_ZP:
-			case LSR_ZPX:
-			case LSR_ABS:
-			case LSR_ABSX:
-				LSR(itx);
-				break;
-
-			case ROL_ACC:
-			case ROL_ZP:
-			case ROL_ZPX:
-			case ROL_ABS:
-			case ROL_ABSX:
-				ROL(itx);
-				break;
-
-			case ROR_ACC:
-			case ROR_ZP:
-			case ROR_ZPX:
-			case ROR_ABS:
-			case ROR_ABSX:
-				ROR(itx);
-				break;
-
-			case BCC_REL:
-				BCC();
-				break;
-			case BCS_REL:
-				BCS();
-				break;
-			case BEQ_REL:
-				BEQ();
-				break;
-			case BNE_REL:
-				BNE();
-				break;
-			case BMI_REL:
-				BMI();
-				break;
-			case BPL_REL:
-				BPL();
-				break;
-			case BVC_REL:
-				BVC();
-				break;
-			case BVS_REL:
-				BVS();
-				break;
-
-			case BIT_ZP:
-			case BIT_ABS:
-				BIT(itx);
-				break;
-
-			case BRK_IMP:
-				BRK();
-				break;
-			case CLC_IMP:
-				C = 0;
-				break;
-			case CLD_IMP:
-				D = 0;
-				break;
-			case CLI_IMP:
-				I = 0;
-				break;
-			case CLV_IMP:
-				V = 0;
-				break;
-			case SEC_IMP:
-				C = 1;
-				break;
-			case SED_IMP:
-				D = 1;
-				break;
-			case SEI_IMP:
-				I = 1;
-				break;
-
-			case CMP_IMM:
-			case CMP_ZP:
-			case CMP_ZPX:
-			case CMP_ABS:
-			case CMP_ABSX:
-			case CMP_ABSY:
-			case CMP_INDX:
-			case CMP_INDY:
-				CMP(itx);
-				break;
-
-			case CPX_IMM:
-			case CPX_ZP:
-			case CPX_ABS:
-				CPX(itx);
-				break;
-
-			case CPY_IMM:
-			case CPY_ZP:
-			case CPY_ABS:
-				CPY(itx);
-				break;
-
-			case DEC_ZP:
-			case DEC_ZPX:
-			case DEC_ABS:
-			case DEC_ABSX:
-				DEC(itx);
-				break;
-
-			case DEX_IMP:
-			{
-				X--;
-				N = (X & 0b10000000) ? 1 : 0;
-				Z = (X == 0) ? 1 : 0;
-			}
-			break;
-			case DEY_IMP:
-			{
-				Y--;
-				N = (Y & 0b10000000) ? 1 : 0;
-				Z = (Y == 0) ? 1 : 0;
-			}
-			break;
-
-			case INC_ZP:
-			case INC_ZPX:
-			case INC_ABS:
-			case INC_ABSX:
-				INC(itx);
-				break;
-
-			case INX_IMP:
-				X++;
-				N = (X & 0b10000000) ? 1 : 0;
-				Z = (X == 0) ? 1 : 0;
-				break;
-			case INY_IMP:
-				Y++;
-				N = (Y & 0b10000000) ? 1 : 0;
-				Z = (Y == 0) ? 1 : 0;
-				break;
-
-			case JSR_ABS:
-				JSR();
-				break;
-			case RTS_IMP:
-				RTS();
-				break;
-			case RTI_IMP:
-				RTI();
-				break;
-
-			case STA_ZP:
-			case STA_ZPX:
-			case STA_ABS:
-			case STA_ABSX:
-			case STA_ABSY:
-			case STA_INDX:
-			case STA_INDY:
-				STA(itx);
-				break;
-
-			case STX_ZP:
-			case STX_ZPY:
-			case STX_ABS:
-				STX(itx);
-				break;
-
-			case STY_ZP:
-			case STY_ZPX:
-			case STY_ABS:
-				STY(itx);
-				break;
-
-			case TAX_IMP:
-			{
-				X = A;
-				N = (X & 0b10000000) ? 1 : 0;
-				Z = (X == 0) ? 1 : 0;
-			}
-			break;
-
-			case TAY_IMP:
-			{
-				Y = A;
-				N = (Y & 0b10000000) ? 1 : 0;
-				Z = (Y == 0) ? 1 : 0;
-			}
-			break;
-
-			case TSX_IMP:
-			{
-				X = S;
-				N = (X & 0b10000000) ? 1 : 0;
-				Z = (X == 0) ? 1 : 0;
-			}
-			break;
-
-			case TXA_IMP:
-			{
-				A = X;
-				N = (A & 0b10000000) ? 1 : 0;
-				Z = (A == 0) ? 1 : 0;
-			}
-			break;
-
-			case TXS_IMP:
-			{
-				S = X;
-			}
-			break;
-
-			case TYA_IMP:
-			{
-				A = Y;
-				N = (A & 0b10000000) ? 1 : 0;
-				Z = (A == 0) ? 1 : 0;
-			}
-			break;
-
-			default:
-				std::cout << "Unknown instruction : " << std::hex << itx << std::endl;
-				break;
-			}
-		}
-	}
-
-private:
-	Memory *memory;
-	uint16_t PC{};	  // program counter
-	uint8_t A{};	  // accumulator
-	uint8_t X{};	  // x index
-	uint8_t Y{};	  // y index
-	uint8_t S{};	  // stack pointer
-	uint8_t N : 1 {}; // negative flag
-	uint8_t V : 1 {}; // overflow flag
-	uint8_t B : 1 {}; // break flag
-	uint8_t D : 1 {}; // decimal flag
-	uint8_t I : 1 {}; // interupt disable flag
-	uint8_t Z : 1 {}; // zero flag
-	uint8_t C : 1 {}; // carry flag
-};
-
-int main(int argc, char **argv)
-{
-	Memory memory;
-	if (!memory.LoadFromFile("6502_functional_test.bin"))
-	{
-		std::cout << "Failed to load memory" << std::endl;
-		return 1;
+		profiler->WriteSummary(std::cout, 10);
+		if (!profiler->WriteFolded(profilePath) || !profiler->WritePairs(profilePath + ".pairs"))
+			std::cout << "Failed to write the profile to " << profilePath << std::endl;
 	}
-
-	// int i = 0;
-	// memory.WriteByte(0xFF + i++, LDA_IMM);
-	// memory.WriteByte(0xFF + i++, 0x32);
-	// memory.WriteByte(0xFF + i++, ADC_IMM);
-	// memory.WriteByte(0xFF + i++, 0x23);
-
-	CPU cpu(&memory);
-
-	cpu.Run();
-
-	return 0;
+	return status;
 }
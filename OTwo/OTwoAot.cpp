@@ -0,0 +1,208 @@
+#include <array>
+#include <bitset>
+#include <cstdint>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "blockcache.h"
+#include "defines.h"
+#include "memory.h"
+#include "opcodes.h"
+
+// Compiles the code of an image ahead of time into C++: every block that
+// can be reached from the reset vector (and from any extra entry points
+// given) becomes a function that runs its instructions through the CPU
+// handlers with every PC and operand known, so there is nothing left to
+// dispatch or decode.
+// Code reached only through returns, interrupts or indirect jumps through
+// pointers set at run time, or written at run time, is left to the
+// interpreter.
+//
+// Usage: OTwoAot <image> <load address> <output.cpp> [entry point...]
+
+namespace
+{
+
+struct OpcodeInfo
+{
+	const char *handler;
+	uint8_t cycles;
+};
+
+std::array<OpcodeInfo, 256> BuildOpcodeInfo()
+{
+	std::array<OpcodeInfo, 256> table{};
+	// Undocumented opcodes are two-cycle no-ops that stop the CPU.
+	table.fill({ "Unknown", 2 });
+#define OTWO_OPCODE_INFO(opcode, handler, bytes, base_cycles) table[opcode] = { #handler, base_cycles };
+	OTWO_OPCODES(OTWO_OPCODE_INFO)
+#undef OTWO_OPCODE_INFO
+	return table;
+}
+
+bool IsBranch(uint8_t opcode)
+{
+	switch (opcode)
+	{
+	case BCC_REL:
+	case BCS_REL:
+	case BEQ_REL:
+	case BNE_REL:
+	case BMI_REL:
+	case BPL_REL:
+	case BVC_REL:
+	case BVS_REL:
+		return true;
+	}
+	return false;
+}
+
+// Appends the addresses control can go to after the block.
+void AddSuccessors(Memory &memory, const Block &block, std::vector<uint16_t> &pending)
+{
+	const DecodedInstruction &last = block.instructions.back();
+	bool fallsThrough = true;
+	if (IsBranch(last.opcode))
+		pending.push_back(uint16_t(block.end + (int8_t)last.operand));
+	switch (last.opcode)
+	{
+	case JMP_ABS:
+		pending.push_back(last.operand);
+		fallsThrough = false;
+		break;
+	case JSR_ABS:
+		// The subroutine normally returns to the next instruction.
+		pending.push_back(last.operand);
+		break;
+	case BRK_IMP:
+		// The handler normally returns past the byte after the BRK.
+		pending.push_back(memory.ReadWord(0xFFFE));
+		pending.push_back(uint16_t(block.end + 1));
+		fallsThrough = false;
+		break;
+	case JMP_IND:
+		// The pointer may change at run time, but the target it holds in
+		// the image is the likeliest one.
+		pending.push_back(memory.ReadByte(last.operand) | (memory.ReadByte((last.operand & 0xFF00) | ((last.operand + 1) & 0xFF)) << 8));
+		fallsThrough = false;
+		break;
+	case RTS_IMP:
+	case RTI_IMP:
+		fallsThrough = false;
+		break;
+	}
+	if (fallsThrough && block.end <= 0xFFFF)
+		pending.push_back(uint16_t(block.end));
+}
+
+std::string Hex(unsigned value, int digits)
+{
+	static const char digitChars[] = "0123456789ABCDEF";
+	std::string text = "0x";
+	for (int i = digits - 1; i >= 0; i--)
+		text += digitChars[(value >> (4 * i)) & 0xF];
+	return text;
+}
+
+void EmitBlock(std::ostream &out, Memory &memory, const Block &block, const std::array<OpcodeInfo, 256> &opcodes)
+{
+	std::string name = Hex(block.start, 4).substr(2);
+
+	out << "const uint8_t code" << name << "[] = {";
+	for (uint32_t address = block.start; address < block.end; address++)
+		out << (address == block.start ? " " : ", ") << Hex(memory.ReadByte(address), 2);
+	out << " };\n\n";
+
+	out << "uint32_t Run" << name << "(CPU &cpu)\n{\n";
+	for (size_t i = 0; i < block.instructions.size(); i++)
+	{
+		const DecodedInstruction &instruction = block.instructions[i];
+		const OpcodeInfo &info = opcodes[instruction.opcode];
+		// The operand fetch a handler is specialized on is replaced by the
+		// one that takes the operand as a constant.
+		std::string handler = info.handler;
+		if (handler.back() == '>')
+			handler.insert(handler.size() - 1, "<" + Hex(instruction.operand, instruction.bytes == 2 ? 2 : 4) + ">");
+		std::string step = "cpu.CompiledStep<&CPU::" + handler + ", " +
+						   std::to_string(info.cycles) + ">(" + Hex(uint16_t(instruction.address + 1), 4) + ")";
+		if (i + 1 < block.instructions.size())
+			out << "\tif (!" << step << ")\n\t\treturn " << i + 1 << ";\n";
+		else
+			out << "\t" << step << ";\n";
+	}
+	out << "\treturn " << block.instructions.size() << ";\n}\n\n";
+}
+
+}
+
+int main(int argc, char **argv)
+{
+	if (argc < 4)
+	{
+		std::cerr << "Usage: " << argv[0] << " <image> <load address> <output.cpp> [entry point...]" << std::endl;
+		return 1;
+	}
+
+	Memory memory;
+	uint16_t loadAddress = (uint16_t)std::strtoul(argv[2], nullptr, 0);
+	if (!memory.LoadImages({ { argv[1], loadAddress, false } }))
+	{
+		std::cerr << "Failed to load " << argv[1] << std::endl;
+		return 1;
+	}
+
+	std::vector<uint16_t> pending = { memory.ReadWord(0xFFFC) };
+	for (int i = 4; i < argc; i++)
+		pending.push_back((uint16_t)std::strtoul(argv[i], nullptr, 0));
+
+	// Blocks are found with the same decoder the CPU uses, so that each
+	// one matches the block the CPU decodes at run time.
+	BlockCache cache(&memory);
+	std::bitset<0x10000> visited;
+	std::map<uint16_t, const Block *> blocks;
+	while (!pending.empty())
+	{
+		uint16_t address = pending.back();
+		pending.pop_back();
+		if (visited[address])
+			continue;
+		visited[address] = true;
+
+		const Block *block = cache.Lookup(address);
+		if (!block)
+			continue;
+		blocks[address] = block;
+		AddSuccessors(memory, *block, pending);
+	}
+
+	std::ofstream out(argv[3]);
+	if (!out)
+	{
+		std::cerr << "Failed to open " << argv[3] << std::endl;
+		return 1;
+	}
+
+	const std::array<OpcodeInfo, 256> opcodes = BuildOpcodeInfo();
+	out << "// Generated by OTwoAot from " << argv[1] << " loaded at " << Hex(loadAddress, 4) << ". Do not edit.\n\n";
+	out << "#include \"aot.h\"\n#include \"cpu.h\"\n\nnamespace\n{\n\n";
+	for (const auto &[address, block] : blocks)
+		EmitBlock(out, memory, *block, opcodes);
+
+	out << "const CompiledBlock blocks[] = {\n";
+	for (const auto &[address, block] : blocks)
+	{
+		std::string name = Hex(address, 4).substr(2);
+		out << "\t{ " << Hex(address, 4) << ", " << block->end - block->start << ", code" << name << ", Run" << name << " },\n";
+	}
+	if (blocks.empty())
+		out << "\t{},\n";
+	out << "};\n\n}\n\n";
+	out << "extern const CompiledProgram compiledProgram = { blocks, " << blocks.size() << " };\n";
+
+	std::cout << "Compiled " << blocks.size() << " blocks to " << argv[3] << std::endl;
+	return out.good() ? 0 : 1;
+}
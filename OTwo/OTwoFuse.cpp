@@ -0,0 +1,135 @@
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "blockcache.h"
+#include "defines.h"
+#include "opcodes.h"
+
+// Picks the opcode pairs the block decoder fuses into one handler from
+// profile data, and writes them out as fusion.h. The input is the pair
+// counts that OTwo --profile writes; several profiles are added together.
+// A pair whose first instruction ends a block never runs back to back in
+// straight-line code, so it is left out. Of the rest, the most executed
+// are taken, as long as each ran as at least MinShare of all instructions.
+//
+// Usage: OTwoFuse <fusion.h> <max pairs> <pairs file>...
+//
+// The fusion.h in the tree was made from a profile of the functional test:
+//   OTwo --profile test.folded 0 0x3469
+//   OTwoFuse fusion.h 16 test.folded.pairs
+
+namespace
+{
+
+constexpr double MinShare = 0.001;
+
+struct OpcodeInfo
+{
+	const char *name;
+	const char *handler;
+	uint8_t cycles;
+};
+
+std::array<OpcodeInfo, 256> BuildOpcodeInfo()
+{
+	std::array<OpcodeInfo, 256> table{};
+#define OTWO_OPCODE_INFO(opcode, handler, bytes, base_cycles) table[opcode] = { #opcode, #handler, base_cycles };
+	OTWO_OPCODES(OTWO_OPCODE_INFO)
+#undef OTWO_OPCODE_INFO
+	return table;
+}
+
+struct Pair
+{
+	uint8_t first;
+	uint8_t second;
+	uint64_t count;
+};
+
+}
+
+int main(int argc, char **argv)
+{
+	if (argc < 4)
+	{
+		std::cerr << "Usage: " << argv[0] << " <fusion.h> <max pairs> <pairs file>..." << std::endl;
+		return 1;
+	}
+
+	const std::array<OpcodeInfo, 256> opcodes = BuildOpcodeInfo();
+	std::map<std::string, uint8_t> opcodeByName;
+	for (int opcode = 0; opcode < 256; opcode++)
+		if (opcodes[opcode].name)
+			opcodeByName[opcodes[opcode].name] = opcode;
+
+	std::vector<uint64_t> counts(0x10000);
+	uint64_t total = 0;
+	for (int i = 3; i < argc; i++)
+	{
+		std::ifstream file(argv[i]);
+		if (!file)
+		{
+			std::cerr << "Failed to open " << argv[i] << std::endl;
+			return 1;
+		}
+		std::string first, second;
+		uint64_t count;
+		while (file >> first >> second >> count)
+		{
+			total += count;
+			auto a = opcodeByName.find(first);
+			auto b = opcodeByName.find(second);
+			if (a != opcodeByName.end() && b != opcodeByName.end())
+				counts[(a->second << 8) | b->second] += count;
+		}
+		if (!file.eof())
+		{
+			std::cerr << argv[i] << ": not a pair count file" << std::endl;
+			return 1;
+		}
+	}
+
+	std::vector<Pair> pairs;
+	for (uint32_t pair = 0; pair < counts.size(); pair++)
+		if (counts[pair] > 0 && counts[pair] >= total * MinShare && !BlockCache::EndsBlock(pair >> 8))
+			pairs.push_back({ uint8_t(pair >> 8), uint8_t(pair), counts[pair] });
+	std::sort(pairs.begin(), pairs.end(), [](const Pair &a, const Pair &b) { return a.count > b.count; });
+	pairs.resize(std::min<size_t>(pairs.size(), std::strtoul(argv[2], nullptr, 0)));
+
+	std::ofstream out(argv[1]);
+	if (!out)
+	{
+		std::cerr << "Failed to open " << argv[1] << std::endl;
+		return 1;
+	}
+
+	out << "#pragma once\n\n";
+	out << "// Generated by OTwoFuse from profile data. Do not edit; see OTwoFuse.cpp\n";
+	out << "// to regenerate it.\n//\n";
+	out << "// Opcode pairs the block decoder fuses into one handler, most executed\n";
+	out << "// first, as FUSED(first, its handler, its cycles, second, its handler,\n";
+	out << "// its cycles), each with the share of the profiled instructions that ran\n";
+	out << "// as the pair.\n";
+	out << "#define OTWO_FUSED_PAIRS(FUSED)";
+	for (const Pair &pair : pairs)
+	{
+		const OpcodeInfo &first = opcodes[pair.first];
+		const OpcodeInfo &second = opcodes[pair.second];
+		char share[16];
+		std::snprintf(share, sizeof(share), "%.2f%%", 100.0 * pair.count / total);
+		out << " \\\n\tFUSED(" << first.name << ", " << first.handler << ", " << int(first.cycles) << ", "
+			<< second.name << ", " << second.handler << ", " << int(second.cycles) << ") /* " << share << " */";
+	}
+	out << "\n";
+
+	std::cout << "Fused " << pairs.size() << " pairs into " << argv[1] << std::endl;
+	return out.good() ? 0 : 1;
+}
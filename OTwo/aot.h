@@ -0,0 +1,22 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+
+#include "cpupolicy.h"
+
+// A block compiled to C++ ahead of time by the OTwoAot tool. Its code is
+// only run while memory still holds the bytes it was compiled from and the
+// block decoded there has the same length.
+struct CompiledBlock {
+	uint16_t start;
+	uint16_t size;
+	const uint8_t* code; // the bytes the block was compiled from
+	// Executes the block and returns how many instructions ran; fewer than
+	// all of them when an instruction ends the batch.
+	uint32_t (*run)(CPU& cpu);
+};
+
+struct CompiledProgram {
+	const CompiledBlock* blocks;
+	size_t count;
+};
@@ -0,0 +1,365 @@
+#include "batch.h"
+#include <algorithm>
+#include <cstdlib>
+#include <map>
+#include <mutex>
+#include <sstream>
+#include <tuple>
+
+#include "lockstep.h"
+#include "machine.h"
+#include "threadpool.h"
+#include "warmstart.h"
+
+namespace {
+
+bool ParseCapture(const std::string& text, Capture& capture)
+{
+    static const std::pair<const char*, Capture::Kind> names[] = {
+        { "a", Capture::Kind::A },
+        { "x", Capture::Kind::X },
+        { "y", Capture::Kind::Y },
+        { "s", Capture::Kind::S },
+        { "p", Capture::Kind::P },
+        { "pc", Capture::Kind::PC },
+        { "cycles", Capture::Kind::Cycles },
+        { "instructions", Capture::Kind::Instructions },
+    };
+    for (const auto& [name, kind] : names) {
+        if (text == name) {
+            capture.kind = kind;
+            return true;
+        }
+    }
+
+    if (text.rfind("mem:", 0) != 0) {
+        return false;
+    }
+    capture.kind = Capture::Kind::Memory;
+    std::string range = text.substr(4);
+    uint64_t address = 0;
+    uint64_t size = 1;
+    size_t colon = range.find(':');
+    if (colon != std::string::npos) {
+        if (!ParseNumber(range.substr(colon + 1), 0x10000, size) || size == 0) {
+            return false;
+        }
+        range.resize(colon);
+    }
+    if (!ParseNumber(range, 0xFFFF, address)) {
+        return false;
+    }
+    capture.address = (uint16_t)address;
+    capture.size = (uint32_t)std::min<uint64_t>(size, 0x10000 - address);
+    return true;
+}
+
+std::string Hex(uint64_t value, int digits)
+{
+    std::ostringstream text;
+    text << std::hex;
+    text.width(digits);
+    text.fill('0');
+    text << value;
+    return text.str();
+}
+
+std::string FormatCaptures(Machine& machine, const std::vector<Capture>& captures)
+{
+    const CPU& cpu = machine.cpu;
+    std::string text;
+    for (const Capture& capture : captures) {
+        if (!text.empty()) {
+            text += ' ';
+        }
+        switch (capture.kind) {
+        case Capture::Kind::A:
+            text += "a=" + Hex(cpu.Accumulator(), 2);
+            break;
+        case Capture::Kind::X:
+            text += "x=" + Hex(cpu.IndexX(), 2);
+            break;
+        case Capture::Kind::Y:
+            text += "y=" + Hex(cpu.IndexY(), 2);
+            break;
+        case Capture::Kind::S:
+            text += "s=" + Hex(cpu.StackPointer(), 2);
+            break;
+        case Capture::Kind::P:
+            text += "p=" + Hex(cpu.Status(), 2);
+            break;
+        case Capture::Kind::PC:
+            text += "pc=" + Hex(cpu.ProgramCounter(), 4);
+            break;
+        case Capture::Kind::Cycles:
+            text += "cycles=" + std::to_string(cpu.Cycles());
+            break;
+        case Capture::Kind::Instructions:
+            text += "instructions=" + std::to_string(cpu.Instructions());
+            break;
+        case Capture::Kind::Memory:
+            text += "mem[" + Hex(capture.address, 4) + "]=";
+            for (uint32_t i = 0; i < capture.size; i++) {
+                text += Hex(machine.memory.ReadByte(capture.address + i), 2);
+            }
+            break;
+        }
+    }
+    return text;
+}
+
+// Skips unknown opcodes, as a normal run does, until the budget is spent or
+// something else stops the CPU.
+RunResult FinishJob(Machine& machine, const BatchJob& job, RunResult run, WarmStart* warm = nullptr)
+{
+    CPU& cpu = machine.cpu;
+    while (run.reason == StopReason::UnknownOpcode && cpu.Cycles() < job.cycles) {
+        run = warm ? warm->RunFor(machine, job.cycles - cpu.Cycles()) : cpu.RunFor(job.cycles - cpu.Cycles());
+    }
+    return run;
+}
+
+// Builds the job's machine, forked from base when there is one and with
+// the job's images mapped otherwise, and points the CPU at its start.
+// Returns null when the images cannot be mapped.
+std::unique_ptr<Machine> CreateMachine(const BatchJob& job, const std::shared_ptr<const Memory::BaseImage>& base)
+{
+    auto machine = base ? std::make_unique<Machine>(base) : std::make_unique<Machine>();
+    if (!base && !machine->memory.LoadImages(job.images)) {
+        return nullptr;
+    }
+    machine->cpu.Reset();
+    if (!job.startAtReset) {
+        machine->cpu.SetProgramCounter(job.start);
+    }
+    return machine;
+}
+
+BatchResult RunJob(const BatchJob& job, size_t index, const std::shared_ptr<const Memory::BaseImage>& base)
+{
+    BatchResult result{};
+    result.index = index;
+
+    std::unique_ptr<Machine> machine = CreateMachine(job, base);
+    result.loaded = machine != nullptr;
+    if (!result.loaded) {
+        return result;
+    }
+
+    CPU& cpu = machine->cpu;
+    if (job.warmStart) {
+        WarmStart warm(*job.warmStart);
+        warm.Resume(*machine, job.cycles);
+        result.run = FinishJob(*machine, job, warm.RunFor(*machine, job.cycles - cpu.Cycles()), &warm);
+    } else {
+        result.run = FinishJob(*machine, job, cpu.RunFor(job.cycles));
+    }
+    result.captured = FormatCaptures(*machine, job.captures);
+    return result;
+}
+
+// Maps each image list used by more than one job once, for those jobs to
+// fork their memory from. Lists used once, or that fail to map, get none.
+std::vector<std::shared_ptr<const Memory::BaseImage>> ShareImages(const std::vector<BatchJob>& jobs)
+{
+    std::map<std::string, std::vector<size_t>> users;
+    for (size_t i = 0; i < jobs.size(); i++) {
+        std::string key;
+        for (const Memory::Image& image : jobs[i].images) {
+            key += image.path + '@' + std::to_string(image.address) + (image.writable ? "\n" : ":rom\n");
+        }
+        users[key].push_back(i);
+    }
+
+    std::vector<std::shared_ptr<const Memory::BaseImage>> bases(jobs.size());
+    for (const auto& [key, indices] : users) {
+        Memory memory;
+        if (indices.size() < 2 || !memory.LoadImages(jobs[indices[0]].images)) {
+            continue;
+        }
+        std::shared_ptr<const Memory::BaseImage> base = memory.Share();
+        for (size_t index : indices) {
+            bases[index] = base;
+        }
+    }
+    return bases;
+}
+
+
+// Runs jobs that share a start and a cycle budget on one Lockstep.
+void RunLockstepJobs(const std::vector<BatchJob>& jobs, const std::vector<size_t>& indices,
+    const std::vector<std::shared_ptr<const Memory::BaseImage>>& bases,
+    const std::function<void(const BatchResult&)>& report)
+{
+    std::vector<std::unique_ptr<Machine>> machines;
+    std::vector<size_t> loaded;
+    for (size_t index : indices) {
+        std::unique_ptr<Machine> machine = CreateMachine(jobs[index], bases[index]);
+        if (!machine) {
+            BatchResult result{};
+            result.index = index;
+            report(result);
+            continue;
+        }
+        machines.push_back(std::move(machine));
+        loaded.push_back(index);
+    }
+    if (loaded.empty()) {
+        return;
+    }
+
+    const BatchJob& first = jobs[loaded[0]];
+    Lockstep lockstep(std::move(machines));
+    std::vector<RunResult> runs = lockstep.RunFor(first.cycles);
+    for (size_t lane = 0; lane < loaded.size(); lane++) {
+        const BatchJob& job = jobs[loaded[lane]];
+        Machine& machine = lockstep.Lane(lane);
+        BatchResult result{};
+        result.index = loaded[lane];
+        result.loaded = true;
+        result.run = FinishJob(machine, job, runs[lane]);
+        result.captured = FormatCaptures(machine, job.captures);
+        report(result);
+    }
+}
+
+}
+
+bool ParseNumber(const std::string& text, uint64_t max, uint64_t& value)
+{
+    if (text.empty()) {
+        return false;
+    }
+    char* end = nullptr;
+    value = std::strtoull(text.c_str(), &end, 0);
+    return *end == '\0' && value <= max;
+}
+
+bool ParseImage(std::string text, Memory::Image& image)
+{
+    const std::string rom = ":rom";
+    image.writable = true;
+    if (text.size() > rom.size() && text.compare(text.size() - rom.size(), rom.size(), rom) == 0) {
+        image.writable = false;
+        text.resize(text.size() - rom.size());
+    }
+
+    uint64_t address = 0;
+    size_t at = text.rfind('@');
+    if (at != std::string::npos) {
+        if (!ParseNumber(text.substr(at + 1), 0xFFFF, address)) {
+            return false;
+        }
+        text.resize(at);
+    }
+    image.path = text;
+    image.address = (uint16_t)address;
+    return !image.path.empty();
+}
+
+bool ParseBatchJobs(std::istream& in, std::vector<BatchJob>& jobs, std::string& error)
+{
+    std::string line;
+    for (size_t number = 1; std::getline(in, line); number++) {
+        std::istringstream fields(line);
+        std::string images, start, cycles;
+        if (!(fields >> images) || images[0] == '#') {
+            continue;
+        }
+
+        BatchJob job;
+        std::istringstream imageList(images);
+        for (std::string text; std::getline(imageList, text, ',');) {
+            Memory::Image image;
+            if (!ParseImage(text, image)) {
+                error = "line " + std::to_string(number) + ": bad image '" + text + "'";
+                return false;
+            }
+            job.images.push_back(image);
+        }
+
+        uint64_t value = 0;
+        if (!(fields >> start >> cycles)) {
+            error = "line " + std::to_string(number) + ": expected a start and a cycle budget";
+            return false;
+        }
+        job.startAtReset = start == "reset";
+        if (!job.startAtReset) {
+            if (!ParseNumber(start, 0xFFFF, value)) {
+                error = "line " + std::to_string(number) + ": bad start '" + start + "'";
+                return false;
+            }
+            job.start = (uint16_t)value;
+        }
+        if (!ParseNumber(cycles, UINT64_MAX, job.cycles)) {
+            error = "line " + std::to_string(number) + ": bad cycle budget '" + cycles + "'";
+            return false;
+        }
+
+        for (std::string text; fields >> text;) {
+            if (text.rfind("warm:", 0) == 0) {
+                if (!ParseNumber(text.substr(5), 0xFFFF, value)) {
+                    error = "line " + std::to_string(number) + ": bad warm start '" + text + "'";
+                    return false;
+                }
+                job.warmStart = (uint16_t)value;
+                continue;
+            }
+            Capture capture;
+            if (!ParseCapture(text, capture)) {
+                error = "line " + std::to_string(number) + ": bad capture '" + text + "'";
+                return false;
+            }
+            job.captures.push_back(capture);
+        }
+        jobs.push_back(std::move(job));
+    }
+    return true;
+}
+
+BatchResult RunBatchJob(const BatchJob& job, size_t index)
+{
+    return RunJob(job, index, nullptr);
+}
+
+void RunBatch(const std::vector<BatchJob>& jobs, unsigned threadCount,
+    const std::function<void(const BatchResult&)>& onResult, bool lockstep)
+{
+    std::mutex resultMutex;
+    std::vector<std::shared_ptr<const Memory::BaseImage>> bases = ShareImages(jobs);
+    ThreadPool pool(threadCount);
+    if (lockstep) {
+        auto report = [&](const BatchResult& result) {
+            std::lock_guard<std::mutex> lock(resultMutex);
+            onResult(result);
+        };
+        std::map<std::tuple<bool, uint16_t, uint64_t>, std::vector<size_t>> groups;
+        for (size_t i = 0; i < jobs.size(); i++) {
+            const BatchJob& job = jobs[i];
+            if (job.warmStart) {
+                pool.Submit([&, i] { report(RunJob(jobs[i], i, bases[i])); });
+                continue;
+            }
+            groups[{ job.startAtReset, job.start, job.cycles }].push_back(i);
+        }
+        for (const auto& [key, indices] : groups) {
+            for (size_t first = 0; first < indices.size(); first += BatchLockstepLanes) {
+                size_t last = std::min(indices.size(), first + BatchLockstepLanes);
+                pool.Submit([&, chunk = std::vector<size_t>(indices.begin() + first, indices.begin() + last)] {
+                    RunLockstepJobs(jobs, chunk, bases, report);
+                });
+            }
+        }
+        pool.Wait();
+        return;
+    }
+
+    for (size_t i = 0; i < jobs.size(); i++) {
+        pool.Submit([&, i] {
+            BatchResult result = RunJob(jobs[i], i, bases[i]);
+            std::lock_guard<std::mutex> lock(resultMutex);
+            onResult(result);
+        });
+    }
+    pool.Wait();
+}
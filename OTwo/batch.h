@@ -0,0 +1,88 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <istream>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include "cpu.h"
+#include "memory.h"
+
+// A value to report once a job has finished.
+struct Capture {
+	enum class Kind {
+		A,
+		X,
+		Y,
+		S,
+		P,
+		PC,
+		Cycles,
+		Instructions,
+		Memory,
+	};
+
+	Kind kind;
+	uint16_t address = 0; // for Memory
+	uint32_t size = 1;
+};
+
+// One independent run: the images to map, where to start and for how many
+// cycles, and what to report.
+struct BatchJob {
+	std::vector<Memory::Image> images;
+	bool startAtReset = false;
+	uint16_t start = 0;
+	uint64_t cycles = 0;
+	std::vector<Capture> captures;
+	// Resumes from, or saves, a warm start at this PC (see warmstart.h).
+	std::optional<uint16_t> warmStart;
+};
+
+struct BatchResult {
+	size_t index; // of the job in the list
+	bool loaded;  // false when the images could not be mapped
+	RunResult run;
+	std::string captured; // "name=value" per capture, space separated
+};
+
+// Parses a number in C notation that is at most max, with nothing after it.
+bool ParseNumber(const std::string& text, uint64_t max, uint64_t& value);
+
+// Parses an image as job lists give it, image[@address][:rom]; the
+// address defaults to zero.
+bool ParseImage(std::string text, Memory::Image& image);
+
+// Parses a job list, one job per line:
+//
+//   image[@address][:rom][,image...] start cycles [capture...]
+//
+// Images are mapped copy-on-write unless marked :rom. The start is an
+// address or "reset" for the reset vector. Captures are a, x, y, s, p, pc,
+// cycles, instructions and mem:address[:size]; warm:address among them
+// gives the job a warm start at that address. Blank lines and lines
+// starting with # are skipped. Returns false and describes the first bad
+// line in error.
+bool ParseBatchJobs(std::istream& in, std::vector<BatchJob>& jobs, std::string& error);
+
+// Runs the job on a machine of its own. Unknown opcodes are skipped as in
+// a normal run; any other stop ends the job.
+BatchResult RunBatchJob(const BatchJob& job, size_t index);
+
+// Jobs run together on one Lockstep in lockstep batches.
+constexpr size_t BatchLockstepLanes = 256;
+
+// Runs every job on a work-stealing pool of threadCount threads (zero for
+// one per hardware thread) and passes each result to onResult as soon as
+// its job finishes. onResult is never called concurrently. Jobs that map
+// the same images fork their memory from one copy of them.
+//
+// With lockstep set, jobs that share a start and a cycle budget run in
+// groups of up to BatchLockstepLanes on a Lockstep (see lockstep.h); jobs
+// with a warm start run on their own. That
+// pays off when they run the same program on different data, most of all
+// when the program does more register arithmetic than memory accesses.
+void RunBatch(const std::vector<BatchJob>& jobs, unsigned threadCount,
+	const std::function<void(const BatchResult&)>& onResult, bool lockstep = false);
@@ -0,0 +1,189 @@
+#include "blockcache.h"
+#include <algorithm>
+
+#include "defines.h"
+#include "opcodes.h"
+
+namespace {
+
+// Instruction lengths from the opcode list; zero marks an unknown opcode.
+constexpr std::array<uint8_t, 256> BuildOpcodeBytes()
+{
+    std::array<uint8_t, 256> table{};
+#define OTWO_OPCODE_BYTES(opcode, handler, bytes, base_cycles) table[opcode] = bytes;
+    OTWO_OPCODES(OTWO_OPCODE_BYTES)
+#undef OTWO_OPCODE_BYTES
+    return table;
+}
+
+constexpr std::array<uint8_t, 256> BuildOpcodeCycles()
+{
+    std::array<uint8_t, 256> table{};
+    table.fill(2); // unknown opcodes
+#define OTWO_OPCODE_CYCLES(opcode, handler, bytes, base_cycles) table[opcode] = base_cycles;
+    OTWO_OPCODES(OTWO_OPCODE_CYCLES)
+#undef OTWO_OPCODE_CYCLES
+    return table;
+}
+
+constexpr std::array<uint8_t, 256> opcodeBytes = BuildOpcodeBytes();
+constexpr std::array<uint8_t, 256> opcodeCycles = BuildOpcodeCycles();
+
+struct FusedPair {
+    uint8_t first;
+    uint8_t second;
+};
+
+// In the order of fusion.h, which is the order the CPU numbers them in.
+constexpr std::array<FusedPair, FusedPairCount> fusedPairs = { {
+#define OTWO_FUSED_PAIR(first, first_handler, first_cycles, second, second_handler, second_cycles) { first, second },
+    OTWO_FUSED_PAIRS(OTWO_FUSED_PAIR)
+#undef OTWO_FUSED_PAIR
+} };
+
+// Only ever read: a page's own table replaces it before a block is stored.
+std::unique_ptr<Block> noBlocks[Memory::PageSize];
+
+}
+
+bool BlockCache::EndsBlock(uint8_t opcode)
+{
+    switch (opcode) {
+    case BCC_REL:
+    case BCS_REL:
+    case BEQ_REL:
+    case BNE_REL:
+    case BMI_REL:
+    case BPL_REL:
+    case BVC_REL:
+    case BVS_REL:
+    case JMP_ABS:
+    case JMP_IND:
+    case JSR_ABS:
+    case RTS_IMP:
+    case RTI_IMP:
+    case BRK_IMP:
+        return true;
+    }
+    return opcodeBytes[opcode] == 0;
+}
+
+BlockCache::BlockCache(Memory* memory)
+    : memory(memory)
+{
+    blocks.fill(noBlocks);
+}
+
+Block* BlockCache::Build(uint16_t address)
+{
+    auto block = std::make_unique<Block>();
+    block->start = address;
+    block->maxCycles = 0;
+
+    uint32_t pc = address;
+    while (block->instructions.size() < MaxInstructions) {
+        if (pc > 0xFFFF || !memory->IsDirect(pc)) {
+            break;
+        }
+
+        DecodedInstruction instruction{};
+        instruction.address = pc;
+        instruction.opcode = memory->ReadByte(pc);
+        instruction.dispatch = instruction.opcode;
+        instruction.bytes = std::max<uint8_t>(opcodeBytes[instruction.opcode], 1);
+        // Stop before an instruction that runs off the end of memory or
+        // into a device page.
+        if (pc + instruction.bytes > 0x10000 || !memory->IsDirect(pc + instruction.bytes - 1)) {
+            break;
+        }
+        for (uint8_t i = 1; i < instruction.bytes; i++) {
+            instruction.operand |= memory->ReadByte(pc + i) << (8 * (i - 1));
+        }
+
+        block->instructions.push_back(instruction);
+        // One more for a page crossing; a taken branch can add two, but
+        // it is always last and has no page-crossing operand.
+        block->maxCycles += opcodeCycles[instruction.opcode] + 1;
+        pc += instruction.bytes;
+        if (EndsBlock(instruction.opcode)) {
+            break;
+        }
+    }
+
+    if (block->instructions.empty()) {
+        return nullptr;
+    }
+
+    // Pairs are taken greedily from the start, so an instruction is in at
+    // most one.
+    std::vector<DecodedInstruction>& instructions = block->instructions;
+    for (size_t i = 0; i + 1 < instructions.size(); i++) {
+        for (uint16_t pair = 0; pair < FusedPairCount; pair++) {
+            if (fusedPairs[pair].first == instructions[i].opcode && fusedPairs[pair].second == instructions[i + 1].opcode) {
+                instructions[i++].dispatch = FusedDispatch + pair;
+                break;
+            }
+        }
+    }
+
+    block->end = pc;
+    block->maxCycles += 1;
+    for (uint32_t page = address >> 8; page <= (pc - 1) >> 8; page++) {
+        pageBlocks[page].push_back(address);
+        memory->MarkCode(page, true);
+    }
+
+    std::unique_ptr<std::unique_ptr<Block>[]>& table = pageTables[address >> 8];
+    if (!table) {
+        table = std::make_unique<std::unique_ptr<Block>[]>(Memory::PageSize);
+        blocks[address >> 8] = table.get();
+    }
+    blockCount++;
+    table[address & 0xFF] = std::move(block);
+    return table[address & 0xFF].get();
+}
+
+void BlockCache::Remove(uint16_t start)
+{
+    std::unique_ptr<Block>& slot = blocks[start >> 8][start & 0xFF];
+    const Block& block = *slot;
+    for (uint32_t page = block.start >> 8; page <= (block.end - 1) >> 8; page++) {
+        std::vector<uint16_t>& starts = pageBlocks[page];
+        starts.erase(std::find(starts.begin(), starts.end(), start));
+        if (starts.empty()) {
+            memory->MarkCode(page, false);
+        }
+    }
+    slot.reset();
+    blockCount--;
+    if (removeHandler) {
+        removeHandler(start);
+    }
+}
+
+bool BlockCache::Invalidate(uint16_t address, uint32_t size)
+{
+    uint32_t end = address + size;
+    bool removed = false;
+    for (uint32_t page = address >> 8; page <= (end - 1) >> 8; page++) {
+        // Backwards, since Remove erases the current entry.
+        std::vector<uint16_t>& starts = pageBlocks[page];
+        for (size_t i = starts.size(); i-- > 0;) {
+            const Block& block = *blocks[starts[i] >> 8][starts[i] & 0xFF];
+            if (block.start < end && address < block.end) {
+                Remove(starts[i]);
+                removed = true;
+            }
+        }
+    }
+    return removed;
+}
+
+void BlockCache::Clear()
+{
+    for (uint32_t page = 0; page < Memory::PageCount; page++) {
+        while (!pageBlocks[page].empty()) {
+            Remove(pageBlocks[page].back());
+        }
+    }
+}
@@ -0,0 +1,95 @@
+#pragma once
+#include <array>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <vector>
+
+#include "fusion.h"
+#include "memory.h"
+
+struct DecodedInstruction {
+	uint16_t address;
+	uint8_t opcode;
+	uint8_t bytes;
+	uint16_t operand; // the bytes after the opcode, little-endian
+	// The opcode, or FusedDispatch plus the index in fusion.h of the pair
+	// this instruction and the next are fused into.
+	uint16_t dispatch;
+};
+
+constexpr uint16_t FusedDispatch = 0x100;
+#define OTWO_COUNT_FUSED_PAIR(...) +1
+constexpr size_t FusedPairCount = 0 OTWO_FUSED_PAIRS(OTWO_COUNT_FUSED_PAIR);
+#undef OTWO_COUNT_FUSED_PAIR
+
+// A straight-line run of instructions ending at the first branch, jump,
+// call, return, BRK or unknown opcode. Pairs of instructions listed in
+// fusion.h are marked to be dispatched as one.
+struct Block {
+	uint16_t start;
+	uint32_t end; // one past the last byte
+	// No run through the block can take more cycles than this.
+	uint32_t maxCycles;
+	uint32_t executions = 0;
+	std::vector<DecodedInstruction> instructions;
+};
+
+// Pre-decoded blocks keyed by start address. The pages a block was decoded
+// from are marked as code in Memory, so a write into one of them reaches
+// Invalidate and drops exactly the blocks it overlaps. Blocks are never
+// built from device pages, whose contents can change without a write.
+class BlockCache {
+
+public:
+	static constexpr size_t MaxInstructions = 32;
+
+	// Branches, jumps, calls, returns, BRK and unknown opcodes.
+	static bool EndsBlock(uint8_t opcode);
+
+	explicit BlockCache(Memory* memory);
+
+	BlockCache(const BlockCache&) = delete;
+	BlockCache& operator=(const BlockCache&) = delete;
+
+	// Returns the block starting at address, decoding it on first use, or
+	// null when the code there is not cacheable.
+	inline Block* Lookup(uint16_t address)
+	{
+		Block* block = blocks[address >> 8][address & 0xFF].get();
+		if (block)
+			return block;
+		return Build(address);
+	}
+
+	// Drops every block overlapping [address, address + size) and returns
+	// whether there was one.
+	bool Invalidate(uint16_t address, uint32_t size);
+	void Clear();
+
+	// Called with the start address of every block as it is dropped.
+	void SetRemoveHandler(std::function<void(uint16_t start)> handler)
+	{
+		removeHandler = std::move(handler);
+	}
+
+	size_t BlockCount() const
+	{
+		return blockCount;
+	}
+
+private:
+	Block* Build(uint16_t address);
+	void Remove(uint16_t start);
+
+	Memory* memory;
+	// Blocks by start address, one table per page. A page's table is
+	// allocated when the first block starting in it is built; until then it
+	// points at a shared table of nulls.
+	std::array<std::unique_ptr<Block>*, Memory::PageCount> blocks;
+	std::array<std::unique_ptr<std::unique_ptr<Block>[]>, Memory::PageCount> pageTables;
+	// Start addresses of the blocks that have bytes in each page.
+	std::array<std::vector<uint16_t>, Memory::PageCount> pageBlocks;
+	size_t blockCount = 0;
+	std::function<void(uint16_t start)> removeHandler;
+};
@@ -0,0 +1,100 @@
+#include "console.h"
+#include <cerrno>
+
+#if defined(_WIN32)
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
+namespace {
+
+// Returns the bytes written, or -1 with errno set.
+long WriteSome(int fd, const uint8_t* bytes, size_t size)
+{
+#if defined(_WIN32)
+    return _write(fd, bytes, static_cast<unsigned>(size));
+#else
+    return write(fd, bytes, size);
+#endif
+}
+
+}
+
+Console::Console(int fd, size_t bufferSize, uint64_t flushInterval)
+    : fd(fd), bufferSize(bufferSize > 0 ? bufferSize : 1), flushInterval(flushInterval),
+      buffer(std::make_unique<uint8_t[]>(this->bufferSize))
+{
+}
+
+Console::~Console()
+{
+    Flush();
+}
+
+void Console::Flush()
+{
+    size_t done = 0;
+    while (good && done < used) {
+        long written = WriteSome(fd, buffer.get() + done, used - done);
+        writeCalls++;
+        if (written < 0) {
+            good = errno == EINTR;
+            continue;
+        }
+        done += written;
+        bytesWritten += written;
+    }
+    used = 0;
+}
+
+void Console::FlushEvent()
+{
+    flushScheduled = false;
+    Flush();
+}
+
+uint8_t Console::Read(uint8_t offset) const
+{
+    switch (offset) {
+    case BlockAddress:
+        return blockAddress & 0xFF;
+    case BlockAddress + 1:
+        return blockAddress >> 8;
+    case BlockLength:
+        return blockLength & 0xFF;
+    case BlockLength + 1:
+        return blockLength >> 8;
+    }
+    return 0;
+}
+
+void Console::Write(uint8_t offset, uint8_t value)
+{
+    switch (offset) {
+    case CharOut:
+        Append(value);
+        break;
+    case FlushOut:
+        Flush();
+        break;
+    case BlockAddress:
+        blockAddress = (blockAddress & 0xFF00) | value;
+        break;
+    case BlockAddress + 1:
+        blockAddress = (blockAddress & 0x00FF) | (value << 8);
+        break;
+    case BlockLength:
+        blockLength = (blockLength & 0xFF00) | value;
+        break;
+    case BlockLength + 1:
+        blockLength = (blockLength & 0x00FF) | (value << 8);
+        break;
+    case BlockOut:
+        // Wraps at the end of the address space like the CPU does.
+        for (uint16_t i = 0; i < blockLength; i++) {
+            Append(memory->ReadByte(uint16_t(blockAddress + i)));
+        }
+        break;
+    }
+}
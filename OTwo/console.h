@@ -0,0 +1,109 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+
+#include "machine.h"
+
+// A memory-mapped output device for guest programs, with a port for single
+// characters and one for whole blocks of memory. Output is staged in a
+// buffer and written to a file descriptor with one write(2) when the
+// buffer fills, when the host calls Flush (OTwo does once the program
+// stops), and flushInterval cycles after the first byte the last write
+// left out, so a guest that logs a lot costs a system call per buffer
+// rather than per character.
+//
+// Registers, from the page-aligned address the device is attached at:
+//
+//   +0    CharOut         write: appends the byte
+//   +1    FlushOut        write: writes out the buffer now
+//   +2,3  BlockAddress    read/write, little-endian
+//   +4,5  BlockLength     read/write, little-endian
+//   +6    BlockOut        write: appends BlockLength bytes from BlockAddress
+//
+// The rest of the page reads as zero and ignores writes.
+class Console {
+
+public:
+	static constexpr uint8_t CharOut = 0;
+	static constexpr uint8_t FlushOut = 1;
+	static constexpr uint8_t BlockAddress = 2;
+	static constexpr uint8_t BlockLength = 4;
+	static constexpr uint8_t BlockOut = 6;
+
+	static constexpr size_t DefaultBufferSize = 64 << 10;
+	static constexpr uint64_t DefaultFlushInterval = 100000;
+
+	// The descriptor is not closed.
+	explicit Console(int fd = 1, size_t bufferSize = DefaultBufferSize,
+					 uint64_t flushInterval = DefaultFlushInterval);
+	// Flushes what is left.
+	~Console();
+
+	Console(const Console&) = delete;
+	Console& operator=(const Console&) = delete;
+
+	// Maps the device over the page at address, which must be page-aligned.
+	// The console has to outlive the machine, or at least every run of it,
+	// since the machine's memory and scheduler call back into it.
+	template <typename Policy>
+	bool Attach(BasicMachine<Policy>& machine, uint16_t address)
+	{
+		BasicCPU<Policy>& cpu = machine.cpu;
+		memory = &machine.memory;
+		scheduleFlush = [this, &cpu] { cpu.ScheduleEvent(cpu.Cycles() + flushInterval, [this](uint64_t) { FlushEvent(); }); };
+		return memory->MapIO(address, Memory::PageSize, [this](uint16_t port) { return Read(port & 0xFF); },
+							 [this](uint16_t port, uint8_t value) { Write(port & 0xFF, value); });
+	}
+
+	// Writes out the buffer, retrying short writes.
+	void Flush();
+
+	// False once a write has failed; the output is dropped from then on.
+	bool Good() const
+	{
+		return good;
+	}
+
+	uint64_t BytesWritten() const
+	{
+		return bytesWritten;
+	}
+
+	uint64_t WriteCalls() const
+	{
+		return writeCalls;
+	}
+
+private:
+	uint8_t Read(uint8_t offset) const;
+	void Write(uint8_t offset, uint8_t value);
+	void FlushEvent();
+	void Append(uint8_t value)
+	{
+		if (used == bufferSize)
+			Flush();
+		buffer[used++] = value;
+		if (!flushScheduled && scheduleFlush)
+		{
+			flushScheduled = true;
+			scheduleFlush();
+		}
+	}
+
+	int fd;
+	size_t bufferSize;
+	uint64_t flushInterval;
+	std::unique_ptr<uint8_t[]> buffer;
+	size_t used = 0;
+	bool good = true;
+	uint64_t bytesWritten = 0;
+	uint64_t writeCalls = 0;
+
+	Memory* memory = nullptr;
+	std::function<void()> scheduleFlush;
+	bool flushScheduled = false;
+	uint16_t blockAddress = 0;
+	uint16_t blockLength = 0;
+};
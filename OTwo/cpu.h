@@ -0,0 +1,1677 @@
+#pragma once
+#include <algorithm>
+#include <array>
+#include <bitset>
+#include <cstdint>
+#include <functional>
+#include <type_traits>
+#include <vector>
+
+#include "aot.h"
+#include "blockcache.h"
+#include "cpupolicy.h"
+#include "defines.h"
+#include "jit.h"
+#include "memory.h"
+#include "opcodes.h"
+#include "profiler.h"
+#include "scheduler.h"
+#include "trace.h"
+
+// The threaded core needs labels-as-values, which MSVC does not support;
+// there the portable table-dispatch core is used instead.
+#if defined(OTWO_THREADED_DISPATCH) && (defined(__GNUC__) || defined(__clang__))
+#define OTWO_THREADED_CORE 1
+#else
+#define OTWO_THREADED_CORE 0
+#endif
+
+enum class StopReason
+{
+	BudgetExhausted, // the cycle or instruction budget ran out
+	Trap,			 // a jump or branch to its own address
+	UnknownOpcode,	 // an opcode with no handler was executed as a no-op
+	Breakpoint,		 // PC reached a breakpoint
+	ConditionMet,	 // the RunUntil predicate became true
+};
+
+struct RunResult
+{
+	StopReason reason;
+	uint16_t address;		// where the CPU stopped, or the offending instruction
+	uint64_t cycles;		// cycles elapsed during the call
+	uint64_t instructions;	// instructions executed during the call
+};
+
+// The registers and counters of a CPU, for moving its state to another
+// CPU or into another representation of it.
+struct CPUState
+{
+	uint16_t PC;
+	uint8_t A;
+	uint8_t X;
+	uint8_t Y;
+	uint8_t S;
+	uint8_t P; // as Status() returns it
+	uint64_t cycles;
+	uint64_t instructions;
+};
+
+inline const char *StopReasonName(StopReason reason)
+{
+	switch (reason)
+	{
+	case StopReason::BudgetExhausted:
+		return "budget exhausted";
+	case StopReason::Trap:
+		return "trap";
+	case StopReason::UnknownOpcode:
+		return "unknown opcode";
+	case StopReason::Breakpoint:
+		return "breakpoint";
+	case StopReason::ConditionMet:
+		return "condition met";
+	}
+	return "unknown";
+}
+
+// The 6502, with the features in Policy compiled in (see cpupolicy.h).
+template <typename Policy>
+class BasicCPU
+{
+	friend class Jit;
+	friend struct JitLayout;
+
+	// Handlers name their own instantiation as CPU, as in opcodes.h.
+	using CPU = BasicCPU;
+
+public:
+	// Every opcode is executed by a free function specialized at compile
+	// time on its operation and addressing mode, so dispatching an
+	// instruction costs a single indirect call.
+	using Handler = void (*)(CPU &cpu);
+
+	// Bits of the processor status register P.
+	static constexpr uint8_t FlagC = 0b00000001; // carry
+	static constexpr uint8_t FlagZ = 0b00000010; // zero
+	static constexpr uint8_t FlagI = 0b00000100; // interrupt disable
+	static constexpr uint8_t FlagD = 0b00001000; // decimal
+	static constexpr uint8_t FlagB = 0b00010000; // break, only in pushed copies
+	static constexpr uint8_t FlagU = 0b00100000; // unused, always reads as 1
+	static constexpr uint8_t FlagV = 0b01000000; // overflow
+	static constexpr uint8_t FlagN = 0b10000000; // negative
+
+	// Translated and compiled code inlines memory accesses and cycle counts
+	// and is generated against CPU, so other policies always interpret.
+	static constexpr bool NativeCode = std::is_same_v<Policy, ReleasePolicy>;
+
+	// Called with the address, the value and whether it was written.
+	using AccessHandler = std::function<void(uint16_t address, uint8_t value, bool write)>;
+
+	BasicCPU(Memory *memory)
+		: memory(memory), blockCache(memory)
+	{
+		// A write into decoded code ends the batch, so that the running
+		// block is not executed past the change.
+		memory->SetCodeWriteHandler([this](uint16_t address, uint32_t size)
+									{
+			if (blockCache.Invalidate(address, size))
+				cycleLimit = 0; });
+		blockCache.SetRemoveHandler([this](uint16_t start)
+									{
+			jit.Invalidate(start);
+			compiledValid[start] = false; });
+		EnableJit(OTWO_JIT_CORE && NativeCode);
+		Reset();
+		PC = 0x400;
+	}
+
+	~BasicCPU()
+	{
+		blockCache.Clear();
+		memory->SetCodeWriteHandler(nullptr);
+	}
+
+	BasicCPU(const BasicCPU &) = delete;
+	BasicCPU &operator=(const BasicCPU &) = delete;
+
+	void Reset()
+	{
+		uint16_t rv = memory->ReadWord(0xFFFC);
+		PC = rv;
+		P = (P | FlagI) & ~FlagD;
+		S = 0xFD;
+	}
+
+	inline uint8_t FetchInstruction()
+	{
+		return memory->ReadByte(PC++);
+	}
+
+	inline uint8_t FetchByte()
+	{
+		return memory->ReadByte(PC++);
+	}
+
+	inline uint16_t FetchWord()
+	{
+		auto res = memory->ReadWord(PC);
+		PC += 2;
+		return res;
+	}
+
+	inline uint16_t AddressZP()
+	{
+		return FetchByte();
+	}
+
+	// Zero-page indexing wraps within the zero page.
+	inline uint16_t AddressZPX()
+	{
+		uint8_t zp_index = FetchByte() + X;
+		return zp_index;
+	}
+
+	inline uint16_t AddressZPY()
+	{
+		uint8_t zp_index = FetchByte() + Y;
+		return zp_index;
+	}
+
+	inline uint16_t AddressAbsolute()
+	{
+		return FetchWord();
+	}
+
+	inline uint16_t AddressAbsoluteX()
+	{
+		auto index = FetchWord();
+		return index + X;
+	}
+
+	inline uint16_t AddressAbsoluteY()
+	{
+		auto index = FetchWord();
+		return index + Y;
+	}
+
+	inline uint16_t AddressIndirectX()
+	{
+		uint8_t zp_index = FetchByte() + X;
+		return memory->ReadZPWord(zp_index);
+	}
+
+	inline uint16_t FetchIndirectBase()
+	{
+		return memory->ReadZPWord(FetchByte());
+	}
+
+	inline uint16_t AddressIndirectY()
+	{
+		uint16_t effective_address = FetchIndirectBase() + Y;
+
+		return effective_address;
+	}
+
+	// Indexed reads take one extra cycle when the index carries into the
+	// high byte of the address.
+	static inline bool PageCrossed(uint16_t from, uint16_t to)
+	{
+		return (from ^ to) & 0xFF00;
+	}
+
+	inline uint8_t FetchByteZP()
+	{
+		return ReadData(AddressZP());
+	}
+
+	inline uint8_t FetchByteZPX()
+	{
+		return ReadData(AddressZPX());
+	}
+
+	inline uint8_t FetchByteZPY()
+	{
+		return ReadData(AddressZPY());
+	}
+
+	inline uint8_t FetchByteAbsolute()
+	{
+		return ReadData(AddressAbsolute());
+	}
+
+	inline uint8_t FetchByteAbsoluteX()
+	{
+		auto index = FetchWord();
+		uint16_t address = index + X;
+		AddPenalty(PageCrossed(index, address));
+		return ReadData(address);
+	}
+
+	inline uint8_t FetchByteAbsoluteY()
+	{
+		auto index = FetchWord();
+		uint16_t address = index + Y;
+		AddPenalty(PageCrossed(index, address));
+		return ReadData(address);
+	}
+
+	inline uint8_t FetchByteIndirectX()
+	{
+		return ReadData(AddressIndirectX());
+	}
+
+	inline uint8_t FetchByteIndirectY()
+	{
+		uint16_t base_address = FetchIndirectBase();
+		uint16_t address = base_address + Y;
+		AddPenalty(PageCrossed(base_address, address));
+		return ReadData(address);
+	}
+
+	uint16_t FetchIndirectAddress()
+	{
+		uint16_t ptr = FetchWord();
+		uint16_t lsb = memory->ReadByte(ptr);
+		uint16_t msb = memory->ReadByte((ptr & 0xFF00) | ((ptr + 1) & 0x00FF)); // Handle page boundary
+		return (msb << 8) | lsb;
+	}
+
+	// The same operand fetches for code compiled ahead of time, where the
+	// operand bytes are known and only PC has to be moved past them. The
+	// OTwoAot tool emits e.g. LDA<&CPU::FetchByteZP<0x12>>.
+	template <uint16_t Operand>
+	inline uint8_t FetchByte()
+	{
+		PC++;
+		return Operand;
+	}
+
+	template <uint16_t Operand>
+	inline uint16_t FetchWord()
+	{
+		PC += 2;
+		return Operand;
+	}
+
+	template <uint16_t Operand>
+	inline uint16_t AddressZP()
+	{
+		return FetchByte<Operand>();
+	}
+
+	template <uint16_t Operand>
+	inline uint16_t AddressZPX()
+	{
+		return uint8_t(FetchByte<Operand>() + X);
+	}
+
+	template <uint16_t Operand>
+	inline uint16_t AddressZPY()
+	{
+		return uint8_t(FetchByte<Operand>() + Y);
+	}
+
+	template <uint16_t Operand>
+	inline uint16_t AddressAbsolute()
+	{
+		return FetchWord<Operand>();
+	}
+
+	template <uint16_t Operand>
+	inline uint16_t AddressAbsoluteX()
+	{
+		return FetchWord<Operand>() + X;
+	}
+
+	template <uint16_t Operand>
+	inline uint16_t AddressAbsoluteY()
+	{
+		return FetchWord<Operand>() + Y;
+	}
+
+	template <uint16_t Operand>
+	inline uint16_t AddressIndirectX()
+	{
+		return memory->ReadZPWord(FetchByte<Operand>() + X);
+	}
+
+	template <uint16_t Operand>
+	inline uint16_t AddressIndirectY()
+	{
+		return memory->ReadZPWord(FetchByte<Operand>()) + Y;
+	}
+
+	template <uint16_t Operand>
+	inline uint8_t FetchByteZP()
+	{
+		return ReadData(AddressZP<Operand>());
+	}
+
+	template <uint16_t Operand>
+	inline uint8_t FetchByteZPX()
+	{
+		return ReadData(AddressZPX<Operand>());
+	}
+
+	template <uint16_t Operand>
+	inline uint8_t FetchByteZPY()
+	{
+		return ReadData(AddressZPY<Operand>());
+	}
+
+	template <uint16_t Operand>
+	inline uint8_t FetchByteAbsolute()
+	{
+		return ReadData(AddressAbsolute<Operand>());
+	}
+
+	template <uint16_t Operand>
+	inline uint8_t FetchByteAbsoluteX()
+	{
+		uint16_t address = AddressAbsoluteX<Operand>();
+		AddPenalty(PageCrossed(Operand, address));
+		return ReadData(address);
+	}
+
+	template <uint16_t Operand>
+	inline uint8_t FetchByteAbsoluteY()
+	{
+		uint16_t address = AddressAbsoluteY<Operand>();
+		AddPenalty(PageCrossed(Operand, address));
+		return ReadData(address);
+	}
+
+	template <uint16_t Operand>
+	inline uint8_t FetchByteIndirectX()
+	{
+		return ReadData(AddressIndirectX<Operand>());
+	}
+
+	template <uint16_t Operand>
+	inline uint8_t FetchByteIndirectY()
+	{
+		uint16_t base_address = memory->ReadZPWord(FetchByte<Operand>());
+		uint16_t address = base_address + Y;
+		AddPenalty(PageCrossed(base_address, address));
+		return ReadData(address);
+	}
+
+	template <uint16_t Operand>
+	uint16_t FetchIndirectAddress()
+	{
+		uint16_t ptr = FetchWord<Operand>();
+		uint16_t lsb = memory->ReadByte(ptr);
+		uint16_t msb = memory->ReadByte((ptr & 0xFF00) | ((ptr + 1) & 0x00FF));
+		return (msb << 8) | lsb;
+	}
+
+	void StackPush(uint8_t value)
+	{
+		WriteData(0x100 + S, value);
+		if (S == 0x00)
+			S = 0xFF;
+		else
+			S--;
+	}
+
+	uint8_t StackPop()
+	{
+		if (S == 0xFF)
+			S = 0x00;
+		else
+			S++;
+		return ReadData(0x100 + S);
+	}
+
+	template <uint8_t (CPU::*Fetch)()>
+	inline void ADC()
+	{
+		uint8_t operand = (this->*Fetch)();
+		if constexpr (Policy::Decimal)
+		{
+			if (P & FlagD)
+			{
+				AddDecimal(operand);
+				return;
+			}
+		}
+		uint16_t r = A + operand + carry;
+		SetOverflow(~(A ^ operand) & (A ^ r) & 0x80);
+		A = r & 0xFF;
+		carry = r >> 8;
+		nzResult = A;
+	}
+
+	template <uint8_t (CPU::*Fetch)()>
+	inline void SBC()
+	{
+		uint8_t operand = (this->*Fetch)();
+		if constexpr (Policy::Decimal)
+		{
+			if (P & FlagD)
+			{
+				SubtractDecimal(operand);
+				return;
+			}
+		}
+		uint16_t r = A + (uint8_t)~operand + carry;
+		SetOverflow((A ^ operand) & (A ^ r) & 0x80);
+		A = r & 0xFF;
+		carry = r >> 8;
+		nzResult = A;
+	}
+
+	// BCD arithmetic as the NMOS 6502 does it: Z comes from the binary
+	// result, N and V from the sum before the high digit is adjusted.
+	void AddDecimal(uint8_t operand)
+	{
+		uint8_t binary = A + operand + carry;
+		uint8_t low = (A & 0x0F) + (operand & 0x0F) + carry;
+		if (low > 0x09)
+			low += 0x06;
+		uint8_t high = (A >> 4) + (operand >> 4) + (low > 0x0F);
+		uint8_t intermediate = (high << 4) | (low & 0x0F);
+		SetOverflow(~(A ^ operand) & (A ^ intermediate) & 0x80);
+		nzResult = (binary ? 1 : 0) | ((intermediate & 0x80) << 1);
+		if (high > 0x09)
+			high += 0x06;
+		carry = high > 0x0F;
+		A = (high << 4) | (low & 0x0F);
+	}
+
+	// Flags are those of the binary subtraction.
+	void SubtractDecimal(uint8_t operand)
+	{
+		uint16_t r = A + (uint8_t)~operand + carry;
+		int low = (A & 0x0F) - (operand & 0x0F) - (1 - carry);
+		int high = (A >> 4) - (operand >> 4);
+		if (low < 0)
+		{
+			low -= 0x06;
+			high--;
+		}
+		if (high < 0)
+			high -= 0x06;
+		SetOverflow((A ^ operand) & (A ^ r) & 0x80);
+		nzResult = r & 0xFF;
+		carry = r >> 8;
+		A = (high << 4) | (low & 0x0F);
+	}
+
+	template <uint8_t (CPU::*Fetch)()>
+	inline void AND()
+	{
+		A &= (this->*Fetch)();
+		nzResult = A;
+	}
+
+	template <uint8_t (CPU::*Fetch)()>
+	inline void ORA()
+	{
+		A |= (this->*Fetch)();
+		nzResult = A;
+	}
+
+	template <uint8_t (CPU::*Fetch)()>
+	inline void EOR()
+	{
+		A ^= (this->*Fetch)();
+		nzResult = A;
+	}
+
+	template <uint8_t (CPU::*Fetch)()>
+	inline void LDA()
+	{
+		A = (this->*Fetch)();
+		nzResult = A;
+	}
+
+	template <uint8_t (CPU::*Fetch)()>
+	inline void LDX()
+	{
+		X = (this->*Fetch)();
+		nzResult = X;
+	}
+
+	template <uint8_t (CPU::*Fetch)()>
+	inline void LDY()
+	{
+		Y = (this->*Fetch)();
+		nzResult = Y;
+	}
+
+	template <uint16_t (CPU::*Target)()>
+	void JMP()
+	{
+		uint16_t address = PC - 1;
+		PC = (this->*Target)();
+		CheckTrap(address);
+	}
+
+	void PHA()
+	{
+		StackPush(A);
+	}
+
+	void PHP()
+	{
+		StackPush(Status() | FlagB);
+	}
+
+	uint8_t ShiftLeft(uint8_t _val)
+	{
+		uint8_t val = _val << 1;
+		carry = _val >> 7;
+		nzResult = val;
+		return val;
+	}
+
+	uint8_t ShiftRight(uint8_t _val)
+	{
+		uint8_t val = _val >> 1;
+		carry = _val & 1;
+		nzResult = val;
+		return val;
+	}
+
+	uint8_t RotateLeft(uint8_t _val)
+	{
+		uint8_t val = (_val << 1) | carry;
+		carry = _val >> 7;
+		nzResult = val;
+		return val;
+	}
+
+	uint8_t RotateRight(uint8_t _val)
+	{
+		uint8_t val = (_val >> 1) | (carry << 7);
+		carry = _val & 1;
+		nzResult = val;
+		return val;
+	}
+
+	void ASLAccumulator()
+	{
+		A = ShiftLeft(A);
+	}
+
+	template <uint16_t (CPU::*Address)()>
+	void ASL()
+	{
+		uint16_t address = (this->*Address)();
+		WriteData(address, ShiftLeft(ReadData(address)));
+	}
+
+	void LSRAccumulator()
+	{
+		A = ShiftRight(A);
+	}
+
+	template <uint16_t (CPU::*Address)()>
+	void LSR()
+	{
+		uint16_t address = (this->*Address)();
+		WriteData(address, ShiftRight(ReadData(address)));
+	}
+
+	void ROLAccumulator()
+	{
+		A = RotateLeft(A);
+	}
+
+	template <uint16_t (CPU::*Address)()>
+	void ROL()
+	{
+		uint16_t address = (this->*Address)();
+		WriteData(address, RotateLeft(ReadData(address)));
+	}
+
+	void RORAccumulator()
+	{
+		A = RotateRight(A);
+	}
+
+	template <uint16_t (CPU::*Address)()>
+	void ROR()
+	{
+		uint16_t address = (this->*Address)();
+		WriteData(address, RotateRight(ReadData(address)));
+	}
+
+	void PLP()
+	{
+		SetStatus(StackPop());
+		CheckUnmasked();
+	}
+
+	void PLA()
+	{
+		A = StackPop();
+		nzResult = A;
+	}
+
+	// A taken branch costs one extra cycle, two if it lands on another page.
+	void Branch(bool taken)
+	{
+		uint16_t address = PC - 1;
+		int8_t rel_offset = (int8_t)FetchByte();
+		if (taken)
+		{
+			uint16_t target = PC + rel_offset;
+			AddPenalty(PageCrossed(PC, target) ? 2 : 1);
+			PC = target;
+			CheckTrap(address);
+		}
+	}
+
+	void BCC()
+	{
+		Branch(carry == 0);
+	}
+
+	void BCS()
+	{
+		Branch(carry == 1);
+	}
+
+	void BEQ()
+	{
+		Branch(Zero());
+	}
+
+	void BNE()
+	{
+		Branch(!Zero());
+	}
+
+	void BPL()
+	{
+		Branch(!Negative());
+	}
+
+	void BMI()
+	{
+		Branch(Negative());
+	}
+
+	void BVC()
+	{
+		Branch((P & FlagV) == 0);
+	}
+
+	void BVS()
+	{
+		Branch((P & FlagV) != 0);
+	}
+
+	template <uint8_t (CPU::*Fetch)()>
+	void BIT()
+	{
+		uint8_t val = (this->*Fetch)();
+
+		// Bit 8 carries N separately, since it comes from the operand and
+		// not from the result that sets Z.
+		nzResult = (val & A) | ((val & 0x80) << 1);
+		SetOverflow(val & FlagV);
+	}
+
+	void BRK()
+	{
+		// The byte after BRK is skipped on return.
+		uint16_t pc = PC + 1;
+		StackPush(pc >> 8);
+		StackPush(pc & 0xFF);
+		StackPush(Status() | FlagB);
+		P |= FlagI;
+		PC = memory->ReadWord(0xFFFE);
+		ProfileCall();
+	}
+
+	void NOP()
+	{
+	}
+
+	void CLC()
+	{
+		carry = 0;
+	}
+
+	void CLD()
+	{
+		P &= ~FlagD;
+	}
+
+	void CLI()
+	{
+		P &= ~FlagI;
+		CheckUnmasked();
+	}
+
+	void CLV()
+	{
+		P &= ~FlagV;
+	}
+
+	void SEC()
+	{
+		carry = 1;
+	}
+
+	void SED()
+	{
+		P |= FlagD;
+	}
+
+	void SEI()
+	{
+		P |= FlagI;
+	}
+
+	template <uint8_t (CPU::*Fetch)()>
+	void CMP()
+	{
+		uint8_t val = (this->*Fetch)();
+
+		carry = A >= val;
+		nzResult = (uint8_t)(A - val);
+	}
+
+	template <uint8_t (CPU::*Fetch)()>
+	void CPX()
+	{
+		uint8_t val = (this->*Fetch)();
+
+		carry = X >= val;
+		nzResult = (uint8_t)(X - val);
+	}
+
+	template <uint8_t (CPU::*Fetch)()>
+	void CPY()
+	{
+		uint8_t val = (this->*Fetch)();
+
+		carry = Y >= val;
+		nzResult = (uint8_t)(Y - val);
+	}
+
+	template <uint16_t (CPU::*Address)()>
+	void DEC()
+	{
+		uint16_t address = (this->*Address)();
+		uint8_t val = ReadData(address) - 1;
+		WriteData(address, val);
+
+		nzResult = val;
+	}
+
+	template <uint16_t (CPU::*Address)()>
+	void INC()
+	{
+		uint16_t address = (this->*Address)();
+		uint8_t val = ReadData(address) + 1;
+		WriteData(address, val);
+
+		nzResult = val;
+	}
+
+	void DEX()
+	{
+		X--;
+		nzResult = X;
+	}
+
+	void DEY()
+	{
+		Y--;
+		nzResult = Y;
+	}
+
+	void INX()
+	{
+		X++;
+		nzResult = X;
+	}
+
+	void INY()
+	{
+		Y++;
+		nzResult = Y;
+	}
+
+	void JSR()
+	{
+		// The return address pushed is that of the last byte of the JSR.
+		uint16_t target = FetchWord();
+		uint16_t pc = PC - 1;
+		StackPush(pc >> 8);
+		StackPush(pc & 0xFF);
+		PC = target;
+		ProfileCall();
+	}
+
+	void RTS()
+	{
+		uint16_t pc = StackPop();
+		pc |= StackPop() << 8;
+		PC = pc + 1;
+		ProfileReturn();
+	}
+
+	void RTI()
+	{
+		SetStatus(StackPop());
+		uint16_t pc = StackPop();
+		pc |= StackPop() << 8;
+		PC = pc;
+		ProfileReturn();
+		CheckUnmasked();
+	}
+
+	template <uint16_t (CPU::*Address)()>
+	void STA()
+	{
+		WriteData((this->*Address)(), A);
+	}
+
+	template <uint16_t (CPU::*Address)()>
+	void STX()
+	{
+		WriteData((this->*Address)(), X);
+	}
+
+	template <uint16_t (CPU::*Address)()>
+	void STY()
+	{
+		WriteData((this->*Address)(), Y);
+	}
+
+	void TAX()
+	{
+		X = A;
+		nzResult = X;
+	}
+
+	void TAY()
+	{
+		Y = A;
+		nzResult = Y;
+	}
+
+	void TSX()
+	{
+		X = S;
+		nzResult = X;
+	}
+
+	void TXA()
+	{
+		A = X;
+		nzResult = A;
+	}
+
+	void TXS()
+	{
+		S = X;
+	}
+
+	void TYA()
+	{
+		A = Y;
+		nzResult = A;
+	}
+
+	void Unknown()
+	{
+		RequestStop(StopReason::UnknownOpcode, PC - 1);
+	}
+
+	uint64_t Cycles() const
+	{
+		return cycles;
+	}
+
+	uint64_t Instructions() const
+	{
+		return instructions;
+	}
+
+	uint16_t ProgramCounter() const
+	{
+		return PC;
+	}
+
+	void SetProgramCounter(uint16_t address)
+	{
+		PC = address;
+	}
+
+	uint8_t Accumulator() const
+	{
+		return A;
+	}
+
+	uint8_t IndexX() const
+	{
+		return X;
+	}
+
+	uint8_t IndexY() const
+	{
+		return Y;
+	}
+
+	uint8_t StackPointer() const
+	{
+		return S;
+	}
+
+	// The status register as an interrupt pushes it; PHP and BRK also set B.
+	uint8_t Status() const
+	{
+		uint8_t status = (P & ~(FlagN | FlagZ | FlagC | FlagB)) | FlagU;
+		status |= carry;
+		status |= Zero() ? FlagZ : 0;
+		status |= Negative() ? FlagN : 0;
+		return status;
+	}
+
+	void SetStatus(uint8_t status)
+	{
+		P = status & ~(FlagN | FlagZ | FlagC | FlagB | FlagU);
+		carry = status & FlagC;
+		nzResult = ((status & FlagN) << 1) | ((status & FlagZ) ? 0 : 1);
+	}
+
+	CPUState GetState() const
+	{
+		return { PC, A, X, Y, S, Status(), cycles, instructions };
+	}
+
+	void SetState(const CPUState &state)
+	{
+		PC = state.PC;
+		A = state.A;
+		X = state.X;
+		Y = state.Y;
+		S = state.S;
+		SetStatus(state.P);
+		cycles = state.cycles;
+		instructions = state.instructions;
+	}
+
+	// Blocks entered this many times are translated to native code.
+	static constexpr uint32_t DefaultJitThreshold = 32;
+
+	// Has no effect where the translator is not built or cannot get
+	// executable memory.
+	void EnableJit(bool enabled, uint32_t hotThreshold = DefaultJitThreshold)
+	{
+		jitEnabled = enabled && jit.Available();
+		jitThreshold = hotThreshold;
+	}
+
+	// Runs blocks compiled by OTwoAot in place of the interpreter. The
+	// program must outlive the CPU.
+	void LoadCompiledProgram(const CompiledProgram &program)
+		requires NativeCode
+	{
+		compiledBlocks.assign(0x10000, nullptr);
+		compiledValid.reset();
+		for (size_t i = 0; i < program.count; i++)
+			compiledBlocks[program.blocks[i].start] = &program.blocks[i];
+	}
+
+	// One instruction of a compiled block; pc is the address after its
+	// opcode. Returns whether the batch goes on.
+	template <void (CPU::*Operation)(), uint8_t BaseCycles>
+	inline bool CompiledStep(uint16_t pc)
+	{
+		PC = pc;
+		cycles += BaseCycles;
+		(this->*Operation)();
+		return cycles < cycleLimit;
+	}
+
+	void SetBreakpoint(uint16_t address, bool enabled = true)
+		requires Policy::Breakpoints
+	{
+		if (breakpoints[address] != enabled)
+			breakpointCount += enabled ? 1 : -1;
+		breakpoints[address] = enabled;
+	}
+
+	bool IsBreakpoint(uint16_t address) const
+		requires Policy::Breakpoints
+	{
+		return breakpoints[address];
+	}
+
+	void ClearBreakpoints()
+		requires Policy::Breakpoints
+	{
+		breakpoints.reset();
+		breakpointCount = 0;
+	}
+
+	// Executes exactly one instruction, ignoring breakpoints, after
+	// running due events and taking a waiting interrupt.
+	RunResult Step()
+	{
+		uint64_t startCycles = cycles;
+		stopRequested = false;
+		ServiceEvents();
+		Dispatch(FetchInstruction());
+		instructions++;
+		return Finish(startCycles, 1);
+	}
+
+	// Runs until maxCycles cycles or maxInstructions instructions have
+	// elapsed, whichever comes first, or until something stops the CPU
+	// earlier. The last instruction may overshoot the cycle budget.
+	// Batches also end at the next scheduled event, which runs before the
+	// batch after it.
+	RunResult RunFor(uint64_t maxCycles, uint64_t maxInstructions = UINT64_MAX)
+	{
+		if constexpr (Policy::Tracing)
+		{
+			if (tracer)
+				return RunTraced(maxCycles, maxInstructions);
+		}
+
+		uint64_t startCycles = cycles;
+		uint64_t endCycles = maxCycles > UINT64_MAX - cycles ? UINT64_MAX : cycles + maxCycles;
+		uint64_t executed = 0;
+		stopRequested = false;
+
+		// The budget is only checked between batches. Every instruction
+		// costs at least two cycles, so a batch that may use twice the
+		// remaining instruction count in cycles cannot overrun it.
+		while (cycles < endCycles && executed < maxInstructions)
+		{
+			ServiceEvents();
+			if (AtBreakpoint(executed))
+				break;
+
+			uint64_t remaining = maxInstructions - executed;
+			if constexpr (Policy::Breakpoints)
+			{
+				if (breakpointCount > 0)
+					remaining = 1;
+			}
+
+			// Taking an interrupt may have run the cycle counter past the
+			// next event; the batch is then empty and the event runs next.
+			cycleLimit = std::min(endCycles, scheduler.NextCycle());
+			if (cycleLimit > cycles && remaining < (cycleLimit - cycles) / 2)
+				cycleLimit = cycles + remaining * 2;
+
+			executed += Execute();
+			if (stopRequested)
+				break;
+		}
+
+		instructions += executed;
+		return Finish(startCycles, executed);
+	}
+
+	// While a tracer is set, RunFor records every instruction into it and
+	// runs one instruction at a time, without blocks or translated code.
+	// Null turns tracing off again.
+	void SetTracer(Tracer *tracer)
+		requires Policy::Tracing
+	{
+		this->tracer = tracer;
+	}
+
+	// Runs one instruction at a time until predicate(*this) holds before
+	// the next instruction, the cycle budget runs out, or the CPU stops.
+	// Meant for debugging; RunFor is much faster.
+	template <typename Predicate>
+	RunResult RunUntil(Predicate &&predicate, uint64_t maxCycles = UINT64_MAX)
+	{
+		uint64_t startCycles = cycles;
+		uint64_t executed = 0;
+		stopRequested = false;
+
+		while (cycles - startCycles < maxCycles)
+		{
+			ServiceEvents();
+			if (predicate(static_cast<const CPU &>(*this)))
+			{
+				RequestStop(StopReason::ConditionMet, PC);
+				break;
+			}
+			if (AtBreakpoint(executed))
+				break;
+
+			Dispatch(FetchInstruction());
+			executed++;
+			if (stopRequested)
+				break;
+		}
+
+		instructions += executed;
+		return Finish(startCycles, executed);
+	}
+
+	// Reads and writes of data, the stack included, are passed to the
+	// handler after they happen. Fetches of opcodes, operands, pointers and
+	// vectors are not. Null removes it.
+	void SetAccessHandler(AccessHandler handler)
+		requires Policy::MemoryHooks
+	{
+		accessHandler = std::move(handler);
+	}
+
+	// Reports to the profiler while one is set. Null stops profiling.
+	void SetProfiler(Profiler *profiler)
+		requires Policy::Profiling
+	{
+		this->profiler = profiler;
+		if (profiler)
+			profiler->Start(PC);
+	}
+
+	// The IRQ input is level-triggered and shared: each device drives a
+	// line of its own, numbered below 32, and the interrupt is taken
+	// between instructions for as long as any line is asserted and I is
+	// clear. Asserting a line from a device handler ends the running batch.
+	void SetIRQ(unsigned line, bool asserted)
+	{
+		uint32_t mask = uint32_t(1) << line;
+		irqLines = asserted ? irqLines | mask : irqLines & ~mask;
+		if (asserted)
+			cycleLimit = 0;
+	}
+
+	uint32_t IRQLines() const
+	{
+		return irqLines;
+	}
+
+	// The NMI input is edge-triggered: each call is taken once, before the
+	// next instruction, whatever I is.
+	void TriggerNMI()
+	{
+		nmiPending = true;
+		cycleLimit = 0;
+	}
+
+	// Runs action between instructions once the cycle counter reaches
+	// cycle (see Scheduler). Events and interrupt inputs are not part of
+	// CPUState.
+	Scheduler::EventId ScheduleEvent(uint64_t cycle, Scheduler::Action action)
+	{
+		// Scheduled by a device handler, an event due before the running
+		// batch would end ends it.
+		if (cycle < cycleLimit)
+			cycleLimit = 0;
+		return scheduler.Schedule(cycle, std::move(action));
+	}
+
+	void CancelEvent(Scheduler::EventId id)
+	{
+		scheduler.Cancel(id);
+	}
+
+	// True when an event is scheduled or an interrupt is waiting, which
+	// code that runs the CPU's instructions itself has to leave to it.
+	bool HasPendingEvents() const
+	{
+		return !scheduler.Empty() || irqLines != 0 || nmiPending;
+	}
+
+	static const std::array<Handler, 256> dispatchTable;
+
+private:
+	// RunFor while tracing.
+	RunResult RunTraced(uint64_t maxCycles, uint64_t maxInstructions)
+		requires Policy::Tracing
+	{
+		uint64_t startCycles = cycles;
+		uint64_t executed = 0;
+		stopRequested = false;
+
+		while (cycles - startCycles < maxCycles && executed < maxInstructions)
+		{
+			ServiceEvents();
+			if (AtBreakpoint(executed))
+				break;
+
+			TraceRecord record{};
+			record.cycles = cycles;
+			record.pc = PC;
+			record.a = A;
+			record.x = X;
+			record.y = Y;
+			record.s = S;
+			record.p = Status();
+			record.opcode = FetchInstruction();
+			tracer->Record(record);
+			Dispatch(record.opcode);
+			executed++;
+			if (stopRequested)
+				break;
+		}
+
+		instructions += executed;
+		return Finish(startCycles, executed);
+	}
+
+	bool Zero() const
+	{
+		return (nzResult & 0xFF) == 0;
+	}
+
+	bool Negative() const
+	{
+		return (nzResult & 0x180) != 0;
+	}
+
+	void SetOverflow(bool overflow)
+	{
+		P = (P & ~FlagV) | (overflow ? FlagV : 0);
+	}
+
+	// Page-crossing and taken-branch cycles.
+	void AddPenalty(uint8_t extra)
+	{
+		if constexpr (Policy::ExactCycles)
+			cycles += extra;
+	}
+
+	uint8_t ReadData(uint16_t address)
+	{
+		uint8_t value = memory->ReadByte(address);
+		if constexpr (Policy::MemoryHooks)
+		{
+			if (accessHandler)
+				accessHandler(address, value, false);
+		}
+		return value;
+	}
+
+	void WriteData(uint16_t address, uint8_t value)
+	{
+		memory->WriteByte(address, value);
+		if constexpr (Policy::MemoryHooks)
+		{
+			if (accessHandler)
+				accessHandler(address, value, true);
+		}
+	}
+
+	// The opcode just fetched, with PC after it.
+	void Profile(uint8_t opcode)
+	{
+		if constexpr (Policy::Profiling)
+		{
+			if (profiler)
+				profiler->Count(PC - 1, opcode);
+		}
+	}
+
+	void ProfileCall()
+	{
+		if constexpr (Policy::Profiling)
+		{
+			if (profiler)
+				profiler->Call(PC, S);
+		}
+	}
+
+	void ProfileReturn()
+	{
+		if constexpr (Policy::Profiling)
+		{
+			if (profiler)
+				profiler->Return(S);
+		}
+	}
+
+	void Dispatch(uint8_t opcode)
+	{
+		Profile(opcode);
+		dispatchTable[opcode](*this);
+	}
+
+	// Stops before the next instruction when PC is at a breakpoint. The
+	// first instruction of a call is not checked, so that running again
+	// leaves the breakpoint.
+	bool AtBreakpoint(uint64_t executed)
+	{
+		if constexpr (Policy::Breakpoints)
+		{
+			if (breakpointCount > 0 && executed > 0 && breakpoints[PC])
+			{
+				RequestStop(StopReason::Breakpoint, PC);
+				return true;
+			}
+		}
+		return false;
+	}
+
+	void RequestStop(StopReason reason, uint16_t address)
+	{
+		stopRequested = true;
+		stopReason = reason;
+		stopAddress = address;
+		cycleLimit = 0;
+	}
+
+	// A jump or branch to its own address can only be left through an
+	// interrupt, so once no event is scheduled that could raise one the
+	// program has stopped for good. Test ROMs report pass/fail this way.
+	void CheckTrap(uint16_t address)
+	{
+		if (PC == address && scheduler.Empty() && !nmiPending)
+			RequestStop(StopReason::Trap, address);
+	}
+
+	// Between instructions: runs the events that are due, then takes a
+	// waiting interrupt, NMI first.
+	void ServiceEvents()
+	{
+		if (cycles >= scheduler.NextCycle())
+			scheduler.RunDue(cycles);
+		if (nmiPending)
+		{
+			nmiPending = false;
+			Interrupt(0xFFFA);
+		}
+		else if (irqLines != 0 && !(P & FlagI))
+			Interrupt(0xFFFE);
+	}
+
+	// Like BRK, but returns to PC itself and pushes the status without B.
+	void Interrupt(uint16_t vector)
+	{
+		StackPush(PC >> 8);
+		StackPush(PC & 0xFF);
+		StackPush(Status());
+		P |= FlagI;
+		PC = memory->ReadWord(vector);
+		cycles += interruptCycles;
+		ProfileCall();
+	}
+
+	// After I was cleared: a waiting IRQ ends the batch so it is taken.
+	void CheckUnmasked()
+	{
+		if (irqLines != 0 && !(P & FlagI))
+			cycleLimit = 0;
+	}
+
+	RunResult Finish(uint64_t startCycles, uint64_t executed)
+	{
+		RunResult result{};
+		result.reason = stopRequested ? stopReason : StopReason::BudgetExhausted;
+		result.address = stopRequested ? stopAddress : PC;
+		result.cycles = cycles - startCycles;
+		result.instructions = executed;
+		return result;
+	}
+
+	// Runs the compiled block at PC and returns how many instructions ran,
+	// or zero when there is none, its code has changed since it was
+	// compiled, or it does not fit the budget.
+	uint64_t RunCompiled()
+		requires NativeCode
+	{
+		if (compiledBlocks.empty() || !compiledBlocks[PC])
+			return 0;
+		const CompiledBlock *compiled = compiledBlocks[PC];
+		const Block *block = blockCache.Lookup(PC);
+		if (!block)
+			return 0;
+		if (!compiledValid[PC])
+		{
+			// Checked again whenever the decoded block is rebuilt.
+			if (block->end - block->start != compiled->size)
+				return 0;
+			for (uint16_t i = 0; i < compiled->size; i++)
+				if (memory->ReadByte(PC + i) != compiled->code[i])
+					return 0;
+			compiledValid[PC] = true;
+		}
+		if (cycles + block->maxCycles > cycleLimit)
+			return 0;
+		return compiled->run(*this);
+	}
+
+	// Runs the translation of the block at PC, translating it first once it
+	// is hot, and returns how many instructions ran. Zero means the block
+	// is left to the interpreter: it is cold, or does not fit the budget.
+	uint64_t RunTranslated()
+		requires NativeCode
+	{
+#if OTWO_JIT_CORE
+		if (!jitEnabled)
+			return 0;
+		const uint8_t *entry = jit.Lookup(PC);
+		if (!entry)
+		{
+			Block *block = blockCache.Lookup(PC);
+			if (!block || ++block->executions < jitThreshold)
+				return 0;
+			entry = jit.Compile(*this, *block);
+			if (!entry)
+				return 0;
+		}
+		translatedInstructions = 0;
+		jit.Run(*this, entry);
+		return translatedInstructions;
+#else
+		return 0;
+#endif
+	}
+
+	// Runs the block at PC as compiled or translated code where possible,
+	// and returns how many instructions ran.
+	uint64_t RunNative()
+	{
+		if constexpr (NativeCode)
+		{
+			if (uint64_t executed = RunCompiled())
+				return executed;
+			return RunTranslated();
+		}
+		return 0;
+	}
+
+	// Runs instructions until the cycle counter reaches cycleLimit or a
+	// handler requests a stop, and returns how many were executed.
+	// Opcodes come from the decoded block at PC rather than from memory;
+	// the handlers still read their operands through PC.
+	uint64_t Execute()
+	{
+		uint64_t executed = 0;
+		const DecodedInstruction *next = nullptr;
+		const DecodedInstruction *end = nullptr;
+#if OTWO_THREADED_CORE
+		// Direct threading: every handler ends by jumping straight to the
+		// next opcode's handler, so each opcode has its own indirect branch
+		// for the predictor to learn instead of sharing one in a loop.
+		// Decoded instructions dispatch on DecodedInstruction::dispatch,
+		// which also covers the fused pairs after the opcodes. The label
+		// addresses never change, so the table is filled once per thread
+		// rather than on every call: translated code and writes into code
+		// end batches often.
+		thread_local void *labels[FusedDispatch + FusedPairCount];
+		thread_local bool labelsReady = false;
+		if (!labelsReady)
+		{
+			for (auto &label : labels)
+				label = &&unknown;
+#define OTWO_THREADED_LABEL(opcode, handler, bytes, base_cycles) labels[opcode] = &&op_##opcode;
+			OTWO_OPCODES(OTWO_THREADED_LABEL)
+#undef OTWO_THREADED_LABEL
+			void **fusedLabel = labels + FusedDispatch;
+#define OTWO_FUSED_LABEL(first, first_handler, first_cycles, second, second_handler, second_cycles) \
+	*fusedLabel++ = &&fused_##first##_##second;
+			OTWO_FUSED_PAIRS(OTWO_FUSED_LABEL)
+#undef OTWO_FUSED_LABEL
+			labelsReady = true;
+		}
+
+#define OTWO_NEXT_OPCODE()          \
+	if (cycles >= cycleLimit)       \
+		return executed;            \
+	executed++;                     \
+	if (next == end)                \
+		goto enter_block;           \
+	PC++;                           \
+	goto *labels[(next++)->dispatch]
+		OTWO_NEXT_OPCODE();
+
+	enter_block:
+		if (uint64_t native = RunNative())
+		{
+			// One was already counted for this dispatch.
+			executed += native - 1;
+			OTWO_NEXT_OPCODE();
+		}
+		if (const Block *block = blockCache.Lookup(PC))
+		{
+			next = block->instructions.data();
+			end = next + block->instructions.size();
+			PC++;
+			goto *labels[(next++)->dispatch];
+		}
+		goto *labels[FetchInstruction()];
+
+#define OTWO_THREADED_HANDLER(opcode, handler, bytes, base_cycles) \
+	op_##opcode:                                                   \
+		Profile(opcode);                                           \
+		cycles += base_cycles;                                     \
+		handler();                                                 \
+		OTWO_NEXT_OPCODE();
+		OTWO_OPCODES(OTWO_THREADED_HANDLER)
+#undef OTWO_THREADED_HANDLER
+
+		// Both instructions of a pair in one body, which saves the second
+		// its dispatch. The budget is still checked in between, and the
+		// first may have stopped the CPU or dropped the block.
+#define OTWO_FUSED_HANDLER(first, first_handler, first_cycles, second, second_handler, second_cycles) \
+	fused_##first##_##second:                                                                       \
+		Profile(first);                                                                              \
+		cycles += first_cycles;                                                                      \
+		first_handler();                                                                             \
+		if (cycles >= cycleLimit)                                                                    \
+			return executed;                                                                         \
+		executed++;                                                                                  \
+		next++;                                                                                      \
+		PC++;                                                                                        \
+		Profile(second);                                                                             \
+		cycles += second_cycles;                                                                     \
+		second_handler();                                                                            \
+		OTWO_NEXT_OPCODE();
+		OTWO_FUSED_PAIRS(OTWO_FUSED_HANDLER)
+#undef OTWO_FUSED_HANDLER
+
+	unknown:
+		Profile(memory->ReadByte(PC - 1));
+		cycles += unknownCycles;
+		Unknown();
+		OTWO_NEXT_OPCODE();
+#undef OTWO_NEXT_OPCODE
+#else
+		while (cycles < cycleLimit)
+		{
+			executed++;
+			if (next == end)
+			{
+				if (uint64_t native = RunNative())
+				{
+					executed += native - 1;
+					continue;
+				}
+				const Block *block = blockCache.Lookup(PC);
+				if (!block)
+				{
+					Dispatch(FetchInstruction());
+					continue;
+				}
+				next = block->instructions.data();
+				end = next + block->instructions.size();
+			}
+			PC++;
+			Dispatch((next++)->opcode);
+		}
+		return executed;
+#endif
+	}
+
+	// Undocumented opcodes are treated as two-cycle no-ops.
+	static constexpr uint8_t unknownCycles = 2;
+	static constexpr uint8_t interruptCycles = 7;
+
+	template <void (CPU::*Operation)(), uint8_t BaseCycles>
+	static void Invoke(CPU &cpu)
+	{
+		cpu.cycles += BaseCycles;
+		(cpu.*Operation)();
+	}
+
+	static constexpr std::array<Handler, 256> BuildDispatchTable()
+	{
+		std::array<Handler, 256> table{};
+		table.fill(&Invoke<&CPU::Unknown, unknownCycles>);
+#define OTWO_DISPATCH_ENTRY(opcode, handler, bytes, base_cycles) table[opcode] = &Invoke<&CPU::handler, base_cycles>;
+		OTWO_OPCODES(OTWO_DISPATCH_ENTRY)
+#undef OTWO_DISPATCH_ENTRY
+		return table;
+	}
+
+	Memory *memory;
+	BlockCache blockCache;
+	Jit jit;
+	bool jitEnabled{};
+	uint32_t jitThreshold{};
+	uint64_t translatedInstructions{}; // counted by translated code
+	// Indexed by start address; empty until a program is loaded.
+	std::vector<const CompiledBlock *> compiledBlocks;
+	// Set once a compiled block has been checked against memory, and
+	// cleared when the decoded block it was checked with is dropped.
+	std::bitset<0x10000> compiledValid;
+	uint16_t PC{};	  // program counter
+	uint8_t A{};	  // accumulator
+	uint8_t X{};	  // x index
+	uint8_t Y{};	  // y index
+	uint8_t S{};	  // stack pointer
+	uint8_t P{};	  // processor status; N, Z and C are kept lazily below
+	// N, Z and C are written by nearly every instruction and nearly always
+	// overwritten before anything reads them, so they are kept as the last
+	// instruction produced them and only assembled into P by Status().
+	// Z is set when the low byte of nzResult is zero, N when bit 7 or 8 is.
+	uint16_t nzResult{1};
+	uint8_t carry{};  // 0 or 1
+	uint64_t cycles{}; // cycles elapsed since power-on
+	uint64_t instructions{}; // instructions executed since power-on
+
+	uint64_t cycleLimit{};	// the running batch ends when cycles reach this
+	bool stopRequested{};
+	Scheduler scheduler;
+	uint32_t irqLines{}; // one bit per asserted IRQ line
+	bool nmiPending{};
+	StopReason stopReason{};
+	uint16_t stopAddress{};
+
+	// The state of features that are compiled out takes no space.
+	struct Disabled
+	{
+	};
+	template <bool Enabled, typename T>
+	using Feature = std::conditional_t<Enabled, T, Disabled>;
+
+	[[no_unique_address]] Feature<Policy::Breakpoints, size_t> breakpointCount{};
+	[[no_unique_address]] Feature<Policy::Breakpoints, std::bitset<0x10000>> breakpoints;
+	[[no_unique_address]] Feature<Policy::Tracing, Tracer *> tracer{};
+	[[no_unique_address]] Feature<Policy::MemoryHooks, AccessHandler> accessHandler;
+	[[no_unique_address]] Feature<Policy::Profiling, Profiler *> profiler{};
+};
+
+// Built once at compile time from the opcode list in opcodes.h.
+template <typename Policy>
+inline constexpr std::array<typename BasicCPU<Policy>::Handler, 256> BasicCPU<Policy>::dispatchTable = BasicCPU<Policy>::BuildDispatchTable();
@@ -0,0 +1,48 @@
+#pragma once
+
+// Features of the CPU chosen at compile time. A feature that is off is
+// compiled out of BasicCPU entirely, so it costs nothing at run time; one
+// that is on is checked where it applies.
+//
+// Tracing:     RunFor records every instruction into a Tracer while one is set.
+// Breakpoints: RunFor and RunUntil stop at breakpoints.
+// MemoryHooks: data reads and writes are reported to an access handler.
+// Profiling:   instructions, calls and returns are reported to a Profiler.
+// Decimal:     ADC and SBC honour the D flag; without it they are always
+//              binary, as on the NES's 2A03.
+// ExactCycles: page crossings and taken branches cost their extra cycles;
+//              without it every instruction costs its base cycles.
+
+// What production runs use: nothing that only a debugger needs. Blocks
+// translated by the JIT and compiled by OTwoAot run under this policy only.
+struct ReleasePolicy {
+	static constexpr bool Tracing = false;
+	static constexpr bool Breakpoints = false;
+	static constexpr bool MemoryHooks = false;
+	static constexpr bool Profiling = false;
+	static constexpr bool Decimal = true;
+	static constexpr bool ExactCycles = true;
+};
+
+// Everything on, for debugging and tools that inspect a run.
+struct DebugPolicy {
+	static constexpr bool Tracing = true;
+	static constexpr bool Breakpoints = true;
+	static constexpr bool MemoryHooks = true;
+	static constexpr bool Profiling = true;
+	static constexpr bool Decimal = true;
+	static constexpr bool ExactCycles = true;
+};
+
+// A release build that profiles. It interprets, since translated code
+// does not report its instructions.
+struct ProfilePolicy : ReleasePolicy {
+	static constexpr bool Profiling = true;
+};
+
+template <typename Policy>
+class BasicCPU;
+
+using CPU = BasicCPU<ReleasePolicy>;
+using DebugCPU = BasicCPU<DebugPolicy>;
+using ProfileCPU = BasicCPU<ProfilePolicy>;
@@ -0,0 +1,26 @@
+#pragma once
+
+// Generated by OTwoFuse from profile data. Do not edit; see OTwoFuse.cpp
+// to regenerate it.
+//
+// Opcode pairs the block decoder fuses into one handler, most executed
+// first, as FUSED(first, its handler, its cycles, second, its handler,
+// its cycles), each with the share of the profiled instructions that ran
+// as the pair.
+#define OTWO_FUSED_PAIRS(FUSED) \
+	FUSED(CMP_ZP, CMP<&CPU::FetchByteZP>, 3, BNE_REL, BNE, 2) /* 15.77% */ \
+	FUSED(PLA_IMP, PLA, 4, AND_IMM, AND<&CPU::FetchByte>, 2) /* 8.10% */ \
+	FUSED(PHP_IMP, PHP, 3, LDA_ZP, LDA<&CPU::FetchByteZP>, 3) /* 7.89% */ \
+	FUSED(PHP_IMP, PHP, 3, CMP_ZP, CMP<&CPU::FetchByteZP>, 3) /* 7.89% */ \
+	FUSED(AND_IMM, AND<&CPU::FetchByte>, 2, CMP_ZP, CMP<&CPU::FetchByteZP>, 3) /* 7.89% */ \
+	FUSED(PLP_IMP, PLP, 4, PHP_IMP, PHP, 3) /* 7.39% */ \
+	FUSED(LDA_ZP, LDA<&CPU::FetchByteZP>, 3, STA_ABS, STA<&CPU::AddressAbsolute>, 4) /* 0.99% */ \
+	FUSED(STA_ABS, STA<&CPU::AddressAbsolute>, 4, LDA_ZP, LDA<&CPU::FetchByteZP>, 3) /* 0.99% */ \
+	FUSED(LDA_ZP, LDA<&CPU::FetchByteZP>, 3, JSR_ABS, JSR, 6) /* 0.99% */ \
+	FUSED(LDA_ZP, LDA<&CPU::FetchByteZP>, 3, EOR_ZP, EOR<&CPU::FetchByteZP>, 3) /* 0.64% */ \
+	FUSED(LDA_ZP, LDA<&CPU::FetchByteZP>, 3, SBC_INDX, SBC<&CPU::FetchByteIndirectX>, 6) /* 0.49% */ \
+	FUSED(LDA_ZP, LDA<&CPU::FetchByteZP>, 3, SBC_INDY, SBC<&CPU::FetchByteIndirectY>, 5) /* 0.49% */ \
+	FUSED(LDA_ZP, LDA<&CPU::FetchByteZP>, 3, ADC_ABSX, ADC<&CPU::FetchByteAbsoluteX>, 4) /* 0.49% */ \
+	FUSED(LDA_ZP, LDA<&CPU::FetchByteZP>, 3, ADC_ABSY, ADC<&CPU::FetchByteAbsoluteY>, 4) /* 0.49% */ \
+	FUSED(LDA_ZP, LDA<&CPU::FetchByteZP>, 3, ADC_ZPX, ADC<&CPU::FetchByteZPX>, 4) /* 0.49% */ \
+	FUSED(LDA_ZP, LDA<&CPU::FetchByteZP>, 3, ADC_INDY, ADC<&CPU::FetchByteIndirectY>, 5) /* 0.49% */
@@ -0,0 +1,158 @@
+#include "inputqueue.h"
+#include <algorithm>
+#include <bit>
+#include <cerrno>
+#include <cstring>
+#include <thread>
+
+#if defined(_WIN32)
+#include <io.h>
+#else
+#include <poll.h>
+#include <unistd.h>
+#endif
+
+namespace {
+
+// How long Feed waits for input before it looks at the stop flag again.
+constexpr int StopCheckMilliseconds = 50;
+
+// Returns the bytes read, zero at end of file, or -1 with errno set.
+// EAGAIN means nothing arrived within StopCheckMilliseconds.
+long ReadSome(int fd, uint8_t* bytes, size_t size)
+{
+#if defined(_WIN32)
+    return _read(fd, bytes, static_cast<unsigned>(size));
+#else
+    pollfd waiting{ fd, POLLIN, 0 };
+    int ready = poll(&waiting, 1, StopCheckMilliseconds);
+    if (ready <= 0) {
+        errno = ready == 0 ? EAGAIN : errno;
+        return -1;
+    }
+    return read(fd, bytes, size);
+#endif
+}
+
+}
+
+InputQueue::InputQueue(size_t capacity, uint64_t pollInterval)
+    : mask(std::bit_ceil(std::max<size_t>(capacity, 1)) - 1), pollInterval(pollInterval)
+{
+    ring = std::make_unique<uint8_t[]>(mask + 1);
+}
+
+size_t InputQueue::Push(const uint8_t* bytes, size_t size)
+{
+    size_t capacity = mask + 1;
+    size_t t = tail.load(std::memory_order_relaxed);
+    if (capacity - (t - cachedHead) < size) {
+        cachedHead = head.load(std::memory_order_acquire);
+    }
+    size = std::min(size, capacity - (t - cachedHead));
+
+    // In two pieces when it wraps around the end of the ring.
+    size_t offset = t & mask;
+    size_t first = std::min(size, capacity - offset);
+    std::memcpy(ring.get() + offset, bytes, first);
+    std::memcpy(ring.get(), bytes + first, size - first);
+    tail.store(t + size, std::memory_order_release);
+    return size;
+}
+
+void InputQueue::Feed(int fd)
+{
+    uint8_t bytes[4096];
+    while (!stopping.load(std::memory_order_acquire)) {
+        long size = ReadSome(fd, bytes, sizeof(bytes));
+        if (size < 0 && (errno == EINTR || errno == EAGAIN)) {
+            continue;
+        }
+        if (size <= 0) {
+            break;
+        }
+        for (size_t pushed = 0; pushed < size_t(size) && !stopping.load(std::memory_order_acquire);) {
+            size_t count = Push(bytes + pushed, size - pushed);
+            if (count == 0) {
+                std::this_thread::yield();
+            }
+            pushed += count;
+        }
+    }
+    Close();
+}
+
+size_t InputQueue::Available()
+{
+    cachedTail = tail.load(std::memory_order_acquire);
+    return cachedTail - head.load(std::memory_order_relaxed);
+}
+
+bool InputQueue::Pop(uint8_t& value)
+{
+    size_t h = head.load(std::memory_order_relaxed);
+    if (h == cachedTail) {
+        cachedTail = tail.load(std::memory_order_acquire);
+        if (h == cachedTail) {
+            return false;
+        }
+    }
+    value = ring[h & mask];
+    head.store(h + 1, std::memory_order_release);
+    return true;
+}
+
+uint8_t InputQueue::Read(uint8_t offset)
+{
+    switch (offset) {
+    case Data: {
+        uint8_t value = 0;
+        Pop(value);
+        UpdateIRQ();
+        return value;
+    }
+    case Status: {
+        // Closed is read first, so no byte pushed before Close is missed.
+        bool ended = closed.load(std::memory_order_acquire);
+        size_t waiting = Available();
+        uint8_t status = interruptsOn ? InterruptsOn : 0;
+        status |= waiting > 0 ? DataReady : 0;
+        status |= ended && waiting == 0 ? EndOfInput : 0;
+        return status;
+    }
+    case Count:
+        return uint8_t(std::min<size_t>(Available(), 0xFF));
+    }
+    return 0;
+}
+
+void InputQueue::Write(uint8_t offset, uint8_t value)
+{
+    if (offset == Control) {
+        interruptsOn = (value & InterruptsOn) != 0;
+        UpdateIRQ();
+    }
+}
+
+void InputQueue::Poll()
+{
+    pollScheduled = false;
+    UpdateIRQ();
+}
+
+void InputQueue::UpdateIRQ()
+{
+    bool ended = closed.load(std::memory_order_acquire);
+    bool waiting = Available() > 0;
+    bool asserted = interruptsOn && waiting;
+    if (asserted != irqAsserted) {
+        irqAsserted = asserted;
+        setIRQ(asserted);
+    }
+    // While the IRQ is asserted, the guest's next read of the data port
+    // looks again, so the ring only needs watching while it is empty.
+    if (interruptsOn && !waiting && !ended && !pollScheduled) {
+        pollScheduled = true;
+        schedulePoll();
+    }
+}
@@ -0,0 +1,119 @@
+#pragma once
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+
+#include "machine.h"
+
+// A memory-mapped input device fed by a host thread. Bytes go through a
+// single-producer, single-consumer ring: one host thread (a stdin reader,
+// a file replay, a test driver) pushes, and the thread running the machine
+// pops as the guest reads the data port, with no locks or system calls on
+// either side. Head and tail sit on cache lines of their own, and each side
+// keeps a copy of the other's index so that it only reloads it when the
+// ring looks full or empty.
+//
+// With interrupts enabled, the device asserts its IRQ line while data is
+// waiting. The producer cannot touch the CPU, so the emulation thread looks
+// at the ring every pollInterval cycles through a scheduled event, only
+// while interrupts are enabled and more input may come.
+//
+// Registers, from the page-aligned address the device is attached at:
+//
+//   +0  Data      read: pops the next byte, or zero when there is none
+//   +1  Status    read: DataReady, EndOfInput, InterruptsOn
+//   +1  Control   write: InterruptsOn enables the IRQ
+//   +2  Count     read: bytes waiting, up to 255
+//
+// The rest of the page reads as zero and ignores writes.
+class InputQueue {
+
+public:
+	static constexpr uint8_t Data = 0;
+	static constexpr uint8_t Status = 1;
+	static constexpr uint8_t Control = 1;
+	static constexpr uint8_t Count = 2;
+
+	// Status and control bits.
+	static constexpr uint8_t DataReady = 0b00000001;
+	static constexpr uint8_t EndOfInput = 0b00000010; // closed and drained
+	static constexpr uint8_t InterruptsOn = 0b10000000;
+
+	static constexpr size_t DefaultCapacity = 64 << 10;
+	static constexpr uint64_t DefaultPollInterval = 1000;
+
+	// The capacity is rounded up to a power of two.
+	explicit InputQueue(size_t capacity = DefaultCapacity, uint64_t pollInterval = DefaultPollInterval);
+
+	InputQueue(const InputQueue&) = delete;
+	InputQueue& operator=(const InputQueue&) = delete;
+
+	// Maps the device over the page at address, which must be page-aligned,
+	// with its interrupt on the CPU's IRQ line irqLine. The queue has to
+	// outlive every run of the machine.
+	template <typename Policy>
+	bool Attach(BasicMachine<Policy>& machine, uint16_t address, unsigned irqLine = 0)
+	{
+		BasicCPU<Policy>& cpu = machine.cpu;
+		setIRQ = [&cpu, irqLine](bool asserted) { cpu.SetIRQ(irqLine, asserted); };
+		schedulePoll = [this, &cpu] { cpu.ScheduleEvent(cpu.Cycles() + pollInterval, [this](uint64_t) { Poll(); }); };
+		return machine.memory.MapIO(address, Memory::PageSize, [this](uint16_t port) { return Read(port & 0xFF); },
+									[this](uint16_t port, uint8_t value) { Write(port & 0xFF, value); });
+	}
+
+	// Producer side. Queues as many bytes as fit and returns how many did.
+	size_t Push(const uint8_t* bytes, size_t size);
+
+	// Producer side. Pushes everything read from fd, waiting for room when
+	// the ring is full, and closes the queue at end of file, on an error or
+	// once Stop is called. Blocks, so it runs on a thread of its own. On
+	// Windows a read that is waiting for input is not interrupted by Stop.
+	void Feed(int fd);
+
+	// Makes Feed return soon, from any thread, so that its thread can be
+	// joined before the queue goes away.
+	void Stop()
+	{
+		stopping.store(true, std::memory_order_release);
+	}
+
+	// Producer side. No more input will come; the guest sees EndOfInput
+	// once it has read the rest.
+	void Close()
+	{
+		closed.store(true, std::memory_order_release);
+	}
+
+	// Consumer side: bytes waiting.
+	size_t Available();
+
+private:
+	bool Pop(uint8_t& value);
+	uint8_t Read(uint8_t offset);
+	void Write(uint8_t offset, uint8_t value);
+	void Poll();
+	// Asserts the IRQ while interrupts are on and data is waiting, and
+	// keeps polling while more input may come.
+	void UpdateIRQ();
+
+	std::unique_ptr<uint8_t[]> ring;
+	size_t mask;
+	uint64_t pollInterval;
+	std::atomic<bool> closed{ false };
+	std::atomic<bool> stopping{ false };
+
+	// Written by the consumer only.
+	alignas(64) std::atomic<size_t> head{ 0 };
+	size_t cachedTail = 0;
+	// Written by the producer only.
+	alignas(64) std::atomic<size_t> tail{ 0 };
+	size_t cachedHead = 0;
+
+	alignas(64) bool interruptsOn = false;
+	bool irqAsserted = false;
+	bool pollScheduled = false;
+	std::function<void(bool asserted)> setIRQ;
+	std::function<void()> schedulePoll;
+};
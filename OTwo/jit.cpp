@@ -0,0 +1,1246 @@
+#include "jit.h"
+
+#if OTWO_JIT_CORE
+#include <cstring>
+#include <sys/mman.h>
+
+#include "blockcache.h"
+#include "cpu.h"
+#include "defines.h"
+
+namespace {
+
+// Each chunk is twice the size of the one before, up to MaxChunkSize.
+// Past CodeLimit in all, the translations are dropped and start over.
+constexpr size_t FirstChunkSize = 64 * 1024;
+constexpr size_t MaxChunkSize = 1024 * 1024;
+constexpr size_t CodeLimit = 16 * 1024 * 1024;
+
+// x86-64 register numbers.
+enum Reg : uint8_t { RAX = 0, RCX = 1, RDX = 2, RBX = 3, RSI = 6, RDI = 7 };
+
+// Condition codes for Jcc.
+enum Cond : uint8_t { Above = 0x7, Equal = 0x4, NotEqual = 0x5 };
+
+// ALU operations for the group-1 immediate forms (81 /op).
+enum AluOp : uint8_t { Add = 0, Or = 1, And = 4, Sub = 5, Xor = 6, Cmp = 7 };
+
+// Emits the handful of instruction forms the translator uses. Memory
+// operands are always [base + disp32]; the CPU lives in rbx.
+class Assembler {
+
+public:
+    std::vector<uint8_t> bytes;
+
+    size_t Size() const
+    {
+        return bytes.size();
+    }
+
+    void Byte(uint8_t value)
+    {
+        bytes.push_back(value);
+    }
+
+    void Word(uint16_t value)
+    {
+        Byte(value & 0xFF);
+        Byte(value >> 8);
+    }
+
+    void Dword(uint32_t value)
+    {
+        for (int i = 0; i < 4; i++) {
+            Byte(value >> (8 * i));
+        }
+    }
+
+    void Qword(uint64_t value)
+    {
+        for (int i = 0; i < 8; i++) {
+            Byte(value >> (8 * i));
+        }
+    }
+
+    void Mem(uint8_t reg, Reg base, int32_t disp)
+    {
+        Byte(0x80 | (reg << 3) | base);
+        Dword(disp);
+    }
+
+    // movzx reg, byte [base + disp]
+    void LoadByte(Reg reg, Reg base, int32_t disp)
+    {
+        Byte(0x0F);
+        Byte(0xB6);
+        Mem(reg, base, disp);
+    }
+
+    // movzx reg, word [base + disp]
+    void LoadWord(Reg reg, Reg base, int32_t disp)
+    {
+        Byte(0x0F);
+        Byte(0xB7);
+        Mem(reg, base, disp);
+    }
+
+    // mov byte [base + disp], reg8
+    void StoreByte(Reg base, int32_t disp, Reg reg)
+    {
+        Byte(0x88);
+        Mem(reg, base, disp);
+    }
+
+    // mov word [base + disp], reg16
+    void StoreWord(Reg base, int32_t disp, Reg reg)
+    {
+        Byte(0x66);
+        Byte(0x89);
+        Mem(reg, base, disp);
+    }
+
+    void StoreByteImm(Reg base, int32_t disp, uint8_t value)
+    {
+        Byte(0xC6);
+        Mem(0, base, disp);
+        Byte(value);
+    }
+
+    void StoreWordImm(Reg base, int32_t disp, uint16_t value)
+    {
+        Byte(0x66);
+        Byte(0xC7);
+        Mem(0, base, disp);
+        Word(value);
+    }
+
+    // op byte [base + disp], imm8
+    void AluByteMem(AluOp op, Reg base, int32_t disp, uint8_t value)
+    {
+        Byte(0x80);
+        Mem(op, base, disp);
+        Byte(value);
+    }
+
+    void TestByteMem(Reg base, int32_t disp, uint8_t value)
+    {
+        Byte(0xF6);
+        Mem(0, base, disp);
+        Byte(value);
+    }
+
+    void TestWordMem(Reg base, int32_t disp, uint16_t value)
+    {
+        Byte(0x66);
+        Byte(0xF7);
+        Mem(0, base, disp);
+        Word(value);
+    }
+
+    // op qword [base + disp], imm32
+    void AluQwordMem(AluOp op, Reg base, int32_t disp, int32_t value)
+    {
+        Byte(0x48);
+        Byte(0x81);
+        Mem(op, base, disp);
+        Dword(value);
+    }
+
+    // op reg32, imm32
+    void AluImm(AluOp op, Reg reg, uint32_t value)
+    {
+        Byte(0x81);
+        Byte(0xC0 | (op << 3) | reg);
+        Dword(value);
+    }
+
+    // op dst32, src32 with op one of the 0x01-style opcodes below.
+    void AluReg(uint8_t opcode, Reg dst, Reg src)
+    {
+        Byte(opcode);
+        Byte(0xC0 | (src << 3) | dst);
+    }
+
+    void AddReg(Reg dst, Reg src) { AluReg(0x01, dst, src); }
+    void OrReg(Reg dst, Reg src) { AluReg(0x09, dst, src); }
+    void AndReg(Reg dst, Reg src) { AluReg(0x21, dst, src); }
+    void SubReg(Reg dst, Reg src) { AluReg(0x29, dst, src); }
+    void XorReg(Reg dst, Reg src) { AluReg(0x31, dst, src); }
+    void CmpReg(Reg dst, Reg src) { AluReg(0x39, dst, src); }
+    void MovReg(Reg dst, Reg src) { AluReg(0x89, dst, src); }
+
+    // movzx dst32, src8
+    void ZeroExtendByte(Reg dst, Reg src)
+    {
+        Byte(0x0F);
+        Byte(0xB6);
+        Byte(0xC0 | (dst << 3) | src);
+    }
+
+    void ShiftLeft(Reg reg, uint8_t count)
+    {
+        Byte(0xC1);
+        Byte(0xE0 | reg);
+        Byte(count);
+    }
+
+    void ShiftRight(Reg reg, uint8_t count)
+    {
+        Byte(0xC1);
+        Byte(0xE8 | reg);
+        Byte(count);
+    }
+
+    void Not(Reg reg)
+    {
+        Byte(0xF7);
+        Byte(0xD0 | reg);
+    }
+
+    // setae reg8
+    void SetAboveOrEqual(Reg reg)
+    {
+        Byte(0x0F);
+        Byte(0x93);
+        Byte(0xC0 | reg);
+    }
+
+    void MovImm(Reg reg, uint32_t value)
+    {
+        Byte(0xB8 | reg);
+        Dword(value);
+    }
+
+    void MovImm64(Reg reg, uint64_t value)
+    {
+        Byte(0x48);
+        Byte(0xB8 | reg);
+        Qword(value);
+    }
+
+    // mov rax, [rax]
+    void LoadPointer()
+    {
+        Byte(0x48);
+        Byte(0x8B);
+        Byte(0x00);
+    }
+
+    void TestRax()
+    {
+        Byte(0x48);
+        Byte(0x85);
+        Byte(0xC0);
+    }
+
+    // Emits a jump with a zero displacement and returns where to patch it.
+    size_t Jump(Cond cond)
+    {
+        Byte(0x0F);
+        Byte(0x80 | cond);
+        Dword(0);
+        return Size();
+    }
+
+    size_t Jump()
+    {
+        Byte(0xE9);
+        Dword(0);
+        return Size();
+    }
+
+    // Points the jump ending at patch to the current position.
+    void Bind(size_t patch)
+    {
+        int32_t displacement = int32_t(Size() - patch);
+        std::memcpy(&bytes[patch - 4], &displacement, 4);
+    }
+
+    void JumpRax()
+    {
+        Byte(0xFF);
+        Byte(0xE0);
+    }
+
+    void CallRax()
+    {
+        Byte(0xFF);
+        Byte(0xD0);
+    }
+};
+
+}
+
+// Offsets of the CPU state the translated code touches, relative to the
+// CPU in rbx.
+struct JitLayout {
+    int32_t pc, a, x, y, s, p, nzResult, carry, cycles, cycleLimit, translatedInstructions, irqLines;
+
+    explicit JitLayout(CPU& cpu)
+    {
+        const char* base = reinterpret_cast<const char*>(&cpu);
+        auto offset = [base](const void* member) { return int32_t(reinterpret_cast<const char*>(member) - base); };
+        pc = offset(&cpu.PC);
+        a = offset(&cpu.A);
+        x = offset(&cpu.X);
+        y = offset(&cpu.Y);
+        s = offset(&cpu.S);
+        p = offset(&cpu.P);
+        nzResult = offset(&cpu.nzResult);
+        carry = offset(&cpu.carry);
+        cycles = offset(&cpu.cycles);
+        cycleLimit = offset(&cpu.cycleLimit);
+        translatedInstructions = offset(&cpu.translatedInstructions);
+        irqLines = offset(&cpu.irqLines);
+    }
+};
+
+namespace {
+
+// Translates one block. Cycles of inline instructions are summed and
+// added to the counter before anything that can observe it: a handler
+// call, a memory access that may take the slow path, or an exit.
+class BlockTranslator {
+
+public:
+    BlockTranslator(CPU& cpu, Memory& memory, const std::vector<const uint8_t*>& entries)
+        : layout(cpu), readPages(memory.ReadPageTable()), writePages(memory.WritePageTable()), entries(entries)
+    {
+    }
+
+    std::vector<uint8_t> Translate(const Block& block)
+    {
+        count = block.instructions.size();
+
+        // Leave right away unless the whole block fits in the budget.
+        a.Byte(0x48); // mov rax, [rbx + cycles]
+        a.Byte(0x8B);
+        a.Mem(RAX, RBX, layout.cycles);
+        a.Byte(0x48); // add rax, imm32
+        a.Byte(0x05);
+        a.Dword(block.maxCycles);
+        a.Byte(0x48); // cmp rax, [rbx + cycleLimit]
+        a.Byte(0x3B);
+        a.Mem(RAX, RBX, layout.cycleLimit);
+        exits.push_back(a.Jump(Above));
+        a.AluQwordMem(Add, RBX, layout.translatedInstructions, int32_t(count));
+
+        for (index = 0; index < count; index++) {
+            const DecodedInstruction& instruction = block.instructions[index];
+            if (TranslateInline(instruction)) {
+                continue;
+            }
+            CallHandler(instruction);
+            if (IsLast()) {
+                endsWithJump = true;
+                ChainDynamic();
+            } else {
+                CheckStop();
+            }
+        }
+
+        // A block cut short by its size limit or a device page runs on
+        // into the next one.
+        const DecodedInstruction& last = block.instructions.back();
+        if (!endsWithJump) {
+            Chain(uint16_t(last.address + last.bytes));
+        }
+
+        for (size_t exit : exits) {
+            a.Bind(exit);
+        }
+        Return();
+        return std::move(a.bytes);
+    }
+
+private:
+    bool IsLast() const
+    {
+        return index + 1 == count;
+    }
+
+    void FlushCycles()
+    {
+        if (pendingCycles > 0) {
+            a.AluQwordMem(Add, RBX, layout.cycles, int32_t(pendingCycles));
+            pendingCycles = 0;
+        }
+    }
+
+    void Return()
+    {
+        a.Byte(0x5B); // pop rbx
+        a.Byte(0xC3); // ret
+    }
+
+    // Sets PC and continues in the translation at target, if there is one.
+    void Chain(uint16_t target)
+    {
+        FlushCycles();
+        a.StoreWordImm(RBX, layout.pc, target);
+        a.MovImm64(RAX, reinterpret_cast<uint64_t>(&entries[target]));
+        a.LoadPointer();
+        a.TestRax();
+        exits.push_back(a.Jump(Equal));
+        a.JumpRax();
+    }
+
+    // Continues at whatever PC a handler left behind.
+    void ChainDynamic()
+    {
+        a.LoadWord(RAX, RBX, layout.pc);
+        a.MovImm64(RCX, reinterpret_cast<uint64_t>(entries.data()));
+        a.Byte(0x48); // mov rax, [rcx + rax * 8]
+        a.Byte(0x8B);
+        a.Byte(0x04);
+        a.Byte(0xC1);
+        a.TestRax();
+        exits.push_back(a.Jump(Equal));
+        a.JumpRax();
+    }
+
+    // Runs the instruction through its handler, which adds its own cycles
+    // and leaves PC after the instruction.
+    void CallHandler(const DecodedInstruction& instruction)
+    {
+        FlushCycles();
+        a.StoreWordImm(RBX, layout.pc, instruction.address + 1);
+        a.Byte(0x48); // mov rdi, rbx
+        a.Byte(0x89);
+        a.Byte(0xDF);
+        a.MovImm64(RAX, reinterpret_cast<uint64_t>(CPU::dispatchTable[instruction.opcode]));
+        a.CallRax();
+    }
+
+    // After a handler call: the handler may have written into translated
+    // code or stopped the CPU, and both zero the cycle limit.
+    void CheckStop()
+    {
+        a.Byte(0x48); // cmp qword [rbx + cycleLimit], 0
+        a.Byte(0x83);
+        a.Mem(Cmp, RBX, layout.cycleLimit);
+        a.Byte(0);
+        size_t resume = a.Jump(NotEqual);
+        a.AluQwordMem(Sub, RBX, layout.translatedInstructions, int32_t(count - index - 1));
+        Return();
+        a.Bind(resume);
+    }
+
+    // Loads the page pointer for address into rax and returns the jump
+    // taken when the page has no direct mapping.
+    size_t LoadPage(const void* const* table, uint16_t address)
+    {
+        a.MovImm64(RAX, reinterpret_cast<uint64_t>(&table[address >> 8]));
+        a.LoadPointer();
+        a.TestRax();
+        return a.Jump(Equal);
+    }
+
+    // Emits the inline form of an instruction whose operand is loaded by
+    // loadOperand into ecx, with the handler as the slow path.
+    template <typename LoadOperand, typename Operation>
+    void WithSlowPath(const DecodedInstruction& instruction, uint8_t cycles, LoadOperand loadOperand, Operation operation)
+    {
+        FlushCycles();
+        std::vector<size_t> slow;
+        loadOperand(slow);
+        operation();
+        a.AluQwordMem(Add, RBX, layout.cycles, cycles);
+        size_t join = a.Jump();
+        for (size_t patch : slow) {
+            a.Bind(patch);
+        }
+        CallHandler(instruction);
+        CheckStop();
+        a.Bind(join);
+    }
+
+    // Sets N and Z from the byte in reg, which must be zero-extended.
+    void SetNZ(Reg reg)
+    {
+        a.StoreWord(RBX, layout.nzResult, reg);
+    }
+
+    // A register transfer or increment: eax holds the result.
+    void StoreResult(int32_t target)
+    {
+        a.ZeroExtendByte(RAX, RAX);
+        a.StoreByte(RBX, target, RAX);
+        SetNZ(RAX);
+    }
+
+    void SetOverflowFromEax()
+    {
+        // eax holds the overflow in bit 7.
+        a.AluImm(And, RAX, 0x80);
+        a.ShiftRight(RAX, 1);
+        a.AluByteMem(And, RBX, layout.p, uint8_t(~CPU::FlagV));
+        a.Byte(0x08); // or byte [rbx + p], al
+        a.Mem(RAX, RBX, layout.p);
+    }
+
+    // A + ecx + C, with ecx already complemented for SBC.
+    void EmitAdd()
+    {
+        a.LoadByte(RAX, RBX, layout.a);
+        a.LoadByte(RDX, RBX, layout.carry);
+        a.AddReg(RDX, RAX);
+        a.AddReg(RDX, RCX);
+        // V = ~(A ^ M) & (A ^ r) & 0x80
+        a.MovReg(RSI, RAX);
+        a.XorReg(RSI, RCX);
+        a.Not(RSI);
+        a.XorReg(RAX, RDX);
+        a.AndReg(RAX, RSI);
+        SetOverflowFromEax();
+        a.StoreByte(RBX, layout.a, RDX);
+        a.ZeroExtendByte(RAX, RDX);
+        SetNZ(RAX);
+        a.ShiftRight(RDX, 8);
+        a.StoreByte(RBX, layout.carry, RDX);
+    }
+
+    void EmitCompare(int32_t reg)
+    {
+        a.LoadByte(RAX, RBX, reg);
+        a.CmpReg(RAX, RCX);
+        a.SetAboveOrEqual(RDX);
+        a.StoreByte(RBX, layout.carry, RDX);
+        a.SubReg(RAX, RCX);
+        a.ZeroExtendByte(RAX, RAX);
+        SetNZ(RAX);
+    }
+
+    // Emits the operation applied to the operand in ecx, or returns false
+    // when the opcode's operation has no inline form.
+    bool EmitOperation(uint8_t operation)
+    {
+        switch (operation) {
+        case 0: // LDA
+            a.StoreByte(RBX, layout.a, RCX);
+            SetNZ(RCX);
+            return true;
+        case 1: // LDX
+            a.StoreByte(RBX, layout.x, RCX);
+            SetNZ(RCX);
+            return true;
+        case 2: // LDY
+            a.StoreByte(RBX, layout.y, RCX);
+            SetNZ(RCX);
+            return true;
+        case 3: // AND
+        case 4: // ORA
+        case 5: // EOR
+            a.LoadByte(RAX, RBX, layout.a);
+            if (operation == 3)
+                a.AndReg(RAX, RCX);
+            else if (operation == 4)
+                a.OrReg(RAX, RCX);
+            else
+                a.XorReg(RAX, RCX);
+            a.StoreByte(RBX, layout.a, RAX);
+            SetNZ(RAX);
+            return true;
+        case 6: // CMP
+            EmitCompare(layout.a);
+            return true;
+        case 7: // CPX
+            EmitCompare(layout.x);
+            return true;
+        case 8: // CPY
+            EmitCompare(layout.y);
+            return true;
+        case 9: // ADC
+            EmitAdd();
+            return true;
+        case 10: // SBC
+            a.AluImm(Xor, RCX, 0xFF);
+            EmitAdd();
+            return true;
+        case 11: // BIT
+            a.LoadByte(RAX, RBX, layout.a);
+            a.AndReg(RAX, RCX);
+            a.MovReg(RDX, RCX);
+            a.AluImm(And, RDX, 0x80);
+            a.ShiftLeft(RDX, 1);
+            a.OrReg(RAX, RDX);
+            SetNZ(RAX);
+            a.MovReg(RAX, RCX);
+            a.ShiftLeft(RAX, 1);
+            SetOverflowFromEax();
+            return true;
+        }
+        return false;
+    }
+
+    enum Addressing : uint8_t { Immediate, ZeroPage, Absolute, ZeroPageX, ZeroPageY, AbsoluteX, AbsoluteY, IndirectX, IndirectY };
+
+    // Points rax at the page holding the operand of a memory instruction,
+    // adding to slow the jumps taken when a page it goes through has no
+    // direct mapping.
+    // Indexed modes leave the offset within the page in rsi and return
+    // true; otherwise the offset is the constant low byte of the address.
+    bool LoadOperandPage(const void* const* table, Addressing addressing, uint16_t operand, std::vector<size_t>& slow, bool pagePenalty)
+    {
+        if (addressing == ZeroPage || addressing == Absolute) {
+            uint16_t address = addressing == ZeroPage ? operand & 0xFF : operand;
+            a.MovImm64(RAX, reinterpret_cast<uint64_t>(&table[address >> 8]));
+            a.LoadPointer();
+            a.TestRax();
+            slow.push_back(a.Jump(Equal));
+            return false;
+        }
+
+        bool indirect = addressing == IndirectX || addressing == IndirectY;
+        if (indirect) {
+            // The pointer is read from zero page, wrapping within it; rdi
+            // keeps it for the page penalty of (zp),Y.
+            slow.push_back(LoadPage(reinterpret_cast<const void* const*>(readPages), 0));
+            if (addressing == IndirectX) {
+                a.LoadByte(RSI, RBX, layout.x);
+                a.AluImm(Add, RSI, operand & 0xFF);
+                a.AluImm(And, RSI, 0xFF);
+                LoadOperand(RCX, true, 0);
+                a.AluImm(Add, RSI, 1);
+                a.AluImm(And, RSI, 0xFF);
+                LoadOperand(RDX, true, 0);
+            } else {
+                a.LoadByte(RCX, RAX, operand & 0xFF);
+                a.LoadByte(RDX, RAX, (operand + 1) & 0xFF);
+            }
+            a.ShiftLeft(RDX, 8);
+            a.OrReg(RCX, RDX);
+            a.MovReg(RDI, RCX);
+            a.MovReg(RSI, RCX);
+            if (addressing == IndirectY) {
+                a.LoadByte(RDX, RBX, layout.y);
+                a.AddReg(RSI, RDX);
+                a.AluImm(And, RSI, 0xFFFF);
+            }
+        } else {
+            bool zeroPage = addressing == ZeroPageX || addressing == ZeroPageY;
+            bool byX = addressing == ZeroPageX || addressing == AbsoluteX;
+            a.LoadByte(RSI, RBX, byX ? layout.x : layout.y);
+            a.AluImm(Add, RSI, zeroPage ? operand & 0xFF : operand);
+            a.AluImm(And, RSI, zeroPage ? 0xFF : 0xFFFF);
+        }
+        a.MovReg(RDX, RSI);
+        a.ShiftRight(RDX, 8);
+        a.MovImm64(RCX, reinterpret_cast<uint64_t>(table));
+        a.Byte(0x48); // mov rax, [rcx + rdx * 8]
+        a.Byte(0x8B);
+        a.Byte(0x04);
+        a.Byte(0xD1);
+        a.TestRax();
+        slow.push_back(a.Jump(Equal));
+        if (pagePenalty) {
+            if (indirect) {
+                a.ShiftRight(RDI, 8);
+                a.CmpReg(RDX, RDI);
+            } else {
+                a.AluImm(Cmp, RDX, operand >> 8);
+            }
+            size_t samePage = a.Jump(Equal);
+            a.AluQwordMem(Add, RBX, layout.cycles, 1);
+            a.Bind(samePage);
+        }
+        a.AluImm(And, RSI, 0xFF);
+        return true;
+    }
+
+    // movzx reg, byte [rax + offset]
+    void LoadOperand(Reg reg, bool indexed, uint16_t operand)
+    {
+        if (!indexed) {
+            a.LoadByte(reg, RAX, operand & 0xFF);
+            return;
+        }
+        a.Byte(0x0F);
+        a.Byte(0xB6);
+        a.Byte(0x04 | (reg << 3));
+        a.Byte(0x30);
+    }
+
+    // mov byte [rax + offset], reg
+    void StoreOperand(Reg reg, bool indexed, uint16_t operand)
+    {
+        if (!indexed) {
+            a.StoreByte(RAX, operand & 0xFF, reg);
+            return;
+        }
+        a.Byte(0x88);
+        a.Byte(0x04 | (reg << 3));
+        a.Byte(0x30);
+    }
+
+    struct MemoryForm {
+        uint8_t opcode;
+        uint8_t operation;
+        Addressing addressing;
+    };
+
+    // Read instructions, with the operation numbers of EmitOperation.
+    static constexpr MemoryForm readForms[] = {
+        { LDA_IMM, 0, Immediate }, { LDA_ZP, 0, ZeroPage }, { LDA_ZPX, 0, ZeroPageX }, { LDA_ABS, 0, Absolute }, { LDA_ABSX, 0, AbsoluteX }, { LDA_ABSY, 0, AbsoluteY }, { LDA_INDX, 0, IndirectX }, { LDA_INDY, 0, IndirectY },
+        { LDX_IMM, 1, Immediate }, { LDX_ZP, 1, ZeroPage }, { LDX_ZPY, 1, ZeroPageY }, { LDX_ABS, 1, Absolute }, { LDX_ABSY, 1, AbsoluteY },
+        { LDY_IMM, 2, Immediate }, { LDY_ZP, 2, ZeroPage }, { LDY_ZPX, 2, ZeroPageX }, { LDY_ABS, 2, Absolute }, { LDY_ABSX, 2, AbsoluteX },
+        { AND_IMM, 3, Immediate }, { AND_ZP, 3, ZeroPage }, { AND_ZPX, 3, ZeroPageX }, { AND_ABS, 3, Absolute }, { AND_ABSX, 3, AbsoluteX }, { AND_ABSY, 3, AbsoluteY }, { AND_INDX, 3, IndirectX }, { AND_INDY, 3, IndirectY },
+        { ORA_IMM, 4, Immediate }, { ORA_ZP, 4, ZeroPage }, { ORA_ZPX, 4, ZeroPageX }, { ORA_ABS, 4, Absolute }, { ORA_ABSX, 4, AbsoluteX }, { ORA_ABSY, 4, AbsoluteY }, { ORA_INDX, 4, IndirectX }, { ORA_INDY, 4, IndirectY },
+        { EOR_IMM, 5, Immediate }, { EOR_ZP, 5, ZeroPage }, { EOR_ZPX, 5, ZeroPageX }, { EOR_ABS, 5, Absolute }, { EOR_ABSX, 5, AbsoluteX }, { EOR_ABSY, 5, AbsoluteY }, { EOR_INDX, 5, IndirectX }, { EOR_INDY, 5, IndirectY },
+        { CMP_IMM, 6, Immediate }, { CMP_ZP, 6, ZeroPage }, { CMP_ZPX, 6, ZeroPageX }, { CMP_ABS, 6, Absolute }, { CMP_ABSX, 6, AbsoluteX }, { CMP_ABSY, 6, AbsoluteY }, { CMP_INDX, 6, IndirectX }, { CMP_INDY, 6, IndirectY },
+        { CPX_IMM, 7, Immediate }, { CPX_ZP, 7, ZeroPage }, { CPX_ABS, 7, Absolute },
+        { CPY_IMM, 8, Immediate }, { CPY_ZP, 8, ZeroPage }, { CPY_ABS, 8, Absolute },
+        { ADC_IMM, 9, Immediate }, { ADC_ZP, 9, ZeroPage }, { ADC_ZPX, 9, ZeroPageX }, { ADC_ABS, 9, Absolute }, { ADC_ABSX, 9, AbsoluteX }, { ADC_ABSY, 9, AbsoluteY }, { ADC_INDX, 9, IndirectX }, { ADC_INDY, 9, IndirectY },
+        { SBC_IMM, 10, Immediate }, { SBC_ZP, 10, ZeroPage }, { SBC_ZPX, 10, ZeroPageX }, { SBC_ABS, 10, Absolute }, { SBC_ABSX, 10, AbsoluteX }, { SBC_ABSY, 10, AbsoluteY }, { SBC_INDX, 10, IndirectX }, { SBC_INDY, 10, IndirectY },
+        { BIT_ZP, 11, ZeroPage }, { BIT_ABS, 11, Absolute },
+    };
+
+    // Stores and increments, as {opcode, 0 STA / 1 STX / 2 STY / 3 INC /
+    // 4 DEC, addressing}.
+    static constexpr MemoryForm writeForms[] = {
+        { STA_ZP, 0, ZeroPage }, { STA_ZPX, 0, ZeroPageX }, { STA_ABS, 0, Absolute }, { STA_ABSX, 0, AbsoluteX }, { STA_ABSY, 0, AbsoluteY }, { STA_INDX, 0, IndirectX }, { STA_INDY, 0, IndirectY },
+        { STX_ZP, 1, ZeroPage }, { STX_ZPY, 1, ZeroPageY }, { STX_ABS, 1, Absolute },
+        { STY_ZP, 2, ZeroPage }, { STY_ZPX, 2, ZeroPageX }, { STY_ABS, 2, Absolute },
+        { INC_ZP, 3, ZeroPage }, { INC_ZPX, 3, ZeroPageX }, { INC_ABS, 3, Absolute }, { INC_ABSX, 3, AbsoluteX },
+        { DEC_ZP, 4, ZeroPage }, { DEC_ZPX, 4, ZeroPageX }, { DEC_ABS, 4, Absolute }, { DEC_ABSX, 4, AbsoluteX },
+    };
+
+    bool TranslateRead(const DecodedInstruction& instruction, uint8_t cycles)
+    {
+        for (const MemoryForm& form : readForms) {
+            if (form.opcode != instruction.opcode) {
+                continue;
+            }
+
+            // Decimal mode is left to the handler.
+            bool arithmetic = form.operation == 9 || form.operation == 10;
+            if (form.addressing == Immediate && !arithmetic) {
+                pendingCycles += cycles;
+                a.MovImm(RCX, instruction.operand & 0xFF);
+                EmitOperation(form.operation);
+                return true;
+            }
+
+            WithSlowPath(instruction, cycles, [&](std::vector<size_t>& slow) {
+                if (arithmetic) {
+                    a.TestByteMem(RBX, layout.p, CPU::FlagD);
+                    slow.push_back(a.Jump(NotEqual));
+                }
+                if (form.addressing == Immediate) {
+                    a.MovImm(RCX, instruction.operand & 0xFF);
+                    return;
+                }
+                bool penalty = form.addressing == AbsoluteX || form.addressing == AbsoluteY || form.addressing == IndirectY;
+                bool indexed = LoadOperandPage(reinterpret_cast<const void* const*>(readPages), form.addressing, instruction.operand, slow, penalty);
+                LoadOperand(RCX, indexed, instruction.operand); }, [&] { EmitOperation(form.operation); });
+            return true;
+        }
+        return false;
+    }
+
+    bool TranslateWrite(const DecodedInstruction& instruction, uint8_t cycles)
+    {
+        for (const MemoryForm& form : writeForms) {
+            if (form.opcode != instruction.opcode) {
+                continue;
+            }
+
+            // Pages holding code have no write pointer, so writes into
+            // translated code always go through the handler.
+            bool indexed = false;
+            WithSlowPath(instruction, cycles, [&](std::vector<size_t>& slow) { indexed = LoadOperandPage(reinterpret_cast<const void* const*>(writePages), form.addressing, instruction.operand, slow, false); }, [&] {
+                if (form.operation < 3) {
+                    const int32_t sources[] = { layout.a, layout.x, layout.y };
+                    a.LoadByte(RCX, RBX, sources[form.operation]);
+                    StoreOperand(RCX, indexed, instruction.operand);
+                    return;
+                }
+                LoadOperand(RCX, indexed, instruction.operand);
+                a.AluImm(form.operation == 3 ? Add : Sub, RCX, 1);
+                StoreOperand(RCX, indexed, instruction.operand);
+                a.ZeroExtendByte(RCX, RCX);
+                SetNZ(RCX); });
+            return true;
+        }
+        return false;
+    }
+
+    // CLI is left to its handler, which ends the batch when an IRQ is
+    // waiting.
+    bool TranslateImplied(uint8_t opcode)
+    {
+        switch (opcode) {
+        case NOP_IMP:
+            return true;
+        case CLC_IMP:
+            a.StoreByteImm(RBX, layout.carry, 0);
+            return true;
+        case SEC_IMP:
+            a.StoreByteImm(RBX, layout.carry, 1);
+            return true;
+        case CLD_IMP:
+            a.AluByteMem(And, RBX, layout.p, uint8_t(~CPU::FlagD));
+            return true;
+        case SED_IMP:
+            a.AluByteMem(Or, RBX, layout.p, CPU::FlagD);
+            return true;
+        case SEI_IMP:
+            a.AluByteMem(Or, RBX, layout.p, CPU::FlagI);
+            return true;
+        case CLV_IMP:
+            a.AluByteMem(And, RBX, layout.p, uint8_t(~CPU::FlagV));
+            return true;
+        }
+
+        struct Transfer {
+            uint8_t opcode;
+            int32_t from, to;
+            int8_t delta;
+        };
+        const Transfer transfers[] = {
+            { INX_IMP, layout.x, layout.x, 1 },
+            { INY_IMP, layout.y, layout.y, 1 },
+            { DEX_IMP, layout.x, layout.x, -1 },
+            { DEY_IMP, layout.y, layout.y, -1 },
+            { TAX_IMP, layout.a, layout.x, 0 },
+            { TAY_IMP, layout.a, layout.y, 0 },
+            { TXA_IMP, layout.x, layout.a, 0 },
+            { TYA_IMP, layout.y, layout.a, 0 },
+            { TSX_IMP, layout.s, layout.x, 0 },
+        };
+        for (const Transfer& transfer : transfers) {
+            if (transfer.opcode == opcode) {
+                a.LoadByte(RAX, RBX, transfer.from);
+                if (transfer.delta != 0) {
+                    a.AluImm(transfer.delta > 0 ? Add : Sub, RAX, 1);
+                }
+                StoreResult(transfer.to);
+                return true;
+            }
+        }
+
+        if (opcode == TXS_IMP) {
+            a.LoadByte(RAX, RBX, layout.x);
+            a.StoreByte(RBX, layout.s, RAX);
+            return true;
+        }
+
+        if (opcode == ASL_ACC || opcode == LSR_ACC || opcode == ROL_ACC || opcode == ROR_ACC) {
+            a.LoadByte(RAX, RBX, layout.a);
+            a.LoadByte(RCX, RBX, layout.carry);
+            a.MovReg(RDX, RAX);
+            if (opcode == ASL_ACC || opcode == ROL_ACC) {
+                a.ShiftRight(RDX, 7);
+                a.AddReg(RAX, RAX);
+                if (opcode == ROL_ACC)
+                    a.OrReg(RAX, RCX);
+            } else {
+                a.AluImm(And, RDX, 1);
+                a.ShiftRight(RAX, 1);
+                if (opcode == ROR_ACC) {
+                    a.ShiftLeft(RCX, 7);
+                    a.OrReg(RAX, RCX);
+                }
+            }
+            a.StoreByte(RBX, layout.carry, RDX);
+            StoreResult(layout.a);
+            return true;
+        }
+        return false;
+    }
+
+    // Pushes onto the stack page through the pointer in rax.
+    void Push(Reg reg)
+    {
+        a.LoadByte(RSI, RBX, layout.s);
+        StoreOperand(reg, true, 0);
+        a.AluByteMem(Sub, RBX, layout.s, 1);
+    }
+
+    void Pull(Reg reg)
+    {
+        a.AluByteMem(Add, RBX, layout.s, 1);
+        a.LoadByte(RSI, RBX, layout.s);
+        LoadOperand(reg, true, 0);
+    }
+
+    // Builds Status() | B in ecx without touching rax.
+    void LoadStatus()
+    {
+        // N is bit 7 or 8 of nzResult; Z is set when its low byte minus
+        // one borrows.
+        a.LoadWord(RDX, RBX, layout.nzResult);
+        a.MovReg(RDI, RDX);
+        a.ShiftRight(RDI, 1);
+        a.OrReg(RDI, RDX);
+        a.AluImm(And, RDI, CPU::FlagN);
+        a.AluImm(And, RDX, 0xFF);
+        a.AluImm(Sub, RDX, 1);
+        a.ShiftRight(RDX, 7);
+        a.AluImm(And, RDX, CPU::FlagZ);
+        a.OrReg(RDI, RDX);
+        a.LoadByte(RDX, RBX, layout.carry);
+        a.OrReg(RDI, RDX);
+        a.LoadByte(RCX, RBX, layout.p);
+        a.AluImm(And, RCX, uint8_t(~(CPU::FlagN | CPU::FlagZ | CPU::FlagC | CPU::FlagB)));
+        a.OrReg(RCX, RDI);
+        a.AluImm(Or, RCX, CPU::FlagU | CPU::FlagB);
+    }
+
+    // SetStatus with the value in ecx.
+    void StoreStatus()
+    {
+        a.MovReg(RDX, RCX);
+        a.AluImm(And, RDX, uint8_t(~(CPU::FlagN | CPU::FlagZ | CPU::FlagC | CPU::FlagB | CPU::FlagU)));
+        a.StoreByte(RBX, layout.p, RDX);
+        a.MovReg(RDX, RCX);
+        a.AluImm(And, RDX, CPU::FlagC);
+        a.StoreByte(RBX, layout.carry, RDX);
+        a.MovReg(RDX, RCX);
+        a.AluImm(And, RDX, CPU::FlagN);
+        a.ShiftLeft(RDX, 1);
+        a.ShiftRight(RCX, 1);
+        a.AluImm(And, RCX, 1);
+        a.AluImm(Xor, RCX, 1);
+        a.OrReg(RDX, RCX);
+        a.StoreWord(RBX, layout.nzResult, RDX);
+    }
+
+    // After an inline PLP: an IRQ that PLP unmasked ends the batch, as
+    // CheckUnmasked does.
+    void CheckUnmasked(const DecodedInstruction& instruction)
+    {
+        a.Byte(0x83); // cmp dword [rbx + irqLines], 0
+        a.Mem(Cmp, RBX, layout.irqLines);
+        a.Byte(0);
+        size_t none = a.Jump(Equal);
+        a.TestByteMem(RBX, layout.p, CPU::FlagI);
+        size_t masked = a.Jump(NotEqual);
+        a.StoreWordImm(RBX, layout.pc, instruction.address + instruction.bytes);
+        a.AluQwordMem(And, RBX, layout.cycleLimit, 0);
+        a.AluQwordMem(Sub, RBX, layout.translatedInstructions, int32_t(count - index - 1));
+        Return();
+        a.Bind(none);
+        a.Bind(masked);
+    }
+
+    // Pushes, pulls, JSR and RTS go through the stack page's pointer while
+    // it has one. JSR and RTS always end their block.
+    bool TranslateStack(const DecodedInstruction& instruction, uint8_t cycles)
+    {
+        uint8_t opcode = instruction.opcode;
+        bool push = opcode == PHA_IMP || opcode == PHP_IMP || opcode == JSR_ABS;
+        bool pull = opcode == PLA_IMP || opcode == PLP_IMP || opcode == RTS_IMP;
+        if ((!push && !pull) || ((opcode == JSR_ABS || opcode == RTS_IMP) && !IsLast())) {
+            return false;
+        }
+
+        const void* const* table = push ? reinterpret_cast<const void* const*>(writePages) : reinterpret_cast<const void* const*>(readPages);
+        WithSlowPath(instruction, cycles, [&](std::vector<size_t>& slow) { slow.push_back(LoadPage(table, 0x100)); }, [&] {
+            switch (opcode) {
+            case PHA_IMP:
+                a.LoadByte(RCX, RBX, layout.a);
+                Push(RCX);
+                break;
+            case PHP_IMP:
+                LoadStatus();
+                Push(RCX);
+                break;
+            case JSR_ABS: {
+                // The return address pushed is that of the last byte of the JSR.
+                uint16_t pc = instruction.address + 2;
+                a.MovImm(RCX, pc >> 8);
+                Push(RCX);
+                a.MovImm(RCX, pc & 0xFF);
+                Push(RCX);
+                break;
+            }
+            case PLA_IMP:
+                Pull(RCX);
+                a.StoreByte(RBX, layout.a, RCX);
+                SetNZ(RCX);
+                break;
+            case PLP_IMP:
+                Pull(RCX);
+                StoreStatus();
+                break;
+            case RTS_IMP:
+                Pull(RCX);
+                Pull(RDX);
+                a.ShiftLeft(RDX, 8);
+                a.OrReg(RCX, RDX);
+                a.AluImm(Add, RCX, 1);
+                a.StoreWord(RBX, layout.pc, RCX);
+                break;
+            } });
+
+        if (opcode == PLP_IMP) {
+            CheckUnmasked(instruction);
+        } else if (opcode == JSR_ABS) {
+            Chain(instruction.operand);
+            endsWithJump = true;
+        } else if (opcode == RTS_IMP) {
+            ChainDynamic();
+            endsWithJump = true;
+        }
+        return true;
+    }
+
+    static bool IsBranch(uint8_t opcode)
+    {
+        switch (opcode) {
+        case BEQ_REL:
+        case BNE_REL:
+        case BMI_REL:
+        case BPL_REL:
+        case BCS_REL:
+        case BCC_REL:
+        case BVS_REL:
+        case BVC_REL:
+            return true;
+        }
+        return false;
+    }
+
+    bool TranslateBranch(const DecodedInstruction& instruction, uint8_t cycles)
+    {
+        if (!IsBranch(instruction.opcode)) {
+            return false;
+        }
+
+        uint16_t next = instruction.address + 2;
+        uint16_t target = next + int8_t(instruction.operand);
+        // A branch to itself is a trap, which test programs put after each
+        // check; when taken, the handler reports it.
+        bool trap = target == instruction.address;
+
+        FlushCycles();
+        size_t notTaken = 0;
+        switch (instruction.opcode) {
+        case BEQ_REL:
+        case BNE_REL:
+            a.AluByteMem(Cmp, RBX, layout.nzResult, 0);
+            notTaken = a.Jump(instruction.opcode == BEQ_REL ? NotEqual : Equal);
+            break;
+        case BMI_REL:
+        case BPL_REL:
+            a.TestWordMem(RBX, layout.nzResult, 0x180);
+            notTaken = a.Jump(instruction.opcode == BMI_REL ? Equal : NotEqual);
+            break;
+        case BCS_REL:
+        case BCC_REL:
+            a.AluByteMem(Cmp, RBX, layout.carry, 0);
+            notTaken = a.Jump(instruction.opcode == BCS_REL ? Equal : NotEqual);
+            break;
+        case BVS_REL:
+        case BVC_REL:
+            a.TestByteMem(RBX, layout.p, CPU::FlagV);
+            notTaken = a.Jump(instruction.opcode == BVS_REL ? Equal : NotEqual);
+            break;
+        }
+
+        if (trap) {
+            CallHandler(instruction);
+            ChainDynamic();
+        } else {
+            pendingCycles = cycles + (CPU::PageCrossed(next, target) ? 2 : 1);
+            Chain(target);
+        }
+        a.Bind(notTaken);
+        pendingCycles = cycles;
+        Chain(next);
+        endsWithJump = true;
+        return true;
+    }
+
+    bool TranslateInline(const DecodedInstruction& instruction)
+    {
+        uint8_t cycles = cyclesOf(instruction.opcode);
+
+        if (instruction.opcode == JMP_ABS) {
+            if (instruction.operand == instruction.address) {
+                return false;
+            }
+            pendingCycles += cycles;
+            Chain(instruction.operand);
+            endsWithJump = true;
+            return true;
+        }
+
+        if (TranslateBranch(instruction, cycles)) {
+            return true;
+        }
+
+        if (TranslateRead(instruction, cycles) || TranslateWrite(instruction, cycles) || TranslateStack(instruction, cycles)) {
+            return true;
+        }
+
+        size_t before = a.Size();
+        if (TranslateImplied(instruction.opcode)) {
+            pendingCycles += cycles;
+            return true;
+        }
+        a.bytes.resize(before);
+        return false;
+    }
+
+    static uint8_t cyclesOf(uint8_t opcode)
+    {
+        static constexpr std::array<uint8_t, 256> table = [] {
+            std::array<uint8_t, 256> cycles{};
+#define OTWO_OPCODE_CYCLES(opcode, handler, bytes, base_cycles) cycles[opcode] = base_cycles;
+            OTWO_OPCODES(OTWO_OPCODE_CYCLES)
+#undef OTWO_OPCODE_CYCLES
+            return cycles;
+        }();
+        return table[opcode];
+    }
+
+    Assembler a;
+    JitLayout layout;
+    const uint8_t* const* readPages;
+    uint8_t* const* writePages;
+    const std::vector<const uint8_t*>& entries;
+    std::vector<size_t> exits;
+    size_t count = 0;
+    size_t index = 0;
+    uint32_t pendingCycles = 0;
+    bool endsWithJump = false;
+};
+
+// push rbx; mov rbx, rdi; jmp rsi
+constexpr uint8_t enterCode[] = { 0x53, 0x48, 0x89, 0xFB, 0xFF, 0xE6 };
+
+const uint8_t* noEntries[0x10000];
+
+}
+
+Jit::Jit()
+    : table(noEntries)
+{
+    if (!AddChunk(FirstChunkSize)) {
+        return;
+    }
+    std::memcpy(chunks[0].code, enterCode, sizeof(enterCode));
+    used = sizeof(enterCode);
+    // Where the system refuses executable mappings, everything is
+    // interpreted.
+    if (!Protect(false)) {
+        munmap(chunks[0].code, chunks[0].size);
+        chunks.clear();
+    }
+}
+
+Jit::~Jit()
+{
+    for (const Chunk& chunk : chunks) {
+        munmap(chunk.code, chunk.size);
+    }
+}
+
+bool Jit::AddChunk(size_t size)
+{
+    void* memory = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED) {
+        return false;
+    }
+    // The chunk before stays executable from now on.
+    Protect(false);
+    chunks.push_back({ static_cast<uint8_t*>(memory), size });
+    used = 0;
+    mapped += size;
+    writable = true;
+    return true;
+}
+
+bool Jit::Protect(bool writable)
+{
+    if (chunks.empty() || this->writable == writable) {
+        return true;
+    }
+    const Chunk& chunk = chunks.back();
+    if (mprotect(chunk.code, chunk.size, writable ? PROT_READ | PROT_WRITE : PROT_READ | PROT_EXEC) != 0) {
+        return false;
+    }
+    this->writable = writable;
+    return true;
+}
+
+const uint8_t* Jit::Compile(CPU& cpu, const Block& block)
+{
+    if (chunks.empty()) {
+        return nullptr;
+    }
+    if (entries.empty()) {
+        entries.resize(0x10000);
+        table = entries.data();
+    }
+
+    BlockTranslator translator(cpu, *cpu.memory, entries);
+    std::vector<uint8_t> bytes = translator.Translate(block);
+    if (bytes.size() > chunks.back().size - used) {
+        if (mapped >= CodeLimit) {
+            Flush();
+        }
+        if (bytes.size() > chunks.back().size - used) {
+            size_t size = std::min(chunks.back().size * 2, MaxChunkSize);
+            if (!AddChunk(std::max(size, bytes.size()))) {
+                return nullptr;
+            }
+        }
+    }
+
+    Protect(true);
+    uint8_t* entry = chunks.back().code + used;
+    std::memcpy(entry, bytes.data(), bytes.size());
+    used += bytes.size();
+    entries[block.start] = entry;
+    return entry;
+}
+
+void Jit::Run(CPU& cpu, const uint8_t* entry)
+{
+    Protect(false);
+    auto enter = reinterpret_cast<void (*)(CPU*, const uint8_t*)>(chunks[0].code);
+    enter(&cpu, entry);
+}
+
+// Only called between runs, so no translated code is on the stack.
+void Jit::Flush()
+{
+    std::fill(entries.begin(), entries.end(), nullptr);
+    Protect(false);
+    while (chunks.size() > 1) {
+        munmap(chunks.back().code, chunks.back().size);
+        mapped -= chunks.back().size;
+        chunks.pop_back();
+    }
+    writable = false;
+    used = sizeof(enterCode);
+}
+
+#else
+
+Jit::Jit()
+    : table(nullptr)
+{
+}
+
+Jit::~Jit()
+{
+}
+
+const uint8_t* Jit::Compile(CPU&, const Block&)
+{
+    return nullptr;
+}
+
+void Jit::Run(CPU&, const uint8_t*)
+{
+}
+
+void Jit::Flush()
+{
+}
+
+#endif
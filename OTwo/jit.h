@@ -0,0 +1,85 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "cpupolicy.h"
+
+// The translator emits x86-64 code and needs executable memory from mmap.
+#if defined(OTWO_JIT) && defined(__x86_64__) && (defined(__unix__) || defined(__APPLE__))
+#define OTWO_JIT_CORE 1
+#else
+#define OTWO_JIT_CORE 0
+#endif
+
+struct Block;
+
+// Translates hot blocks into native code. Register transfers, flag
+// operations and accumulator shifts, loads, stores, logic, arithmetic and
+// compares in every addressing mode, INC/DEC, pushes and pulls, JSR/RTS,
+// branches and JMP abs are emitted inline; everything else calls the
+// instruction's handler. Memory is reached through the page
+// tables, so device pages and pages holding code fall back to the handler,
+// and a handler that invalidates code ends the translated run.
+//
+// Translated blocks jump straight into each other through a table of entry
+// points indexed by address. Every entry first checks that the whole block
+// fits in the cycle budget and returns to the interpreter otherwise.
+//
+// Code goes into chunks mapped as they fill, so a machine that translates
+// little takes little memory. The chunk being filled is writable while
+// Compile adds to it and executable while Run is in translated code, never
+// both at once.
+class Jit {
+
+public:
+	Jit();
+	~Jit();
+
+	Jit(const Jit&) = delete;
+	Jit& operator=(const Jit&) = delete;
+
+	bool Available() const
+	{
+		return !chunks.empty();
+	}
+
+	const uint8_t* Lookup(uint16_t address) const
+	{
+		return table[address];
+	}
+
+	// Translates the block and returns its entry point, or null when out
+	// of code space even after a flush.
+	const uint8_t* Compile(CPU& cpu, const Block& block);
+	void Run(CPU& cpu, const uint8_t* entry);
+
+	void Invalidate(uint16_t start)
+	{
+		if (!entries.empty())
+			entries[start] = nullptr;
+	}
+
+	// Drops every translation.
+	void Flush();
+
+private:
+	struct Chunk {
+		uint8_t* code;
+		size_t size;
+	};
+
+	bool AddChunk(size_t size);
+	// Makes the last chunk writable or executable.
+	bool Protect(bool writable);
+
+	// The first chunk starts with the code that enters translated code.
+	std::vector<Chunk> chunks;
+	size_t used = 0; // in the last chunk
+	size_t mapped = 0;
+	bool writable = false;
+	// Allocated by the first Compile, so that machines which never get hot
+	// go without it; until then Lookup reads a shared table of nulls.
+	std::vector<const uint8_t*> entries;
+	const uint8_t* const* table;
+};
@@ -0,0 +1,870 @@
+#include "lockstep.h"
+#include <algorithm>
+#include <array>
+
+#include "defines.h"
+#include "opcodes.h"
+
+// The per-lane loops are compiled for SSE2, AVX2 and AVX-512, and the
+// loader picks the best one the host supports.
+#if defined(__GNUC__) && !defined(__clang__) && defined(__x86_64__) && defined(__ELF__)
+#define OTWO_LOCKSTEP_CLONES __attribute__((target_clones("default", "avx2", "arch=skylake-avx512")))
+#else
+#define OTWO_LOCKSTEP_CLONES
+#endif
+
+// Runs the statement for every lane of the first count blocks, with b the
+// block and i the lane in it. Lanes past the last one in use hold stale
+// values and are computed along with the rest.
+#define OTWO_FOR_LANES(...)                                   \
+    for (size_t g = 0; g < count; g++) {                      \
+        Lockstep::LaneBlock& b = blocks[g];                   \
+        for (size_t i = 0; i < LockstepBlock; i++) {          \
+            __VA_ARGS__                                       \
+        }                                                     \
+    }
+
+namespace {
+
+using LaneBlock = Lockstep::LaneBlock;
+
+enum class Operation : uint8_t {
+    Scalar, // run on each lane's CPU
+    Nop,
+    LoadA,
+    LoadX,
+    LoadY,
+    And,
+    Or,
+    Xor,
+    Add,
+    Subtract,
+    CompareA,
+    CompareX,
+    CompareY,
+    Bit,
+    StoreA,
+    StoreX,
+    StoreY,
+    Increment,
+    Decrement,
+    ShiftLeft,
+    ShiftRight,
+    RotateLeft,
+    RotateRight,
+    ShiftLeftA,
+    ShiftRightA,
+    RotateLeftA,
+    RotateRightA,
+    IncrementX,
+    IncrementY,
+    DecrementX,
+    DecrementY,
+    TransferAX,
+    TransferAY,
+    TransferSX,
+    TransferXA,
+    TransferXS,
+    TransferYA,
+    ClearCarry,
+    SetCarry,
+    ClearOverflow,
+    ClearDecimal,
+    SetDecimal,
+    SetInterrupt,
+    // Branch conditions, written to condition[].
+    CarryClear,
+    CarrySet,
+    Equal,
+    NotEqual,
+    Plus,
+    Minus,
+    OverflowClear,
+    OverflowSet,
+    Jump,
+};
+
+enum class Addressing : uint8_t {
+    Implied,
+    Immediate,
+    ZeroPage,
+    ZeroPageX,
+    ZeroPageY,
+    Absolute,
+    AbsoluteX,
+    AbsoluteY,
+    IndirectX,
+    IndirectY,
+    Relative,
+};
+
+struct LaneForm {
+    uint8_t opcode;
+    Operation operation;
+    Addressing addressing;
+};
+
+// Every opcode the lanes run together; the rest are Scalar.
+constexpr LaneForm laneForms[] = {
+    { LDA_IMM, Operation::LoadA, Addressing::Immediate }, { LDA_ZP, Operation::LoadA, Addressing::ZeroPage }, { LDA_ZPX, Operation::LoadA, Addressing::ZeroPageX }, { LDA_ABS, Operation::LoadA, Addressing::Absolute }, { LDA_ABSX, Operation::LoadA, Addressing::AbsoluteX }, { LDA_ABSY, Operation::LoadA, Addressing::AbsoluteY }, { LDA_INDX, Operation::LoadA, Addressing::IndirectX }, { LDA_INDY, Operation::LoadA, Addressing::IndirectY },
+    { LDX_IMM, Operation::LoadX, Addressing::Immediate }, { LDX_ZP, Operation::LoadX, Addressing::ZeroPage }, { LDX_ZPY, Operation::LoadX, Addressing::ZeroPageY }, { LDX_ABS, Operation::LoadX, Addressing::Absolute }, { LDX_ABSY, Operation::LoadX, Addressing::AbsoluteY },
+    { LDY_IMM, Operation::LoadY, Addressing::Immediate }, { LDY_ZP, Operation::LoadY, Addressing::ZeroPage }, { LDY_ZPX, Operation::LoadY, Addressing::ZeroPageX }, { LDY_ABS, Operation::LoadY, Addressing::Absolute }, { LDY_ABSX, Operation::LoadY, Addressing::AbsoluteX },
+    { AND_IMM, Operation::And, Addressing::Immediate }, { AND_ZP, Operation::And, Addressing::ZeroPage }, { AND_ZPX, Operation::And, Addressing::ZeroPageX }, { AND_ABS, Operation::And, Addressing::Absolute }, { AND_ABSX, Operation::And, Addressing::AbsoluteX }, { AND_ABSY, Operation::And, Addressing::AbsoluteY }, { AND_INDX, Operation::And, Addressing::IndirectX }, { AND_INDY, Operation::And, Addressing::IndirectY },
+    { ORA_IMM, Operation::Or, Addressing::Immediate }, { ORA_ZP, Operation::Or, Addressing::ZeroPage }, { ORA_ZPX, Operation::Or, Addressing::ZeroPageX }, { ORA_ABS, Operation::Or, Addressing::Absolute }, { ORA_ABSX, Operation::Or, Addressing::AbsoluteX }, { ORA_ABSY, Operation::Or, Addressing::AbsoluteY }, { ORA_INDX, Operation::Or, Addressing::IndirectX }, { ORA_INDY, Operation::Or, Addressing::IndirectY },
+    { EOR_IMM, Operation::Xor, Addressing::Immediate }, { EOR_ZP, Operation::Xor, Addressing::ZeroPage }, { EOR_ZPX, Operation::Xor, Addressing::ZeroPageX }, { EOR_ABS, Operation::Xor, Addressing::Absolute }, { EOR_ABSX, Operation::Xor, Addressing::AbsoluteX }, { EOR_ABSY, Operation::Xor, Addressing::AbsoluteY }, { EOR_INDX, Operation::Xor, Addressing::IndirectX }, { EOR_INDY, Operation::Xor, Addressing::IndirectY },
+    { ADC_IMM, Operation::Add, Addressing::Immediate }, { ADC_ZP, Operation::Add, Addressing::ZeroPage }, { ADC_ZPX, Operation::Add, Addressing::ZeroPageX }, { ADC_ABS, Operation::Add, Addressing::Absolute }, { ADC_ABSX, Operation::Add, Addressing::AbsoluteX }, { ADC_ABSY, Operation::Add, Addressing::AbsoluteY }, { ADC_INDX, Operation::Add, Addressing::IndirectX }, { ADC_INDY, Operation::Add, Addressing::IndirectY },
+    { SBC_IMM, Operation::Subtract, Addressing::Immediate }, { SBC_ZP, Operation::Subtract, Addressing::ZeroPage }, { SBC_ZPX, Operation::Subtract, Addressing::ZeroPageX }, { SBC_ABS, Operation::Subtract, Addressing::Absolute }, { SBC_ABSX, Operation::Subtract, Addressing::AbsoluteX }, { SBC_ABSY, Operation::Subtract, Addressing::AbsoluteY }, { SBC_INDX, Operation::Subtract, Addressing::IndirectX }, { SBC_INDY, Operation::Subtract, Addressing::IndirectY },
+    { CMP_IMM, Operation::CompareA, Addressing::Immediate }, { CMP_ZP, Operation::CompareA, Addressing::ZeroPage }, { CMP_ZPX, Operation::CompareA, Addressing::ZeroPageX }, { CMP_ABS, Operation::CompareA, Addressing::Absolute }, { CMP_ABSX, Operation::CompareA, Addressing::AbsoluteX }, { CMP_ABSY, Operation::CompareA, Addressing::AbsoluteY }, { CMP_INDX, Operation::CompareA, Addressing::IndirectX }, { CMP_INDY, Operation::CompareA, Addressing::IndirectY },
+    { CPX_IMM, Operation::CompareX, Addressing::Immediate }, { CPX_ZP, Operation::CompareX, Addressing::ZeroPage }, { CPX_ABS, Operation::CompareX, Addressing::Absolute },
+    { CPY_IMM, Operation::CompareY, Addressing::Immediate }, { CPY_ZP, Operation::CompareY, Addressing::ZeroPage }, { CPY_ABS, Operation::CompareY, Addressing::Absolute },
+    { BIT_ZP, Operation::Bit, Addressing::ZeroPage }, { BIT_ABS, Operation::Bit, Addressing::Absolute },
+    { STA_ZP, Operation::StoreA, Addressing::ZeroPage }, { STA_ZPX, Operation::StoreA, Addressing::ZeroPageX }, { STA_ABS, Operation::StoreA, Addressing::Absolute }, { STA_ABSX, Operation::StoreA, Addressing::AbsoluteX }, { STA_ABSY, Operation::StoreA, Addressing::AbsoluteY }, { STA_INDX, Operation::StoreA, Addressing::IndirectX }, { STA_INDY, Operation::StoreA, Addressing::IndirectY },
+    { STX_ZP, Operation::StoreX, Addressing::ZeroPage }, { STX_ZPY, Operation::StoreX, Addressing::ZeroPageY }, { STX_ABS, Operation::StoreX, Addressing::Absolute },
+    { STY_ZP, Operation::StoreY, Addressing::ZeroPage }, { STY_ZPX, Operation::StoreY, Addressing::ZeroPageX }, { STY_ABS, Operation::StoreY, Addressing::Absolute },
+    { INC_ZP, Operation::Increment, Addressing::ZeroPage }, { INC_ZPX, Operation::Increment, Addressing::ZeroPageX }, { INC_ABS, Operation::Increment, Addressing::Absolute }, { INC_ABSX, Operation::Increment, Addressing::AbsoluteX },
+    { DEC_ZP, Operation::Decrement, Addressing::ZeroPage }, { DEC_ZPX, Operation::Decrement, Addressing::ZeroPageX }, { DEC_ABS, Operation::Decrement, Addressing::Absolute }, { DEC_ABSX, Operation::Decrement, Addressing::AbsoluteX },
+    { ASL_ZP, Operation::ShiftLeft, Addressing::ZeroPage }, { ASL_ZPX, Operation::ShiftLeft, Addressing::ZeroPageX }, { ASL_ABS, Operation::ShiftLeft, Addressing::Absolute }, { ASL_ABSX, Operation::ShiftLeft, Addressing::AbsoluteX },
+    { LSR_ZP, Operation::ShiftRight, Addressing::ZeroPage }, { LSR_ZPX, Operation::ShiftRight, Addressing::ZeroPageX }, { LSR_ABS, Operation::ShiftRight, Addressing::Absolute }, { LSR_ABSX, Operation::ShiftRight, Addressing::AbsoluteX },
+    { ROL_ZP, Operation::RotateLeft, Addressing::ZeroPage }, { ROL_ZPX, Operation::RotateLeft, Addressing::ZeroPageX }, { ROL_ABS, Operation::RotateLeft, Addressing::Absolute }, { ROL_ABSX, Operation::RotateLeft, Addressing::AbsoluteX },
+    { ROR_ZP, Operation::RotateRight, Addressing::ZeroPage }, { ROR_ZPX, Operation::RotateRight, Addressing::ZeroPageX }, { ROR_ABS, Operation::RotateRight, Addressing::Absolute }, { ROR_ABSX, Operation::RotateRight, Addressing::AbsoluteX },
+    { ASL_ACC, Operation::ShiftLeftA, Addressing::Implied }, { LSR_ACC, Operation::ShiftRightA, Addressing::Implied }, { ROL_ACC, Operation::RotateLeftA, Addressing::Implied }, { ROR_ACC, Operation::RotateRightA, Addressing::Implied },
+    { INX_IMP, Operation::IncrementX, Addressing::Implied }, { INY_IMP, Operation::IncrementY, Addressing::Implied }, { DEX_IMP, Operation::DecrementX, Addressing::Implied }, { DEY_IMP, Operation::DecrementY, Addressing::Implied },
+    { TAX_IMP, Operation::TransferAX, Addressing::Implied }, { TAY_IMP, Operation::TransferAY, Addressing::Implied }, { TSX_IMP, Operation::TransferSX, Addressing::Implied }, { TXA_IMP, Operation::TransferXA, Addressing::Implied }, { TXS_IMP, Operation::TransferXS, Addressing::Implied }, { TYA_IMP, Operation::TransferYA, Addressing::Implied },
+    { CLC_IMP, Operation::ClearCarry, Addressing::Implied }, { SEC_IMP, Operation::SetCarry, Addressing::Implied }, { CLV_IMP, Operation::ClearOverflow, Addressing::Implied }, { CLD_IMP, Operation::ClearDecimal, Addressing::Implied }, { SED_IMP, Operation::SetDecimal, Addressing::Implied }, { SEI_IMP, Operation::SetInterrupt, Addressing::Implied },
+    { NOP_IMP, Operation::Nop, Addressing::Implied },
+    { BCC_REL, Operation::CarryClear, Addressing::Relative }, { BCS_REL, Operation::CarrySet, Addressing::Relative }, { BEQ_REL, Operation::Equal, Addressing::Relative }, { BNE_REL, Operation::NotEqual, Addressing::Relative },
+    { BPL_REL, Operation::Plus, Addressing::Relative }, { BMI_REL, Operation::Minus, Addressing::Relative }, { BVC_REL, Operation::OverflowClear, Addressing::Relative }, { BVS_REL, Operation::OverflowSet, Addressing::Relative },
+    { JMP_ABS, Operation::Jump, Addressing::Absolute },
+};
+
+struct OpcodeInfo {
+    Operation operation;
+    Addressing addressing;
+    uint8_t bytes;
+    uint8_t cycles;
+};
+
+constexpr std::array<OpcodeInfo, 256> BuildOpcodeInfo()
+{
+    std::array<OpcodeInfo, 256> table{};
+    for (OpcodeInfo& info : table) {
+        info = { Operation::Scalar, Addressing::Implied, 1, 2 };
+    }
+#define OTWO_OPCODE_INFO(opcode, handler, length, base_cycles) \
+    table[opcode].bytes = length;                              \
+    table[opcode].cycles = base_cycles;
+    OTWO_OPCODES(OTWO_OPCODE_INFO)
+#undef OTWO_OPCODE_INFO
+    for (const LaneForm& form : laneForms) {
+        table[form.opcode].operation = form.operation;
+        table[form.opcode].addressing = form.addressing;
+    }
+    return table;
+}
+
+constexpr std::array<OpcodeInfo, 256> opcodeInfo = BuildOpcodeInfo();
+
+bool ReadsOperand(Operation operation)
+{
+    return operation >= Operation::LoadA && operation <= Operation::Bit;
+}
+
+bool WritesOperand(Operation operation)
+{
+    return operation >= Operation::StoreA && operation <= Operation::RotateRight;
+}
+
+bool ModifiesOperand(Operation operation)
+{
+    return operation >= Operation::Increment && operation <= Operation::RotateRight;
+}
+
+// Applies the operation to the first count blocks. The switch is outside
+// the loops so that each loop is a plain vectorizable kernel.
+OTWO_LOCKSTEP_CLONES
+void Apply(Operation operation, LaneBlock* blocks, size_t count)
+{
+    switch (operation) {
+    case Operation::LoadA:
+        OTWO_FOR_LANES(b.a[i] = b.value[i]; b.nzResult[i] = b.value[i];)
+        break;
+    case Operation::LoadX:
+        OTWO_FOR_LANES(b.x[i] = b.value[i]; b.nzResult[i] = b.value[i];)
+        break;
+    case Operation::LoadY:
+        OTWO_FOR_LANES(b.y[i] = b.value[i]; b.nzResult[i] = b.value[i];)
+        break;
+    case Operation::And:
+        OTWO_FOR_LANES(b.a[i] &= b.value[i]; b.nzResult[i] = b.a[i];)
+        break;
+    case Operation::Or:
+        OTWO_FOR_LANES(b.a[i] |= b.value[i]; b.nzResult[i] = b.a[i];)
+        break;
+    case Operation::Xor:
+        OTWO_FOR_LANES(b.a[i] ^= b.value[i]; b.nzResult[i] = b.a[i];)
+        break;
+    case Operation::Add:
+        OTWO_FOR_LANES(
+            uint8_t a = b.a[i];
+            uint8_t operand = b.value[i];
+            uint16_t r = a + operand + b.carry[i];
+            uint8_t overflow = ~(a ^ operand) & (a ^ r) & 0x80;
+            b.p[i] = (b.p[i] & ~CPU::FlagV) | (overflow >> 1);
+            b.a[i] = uint8_t(r);
+            b.carry[i] = r >> 8;
+            b.nzResult[i] = uint8_t(r);)
+        break;
+    case Operation::Subtract:
+        OTWO_FOR_LANES(
+            uint8_t a = b.a[i];
+            uint8_t operand = b.value[i];
+            uint16_t r = a + uint8_t(~operand) + b.carry[i];
+            uint8_t overflow = (a ^ operand) & (a ^ r) & 0x80;
+            b.p[i] = (b.p[i] & ~CPU::FlagV) | (overflow >> 1);
+            b.a[i] = uint8_t(r);
+            b.carry[i] = r >> 8;
+            b.nzResult[i] = uint8_t(r);)
+        break;
+    case Operation::CompareA:
+        OTWO_FOR_LANES(b.carry[i] = b.a[i] >= b.value[i]; b.nzResult[i] = uint8_t(b.a[i] - b.value[i]);)
+        break;
+    case Operation::CompareX:
+        OTWO_FOR_LANES(b.carry[i] = b.x[i] >= b.value[i]; b.nzResult[i] = uint8_t(b.x[i] - b.value[i]);)
+        break;
+    case Operation::CompareY:
+        OTWO_FOR_LANES(b.carry[i] = b.y[i] >= b.value[i]; b.nzResult[i] = uint8_t(b.y[i] - b.value[i]);)
+        break;
+    case Operation::Bit:
+        // Bit 8 carries N, which comes from the operand rather than the
+        // result, as in CPU::BIT.
+        OTWO_FOR_LANES(
+            uint8_t operand = b.value[i];
+            b.nzResult[i] = (operand & b.a[i]) | ((operand & 0x80) << 1);
+            b.p[i] = (b.p[i] & ~CPU::FlagV) | (operand & CPU::FlagV);)
+        break;
+    case Operation::StoreA:
+        OTWO_FOR_LANES(b.value[i] = b.a[i];)
+        break;
+    case Operation::StoreX:
+        OTWO_FOR_LANES(b.value[i] = b.x[i];)
+        break;
+    case Operation::StoreY:
+        OTWO_FOR_LANES(b.value[i] = b.y[i];)
+        break;
+    case Operation::Increment:
+        OTWO_FOR_LANES(b.value[i]++; b.nzResult[i] = b.value[i];)
+        break;
+    case Operation::Decrement:
+        OTWO_FOR_LANES(b.value[i]--; b.nzResult[i] = b.value[i];)
+        break;
+    case Operation::ShiftLeft:
+        OTWO_FOR_LANES(
+            uint8_t v = b.value[i];
+            b.carry[i] = v >> 7;
+            b.value[i] = v << 1;
+            b.nzResult[i] = b.value[i];)
+        break;
+    case Operation::ShiftRight:
+        OTWO_FOR_LANES(
+            uint8_t v = b.value[i];
+            b.carry[i] = v & 1;
+            b.value[i] = v >> 1;
+            b.nzResult[i] = b.value[i];)
+        break;
+    case Operation::RotateLeft:
+        OTWO_FOR_LANES(
+            uint8_t v = b.value[i];
+            b.value[i] = (v << 1) | b.carry[i];
+            b.carry[i] = v >> 7;
+            b.nzResult[i] = b.value[i];)
+        break;
+    case Operation::RotateRight:
+        OTWO_FOR_LANES(
+            uint8_t v = b.value[i];
+            b.value[i] = (v >> 1) | (b.carry[i] << 7);
+            b.carry[i] = v & 1;
+            b.nzResult[i] = b.value[i];)
+        break;
+    case Operation::ShiftLeftA:
+        OTWO_FOR_LANES(
+            uint8_t v = b.a[i];
+            b.carry[i] = v >> 7;
+            b.a[i] = v << 1;
+            b.nzResult[i] = b.a[i];)
+        break;
+    case Operation::ShiftRightA:
+        OTWO_FOR_LANES(
+            uint8_t v = b.a[i];
+            b.carry[i] = v & 1;
+            b.a[i] = v >> 1;
+            b.nzResult[i] = b.a[i];)
+        break;
+    case Operation::RotateLeftA:
+        OTWO_FOR_LANES(
+            uint8_t v = b.a[i];
+            b.a[i] = (v << 1) | b.carry[i];
+            b.carry[i] = v >> 7;
+            b.nzResult[i] = b.a[i];)
+        break;
+    case Operation::RotateRightA:
+        OTWO_FOR_LANES(
+            uint8_t v = b.a[i];
+            b.a[i] = (v >> 1) | (b.carry[i] << 7);
+            b.carry[i] = v & 1;
+            b.nzResult[i] = b.a[i];)
+        break;
+    case Operation::IncrementX:
+        OTWO_FOR_LANES(b.x[i]++; b.nzResult[i] = b.x[i];)
+        break;
+    case Operation::IncrementY:
+        OTWO_FOR_LANES(b.y[i]++; b.nzResult[i] = b.y[i];)
+        break;
+    case Operation::DecrementX:
+        OTWO_FOR_LANES(b.x[i]--; b.nzResult[i] = b.x[i];)
+        break;
+    case Operation::DecrementY:
+        OTWO_FOR_LANES(b.y[i]--; b.nzResult[i] = b.y[i];)
+        break;
+    case Operation::TransferAX:
+        OTWO_FOR_LANES(b.x[i] = b.a[i]; b.nzResult[i] = b.a[i];)
+        break;
+    case Operation::TransferAY:
+        OTWO_FOR_LANES(b.y[i] = b.a[i]; b.nzResult[i] = b.a[i];)
+        break;
+    case Operation::TransferSX:
+        OTWO_FOR_LANES(b.x[i] = b.s[i]; b.nzResult[i] = b.s[i];)
+        break;
+    case Operation::TransferXA:
+        OTWO_FOR_LANES(b.a[i] = b.x[i]; b.nzResult[i] = b.x[i];)
+        break;
+    case Operation::TransferXS:
+        OTWO_FOR_LANES(b.s[i] = b.x[i];)
+        break;
+    case Operation::TransferYA:
+        OTWO_FOR_LANES(b.a[i] = b.y[i]; b.nzResult[i] = b.y[i];)
+        break;
+    case Operation::ClearCarry:
+        OTWO_FOR_LANES(b.carry[i] = 0;)
+        break;
+    case Operation::SetCarry:
+        OTWO_FOR_LANES(b.carry[i] = 1;)
+        break;
+    case Operation::ClearOverflow:
+        OTWO_FOR_LANES(b.p[i] &= ~CPU::FlagV;)
+        break;
+    case Operation::ClearDecimal:
+        OTWO_FOR_LANES(b.p[i] &= ~CPU::FlagD;)
+        break;
+    case Operation::SetDecimal:
+        OTWO_FOR_LANES(b.p[i] |= CPU::FlagD;)
+        break;
+    case Operation::SetInterrupt:
+        OTWO_FOR_LANES(b.p[i] |= CPU::FlagI;)
+        break;
+    case Operation::CarryClear:
+        OTWO_FOR_LANES(b.condition[i] = b.carry[i] == 0;)
+        break;
+    case Operation::CarrySet:
+        OTWO_FOR_LANES(b.condition[i] = b.carry[i] != 0;)
+        break;
+    case Operation::Equal:
+        OTWO_FOR_LANES(b.condition[i] = (b.nzResult[i] & 0xFF) == 0;)
+        break;
+    case Operation::NotEqual:
+        OTWO_FOR_LANES(b.condition[i] = (b.nzResult[i] & 0xFF) != 0;)
+        break;
+    case Operation::Plus:
+        OTWO_FOR_LANES(b.condition[i] = (b.nzResult[i] & 0x180) == 0;)
+        break;
+    case Operation::Minus:
+        OTWO_FOR_LANES(b.condition[i] = (b.nzResult[i] & 0x180) != 0;)
+        break;
+    case Operation::OverflowClear:
+        OTWO_FOR_LANES(b.condition[i] = (b.p[i] & CPU::FlagV) == 0;)
+        break;
+    case Operation::OverflowSet:
+        OTWO_FOR_LANES(b.condition[i] = (b.p[i] & CPU::FlagV) != 0;)
+        break;
+    default:
+        break;
+    }
+}
+
+OTWO_LOCKSTEP_CLONES
+void Fill(LaneBlock* blocks, size_t count, uint8_t value)
+{
+    OTWO_FOR_LANES(b.value[i] = value;)
+}
+
+// Fills address[] for the addressing modes that need no memory access.
+// Returns whether an indexed address crossed a page in any of the first
+// lanes lanes.
+OTWO_LOCKSTEP_CLONES
+bool Addresses(Addressing addressing, LaneBlock* blocks, size_t count, uint16_t operand, size_t lanes)
+{
+    switch (addressing) {
+    case Addressing::ZeroPage:
+    case Addressing::Absolute:
+        OTWO_FOR_LANES(b.address[i] = operand;)
+        return false;
+    case Addressing::ZeroPageX:
+        OTWO_FOR_LANES(b.address[i] = uint8_t(operand + b.x[i]);)
+        return false;
+    case Addressing::ZeroPageY:
+        OTWO_FOR_LANES(b.address[i] = uint8_t(operand + b.y[i]);)
+        return false;
+    case Addressing::AbsoluteX:
+        OTWO_FOR_LANES(b.address[i] = operand + b.x[i];)
+        break;
+    case Addressing::AbsoluteY:
+        OTWO_FOR_LANES(b.address[i] = operand + b.y[i];)
+        break;
+    default:
+        return false;
+    }
+
+    uint16_t crossed = 0;
+    for (size_t g = 0; g * LockstepBlock < lanes; g++) {
+        size_t limit = std::min(LockstepBlock, lanes - g * LockstepBlock);
+        for (size_t i = 0; i < limit; i++) {
+            crossed |= (operand ^ blocks[g].address[i]) & 0xFF00;
+        }
+    }
+    return crossed != 0;
+}
+
+// The number of the first lanes lanes whose condition holds.
+OTWO_LOCKSTEP_CLONES
+size_t CountTaken(const LaneBlock* blocks, size_t lanes)
+{
+    size_t taken = 0;
+    for (size_t g = 0; g * LockstepBlock < lanes; g++) {
+        size_t limit = std::min(LockstepBlock, lanes - g * LockstepBlock);
+        for (size_t i = 0; i < limit; i++) {
+            taken += blocks[g].condition[i];
+        }
+    }
+    return taken;
+}
+
+OTWO_LOCKSTEP_CLONES
+bool AnyDecimal(const LaneBlock* blocks, size_t lanes)
+{
+    uint8_t any = 0;
+    for (size_t g = 0; g * LockstepBlock < lanes; g++) {
+        size_t limit = std::min(LockstepBlock, lanes - g * LockstepBlock);
+        for (size_t i = 0; i < limit; i++) {
+            any |= blocks[g].p[i];
+        }
+    }
+    return any & CPU::FlagD;
+}
+
+// Whether the memory operand can fall on a page that is a device in some
+// lane. Devices schedule events and raise interrupts on the lane's CPU, so
+// they have to see its real cycle count, and the lane has to leave the group
+// to take them.
+bool MayTouchDevice(const std::bitset<Memory::PageCount>& devicePages, Addressing addressing, uint16_t operand)
+{
+    switch (addressing) {
+    case Addressing::Implied:
+    case Addressing::Immediate:
+    case Addressing::Relative:
+        return false;
+    case Addressing::ZeroPage:
+    case Addressing::ZeroPageX:
+    case Addressing::ZeroPageY:
+        return devicePages[0];
+    case Addressing::Absolute:
+        return devicePages[operand >> 8];
+    case Addressing::AbsoluteX:
+    case Addressing::AbsoluteY:
+        return devicePages[operand >> 8] || devicePages[uint16_t(operand + 0xFF) >> 8];
+    default:
+        // The pointers of indirect addressing differ between lanes.
+        return true;
+    }
+}
+
+uint64_t EndCycles(const CPUState& state, uint64_t maxCycles)
+{
+    return maxCycles > UINT64_MAX - state.cycles ? UINT64_MAX : state.cycles + maxCycles;
+}
+
+}
+
+Lockstep::Lockstep(std::vector<std::unique_ptr<Machine>> machines)
+    : machines(std::move(machines))
+{
+}
+
+void Lockstep::Load(size_t slot, const CPUState& state)
+{
+    LaneBlock& b = blocks[slot / LockstepBlock];
+    size_t i = slot % LockstepBlock;
+    b.a[i] = state.A;
+    b.x[i] = state.X;
+    b.y[i] = state.Y;
+    b.s[i] = state.S;
+    // Split as CPU::SetStatus does.
+    b.p[i] = state.P & ~(CPU::FlagN | CPU::FlagZ | CPU::FlagC | CPU::FlagB | CPU::FlagU);
+    b.carry[i] = state.P & CPU::FlagC;
+    b.nzResult[i] = ((state.P & CPU::FlagN) << 1) | ((state.P & CPU::FlagZ) ? 0 : 1);
+    slots[slot].cycles = state.cycles - groupCycles;
+    slots[slot].instructions = state.instructions - groupInstructions;
+}
+
+CPUState Lockstep::Store(size_t slot) const
+{
+    const LaneBlock& b = blocks[slot / LockstepBlock];
+    size_t i = slot % LockstepBlock;
+    uint8_t status = b.p[i] | CPU::FlagU | b.carry[i];
+    status |= (b.nzResult[i] & 0xFF) == 0 ? CPU::FlagZ : 0;
+    status |= (b.nzResult[i] & 0x180) != 0 ? CPU::FlagN : 0;
+    return { pc, b.a[i], b.x[i], b.y[i], b.s[i], status,
+        slots[slot].cycles + groupCycles, slots[slot].instructions + groupInstructions };
+}
+
+void Lockstep::Detach(size_t slot, bool finished, StopReason reason, uint16_t address)
+{
+    size_t machine = slots[slot].machine;
+    machines[machine]->cpu.SetState(Store(slot));
+    if (finished) {
+        Finish(machine, reason, address);
+    }
+    Remove(slot);
+}
+
+void Lockstep::Finish(size_t machine, StopReason reason, uint16_t address)
+{
+    const CPU& cpu = machines[machine]->cpu;
+    results[machine] = { reason, address, cpu.Cycles() - startStates[machine].cycles,
+        cpu.Instructions() - startStates[machine].instructions };
+    done[machine] = true;
+}
+
+void Lockstep::Remove(size_t slot)
+{
+    size_t last = slots.size() - 1;
+    if (slot != last) {
+        LaneBlock& to = blocks[slot / LockstepBlock];
+        const LaneBlock& from = blocks[last / LockstepBlock];
+        size_t i = slot % LockstepBlock;
+        size_t j = last % LockstepBlock;
+        to.a[i] = from.a[j];
+        to.x[i] = from.x[j];
+        to.y[i] = from.y[j];
+        to.s[i] = from.s[j];
+        to.p[i] = from.p[j];
+        to.carry[i] = from.carry[j];
+        to.nzResult[i] = from.nzResult[j];
+        to.value[i] = from.value[j];
+        to.address[i] = from.address[j];
+        to.condition[i] = from.condition[j];
+        slots[slot] = slots[last];
+    }
+    slots.pop_back();
+}
+
+void Lockstep::RetireFinished()
+{
+    uint64_t next = UINT64_MAX;
+    for (size_t k = slots.size(); k-- > 0;) {
+        uint64_t cycles = slots[k].cycles + groupCycles;
+        if (cycles >= slots[k].endCycles) {
+            Detach(k, true, StopReason::BudgetExhausted, pc);
+        } else {
+            next = std::min(next, groupCycles + (slots[k].endCycles - cycles));
+        }
+    }
+    nextBudgetCheck = next;
+}
+
+// Detaches the lanes whose copy of the instruction differs from the first
+// lane's. Returns false, verifying nothing, when the first lane's copy is
+// not in RAM or ROM.
+bool Lockstep::VerifyCode(uint16_t address, uint8_t bytes)
+{
+    Memory& reference = *slots[0].memory;
+    for (uint8_t n = 0; n < bytes; n++) {
+        if (!reference.IsDirect(uint16_t(address + n))) {
+            return false;
+        }
+    }
+
+    for (size_t k = slots.size(); k-- > 1;) {
+        Memory& memory = *slots[k].memory;
+        bool same = true;
+        for (uint8_t n = 0; n < bytes && same; n++) {
+            uint16_t at = address + n;
+            same = memory.IsDirect(at) && memory.ReadByte(at) == reference.ReadByte(at);
+        }
+        if (!same) {
+            Detach(k, false, StopReason::BudgetExhausted, 0);
+        }
+    }
+
+    verified[address] = true;
+    for (uint8_t n = 0; n < bytes; n++) {
+        verifiedPages[uint16_t(address + n) >> 8] = true;
+    }
+    return true;
+}
+
+// Forgets every verified instruction with a byte in the page of address.
+void Lockstep::Unverify(uint16_t address)
+{
+    uint32_t page = address >> 8;
+    uint32_t first = page * Memory::PageSize;
+    for (uint32_t at = first - 2; at != first + Memory::PageSize; at++) {
+        verified[at & 0xFFFF] = false;
+    }
+    verifiedPages[page] = false;
+}
+
+void Lockstep::Step()
+{
+    Memory& memory = *slots[0].memory;
+    // Reading code from a device could have side effects.
+    if (!verified[pc] && !memory.IsDirect(pc)) {
+        StepScalar();
+        return;
+    }
+    uint8_t opcode = memory.ReadByte(pc);
+    const OpcodeInfo& info = opcodeInfo[opcode];
+    Operation operation = info.operation;
+
+    if (operation == Operation::Scalar
+        || ((operation == Operation::Add || operation == Operation::Subtract) && AnyDecimal(blocks.data(), slots.size()))
+        || (!verified[pc] && !VerifyCode(pc, info.bytes))) {
+        StepScalar();
+        return;
+    }
+
+    uint16_t operand = 0;
+    if (info.bytes == 2) {
+        operand = memory.ReadByte(pc + 1);
+    } else if (info.bytes == 3) {
+        operand = memory.ReadWord(pc + 1);
+    }
+    if (devicePages.any() && MayTouchDevice(devicePages, info.addressing, operand)) {
+        StepScalar();
+        return;
+    }
+    vectorInstructions += slots.size();
+
+    if (info.addressing == Addressing::Relative) {
+        StepBranch(opcode, operand);
+        return;
+    }
+    groupCycles += info.cycles;
+    groupInstructions++;
+    if (operation == Operation::Jump) {
+        uint16_t address = pc;
+        pc = operand;
+        if (pc == address) {
+            for (size_t k = slots.size(); k-- > 0;) {
+                Detach(k, true, StopReason::Trap, address);
+            }
+        }
+        return;
+    }
+
+    size_t count = BlockCount();
+    if (info.addressing == Addressing::Immediate) {
+        Fill(blocks.data(), count, uint8_t(operand));
+    } else if (info.addressing != Addressing::Implied) {
+        // Effective addresses are computed for all lanes at once where
+        // they only depend on registers; memory accesses are per lane.
+        bool read = ReadsOperand(operation);
+        if (info.addressing == Addressing::IndirectX || info.addressing == Addressing::IndirectY) {
+            IndirectAddresses(info.addressing == Addressing::IndirectY, uint8_t(operand), read);
+        } else if (Addresses(info.addressing, blocks.data(), count, operand, slots.size()) && read) {
+            // Indexed reads take a cycle more when they cross a page.
+            for (size_t k = 0; k < slots.size(); k++) {
+                slots[k].cycles += CPU::PageCrossed(operand, blocks[k / LockstepBlock].address[k % LockstepBlock]);
+            }
+            nextBudgetCheck = 0;
+        }
+
+        if (read || ModifiesOperand(operation)) {
+            for (size_t k = 0; k < slots.size(); k++) {
+                LaneBlock& b = blocks[k / LockstepBlock];
+                size_t i = k % LockstepBlock;
+                b.value[i] = slots[k].memory->ReadByte(b.address[i]);
+            }
+        }
+    }
+
+    Apply(operation, blocks.data(), count);
+
+    if (WritesOperand(operation)) {
+        for (size_t k = 0; k < slots.size(); k++) {
+            LaneBlock& b = blocks[k / LockstepBlock];
+            size_t i = k % LockstepBlock;
+            uint16_t address = b.address[i];
+            slots[k].memory->WriteByte(address, b.value[i]);
+            if (verifiedPages[address >> 8]) {
+                Unverify(address);
+            }
+        }
+    }
+    pc += info.bytes;
+}
+
+// The pointers of indirect addressing come from each lane's zero page.
+void Lockstep::IndirectAddresses(bool indexedByY, uint8_t operand, bool read)
+{
+    bool crossed = false;
+    for (size_t k = 0; k < slots.size(); k++) {
+        LaneBlock& b = blocks[k / LockstepBlock];
+        size_t i = k % LockstepBlock;
+        if (!indexedByY) {
+            b.address[i] = slots[k].memory->ReadZPWord(uint8_t(operand + b.x[i]));
+            continue;
+        }
+        uint16_t base = slots[k].memory->ReadZPWord(operand);
+        b.address[i] = base + b.y[i];
+        if (read && CPU::PageCrossed(base, b.address[i])) {
+            slots[k].cycles++;
+            crossed = true;
+        }
+    }
+    if (crossed) {
+        nextBudgetCheck = 0;
+    }
+}
+
+// Lanes that disagree with most of the others leave the group before the
+// branch and take it on their own CPUs.
+void Lockstep::StepBranch(uint8_t opcode, uint16_t operand)
+{
+    const OpcodeInfo& info = opcodeInfo[opcode];
+    Apply(info.operation, blocks.data(), BlockCount());
+    size_t taken = CountTaken(blocks.data(), slots.size());
+    bool take = taken * 2 >= slots.size();
+    if (taken != 0 && taken != slots.size()) {
+        for (size_t k = slots.size(); k-- > 0;) {
+            if ((blocks[k / LockstepBlock].condition[k % LockstepBlock] != 0) != take) {
+                Detach(k, false, StopReason::BudgetExhausted, 0);
+            }
+        }
+    }
+
+    uint16_t address = pc;
+    uint16_t next = pc + 2;
+    groupCycles += info.cycles;
+    groupInstructions++;
+    if (!take) {
+        pc = next;
+        return;
+    }
+    pc = next + int8_t(operand);
+    groupCycles += CPU::PageCrossed(next, pc) ? 2 : 1;
+    if (pc == address) {
+        for (size_t k = slots.size(); k-- > 0;) {
+            Detach(k, true, StopReason::Trap, address);
+        }
+    }
+}
+
+// Runs one instruction on every lane's own CPU. Lanes that stop leave the
+// group finished, and lanes that end up at another PC than the first
+// remaining lane, or with an event or interrupt pending, leave it to run on
+// their own.
+void Lockstep::StepScalar()
+{
+    size_t count = slots.size();
+    stepped.resize(count);
+    for (size_t k = 0; k < count; k++) {
+        size_t machine = slots[k].machine;
+        CPU& cpu = machines[machine]->cpu;
+        cpu.SetState(Store(k));
+        RunResult run = cpu.Step();
+        stepped[k] = cpu.GetState();
+        if (run.reason == StopReason::Trap || run.reason == StopReason::UnknownOpcode) {
+            Finish(machine, run.reason, run.address);
+        }
+    }
+    scalarInstructions += count;
+
+    size_t first = 0;
+    while (first < count && done[slots[first].machine]) {
+        first++;
+    }
+    if (first < count) {
+        pc = stepped[first].PC;
+    }
+    // Removing a slot only moves a later one, already handled, into it.
+    for (size_t k = count; k-- > 0;) {
+        if (done[slots[k].machine] || stepped[k].PC != pc || machines[slots[k].machine]->cpu.HasPendingEvents()) {
+            Remove(k);
+        } else {
+            Load(k, stepped[k]);
+        }
+    }
+
+    // Per-lane cycle counts changed, and the stack page may have been
+    // written.
+    nextBudgetCheck = 0;
+    if (verifiedPages[1]) {
+        Unverify(0x100);
+    }
+}
+
+std::vector<RunResult> Lockstep::RunFor(uint64_t maxCycles)
+{
+    size_t count = machines.size();
+    startStates.resize(count);
+    results.assign(count, RunResult{});
+    done.assign(count, false);
+    blocks.assign((count + LockstepBlock - 1) / LockstepBlock, LaneBlock{});
+    slots.clear();
+    verified.reset();
+    verifiedPages.reset();
+    groupCycles = 0;
+    groupInstructions = 0;
+    nextBudgetCheck = 0;
+    vectorInstructions = 0;
+    scalarInstructions = 0;
+    if (count == 0) {
+        return results;
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        startStates[i] = machines[i]->cpu.GetState();
+    }
+    pc = startStates[0].PC;
+    devicePages.reset();
+    for (size_t i = 0; i < count; i++) {
+        if (startStates[i].PC == pc && !machines[i]->cpu.HasPendingEvents()) {
+            slots.push_back({ i, &machines[i]->memory, 0, 0, EndCycles(startStates[i], maxCycles) });
+            Load(slots.size() - 1, startStates[i]);
+            for (uint32_t page = 0; page < Memory::PageCount; page++) {
+                if (machines[i]->memory.KindOf(uint8_t(page)) == Memory::PageKind::Device) {
+                    devicePages[page] = true;
+                }
+            }
+        }
+    }
+
+    while (!slots.empty()) {
+        if (groupCycles >= nextBudgetCheck) {
+            RetireFinished();
+        } else {
+            Step();
+        }
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        if (done[i]) {
+            continue;
+        }
+        CPU& cpu = machines[i]->cpu;
+        uint64_t end = EndCycles(startStates[i], maxCycles);
+        RunResult run = cpu.RunFor(end > cpu.Cycles() ? end - cpu.Cycles() : 0);
+        scalarInstructions += run.instructions;
+        Finish(i, run.reason, run.address);
+    }
+    return results;
+}
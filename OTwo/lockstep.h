@@ -0,0 +1,139 @@
+#pragma once
+#include <bitset>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include "machine.h"
+
+// Lanes are stored in blocks of this many, so the per-lane loops have a
+// fixed trip count and vectorize.
+constexpr size_t LockstepBlock = 64;
+
+// Runs many machines that hold the same program on different data in
+// lockstep: each instruction is decoded once and executed for every lane.
+// Registers and flags are kept as structure-of-arrays in blocks of
+// LockstepBlock lanes, and the register and flag arithmetic is compiled for
+// SSE2, AVX2 and AVX-512 with the best one picked at load time. Memory
+// accesses go to each lane's own memory.
+//
+// Stack operations, calls, returns, BRK, indirect jumps, decimal arithmetic
+// and unknown opcodes run on each lane's own CPU instead. A lane leaves the
+// group and finishes on its own CPU when a branch sends it the other way
+// from most lanes, when its PC after an instruction run on its CPU differs
+// from the first lane's, or when its code differs from the first lane's.
+class Lockstep {
+
+public:
+	explicit Lockstep(std::vector<std::unique_ptr<Machine>> machines);
+
+	Lockstep(const Lockstep&) = delete;
+	Lockstep& operator=(const Lockstep&) = delete;
+
+	// Runs every lane for maxCycles cycles, or until it stops as RunFor
+	// would stop it, and returns one result per lane. Lanes that start at
+	// another PC than the first lane, or have events scheduled or
+	// interrupts waiting, run on their own. So do lanes that get an event
+	// or interrupt during the run, which only an instruction that may touch
+	// a device or clears I can cause; those run on each lane's CPU. Each
+	// lane's CPU holds its final state afterwards.
+	std::vector<RunResult> RunFor(uint64_t maxCycles);
+
+	Machine& Lane(size_t index)
+	{
+		return *machines[index];
+	}
+
+	size_t LaneCount() const
+	{
+		return machines.size();
+	}
+
+	// Instructions the lanes executed in lockstep, and on their own CPUs,
+	// during the last RunFor; their sum is the total over all lanes.
+	uint64_t VectorInstructions() const
+	{
+		return vectorInstructions;
+	}
+
+	uint64_t ScalarInstructions() const
+	{
+		return scalarInstructions;
+	}
+
+	// The registers of LockstepBlock lanes, plus per-lane scratch space for
+	// the instruction being executed. p holds V, I and D; N, Z and C are
+	// kept lazily as in CPU.
+	struct alignas(64) LaneBlock {
+		uint8_t a[LockstepBlock];
+		uint8_t x[LockstepBlock];
+		uint8_t y[LockstepBlock];
+		uint8_t s[LockstepBlock];
+		uint8_t p[LockstepBlock];
+		uint8_t carry[LockstepBlock];
+		uint16_t nzResult[LockstepBlock];
+		uint16_t address[LockstepBlock];  // of the memory operand
+		uint8_t value[LockstepBlock];     // operand or result
+		uint8_t condition[LockstepBlock]; // branch outcome
+	};
+
+private:
+	// A lane's place in the group. Slots are kept dense: the last lane
+	// moves into the slot of one that leaves.
+	struct Slot {
+		size_t machine;
+		Memory* memory;
+		// The lane's counters less those of the whole group, so that an
+		// instruction run by all lanes only adds to groupCycles.
+		uint64_t cycles;
+		uint64_t instructions;
+		uint64_t endCycles;
+	};
+
+	void Load(size_t slot, const CPUState& state);
+	CPUState Store(size_t slot) const;
+	// Writes the lane's state back to its CPU and takes it out of the
+	// group, recording a result when it has finished.
+	void Detach(size_t slot, bool finished, StopReason reason, uint16_t address);
+	void Finish(size_t machine, StopReason reason, uint16_t address);
+	void Remove(size_t slot);
+
+	void RetireFinished();
+	bool VerifyCode(uint16_t address, uint8_t bytes);
+	void Unverify(uint16_t address);
+	void Step();
+	void IndirectAddresses(bool indexedByY, uint8_t operand, bool read);
+	void StepBranch(uint8_t opcode, uint16_t operand);
+	void StepScalar();
+
+	size_t BlockCount() const
+	{
+		return (slots.size() + LockstepBlock - 1) / LockstepBlock;
+	}
+
+	std::vector<std::unique_ptr<Machine>> machines;
+
+	std::vector<LaneBlock> blocks;
+	std::vector<Slot> slots;
+
+	uint16_t pc = 0;
+	uint64_t groupCycles = 0;
+	uint64_t groupInstructions = 0;
+	// No lane reaches the end of its budget before groupCycles does.
+	uint64_t nextBudgetCheck = 0;
+
+	// Instructions whose bytes were found identical in every lane, and the
+	// pages holding them; a store into such a page clears its bits.
+	std::bitset<0x10000> verified;
+	std::bitset<Memory::PageCount> verifiedPages;
+	// Pages that are a device in any lane of the group.
+	std::bitset<Memory::PageCount> devicePages;
+
+	std::vector<CPUState> startStates;
+	std::vector<RunResult> results;
+	std::vector<bool> done;
+	std::vector<CPUState> stepped;
+	uint64_t vectorInstructions = 0;
+	uint64_t scalarInstructions = 0;
+};
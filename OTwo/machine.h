@@ -0,0 +1,54 @@
+#pragma once
+#include "cpu.h"
+#include "memory.h"
+
+// Everything needed to put a machine back where it was: the CPU registers
+// and a snapshot of its memory. Device state is not included.
+struct MachineState {
+	CPUState cpu;
+	std::shared_ptr<const Memory::Snapshot> memory;
+};
+
+// One emulated computer: a Memory and the CPU attached to it. The CPU keeps
+// a pointer to the memory and installs a handler on it, so the memory must
+// outlive the CPU; declaring it first makes it so. Machines share nothing
+// mutable, so separate ones can run on separate threads.
+template <typename Policy>
+class BasicMachine {
+
+public:
+	BasicMachine()
+		: cpu(&memory)
+	{
+	}
+
+	// A machine whose memory is forked from a shared base image.
+	explicit BasicMachine(std::shared_ptr<const Memory::BaseImage> base)
+		: memory(std::move(base)), cpu(&memory)
+	{
+	}
+
+	BasicMachine(const BasicMachine&) = delete;
+	BasicMachine& operator=(const BasicMachine&) = delete;
+
+	// Memory snapshots are incremental, so saving often only costs the
+	// pages written in between (see Memory::SaveState). A state can also
+	// be loaded into another machine with the same memory map.
+	MachineState SaveState()
+	{
+		return { cpu.GetState(), memory.SaveState() };
+	}
+
+	void LoadState(const MachineState& state)
+	{
+		memory.LoadState(state.memory);
+		cpu.SetState(state.cpu);
+	}
+
+	Memory memory;
+	BasicCPU<Policy> cpu;
+};
+
+using Machine = BasicMachine<ReleasePolicy>;
+using DebugMachine = BasicMachine<DebugPolicy>;
+using ProfileMachine = BasicMachine<ProfilePolicy>;
@@ -1,10 +1,82 @@
 #include "memory.h"
 #include <cstdint>
+#include <cstring>
 #include <fstream>
 
+#if defined(__unix__) || defined(__APPLE__)
+#define OTWO_HAVE_MMAP 1
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#else
+#define OTWO_HAVE_MMAP 0
+#endif
+
+namespace {
+constexpr size_t RAMSize = 64 * 1024;
+}
+
 Memory::Memory()
 {
-    data = new uint8_t[64 * 1024]; // 64K of memory
+    Unmap(0, PageCount * PageSize);
+}
+
+Memory::Memory(std::shared_ptr<const BaseImage> image)
+    : base(std::move(image))
+{
+    for (uint32_t page = 0; page < PageCount; page++) {
+        RemapPage(page, base->bytes.get() + page * PageSize, nullptr, nullptr);
+    }
+    sharedPages = ~base->rom;
+    writablePages = sharedPages;
+    UpdateWordPages();
+}
+
+uint8_t* Memory::BuiltInRAM()
+{
+    if (!data) {
+        data = AllocateMirroredRAM();
+    }
+    if (!data) {
+        data = new uint8_t[RAMSize](); // 64K of memory
+    }
+    return data;
+}
+
+uint8_t* Memory::AllocateMirroredRAM()
+{
+#if defined(__linux__)
+    int fd = memfd_create("otwo-ram", MFD_CLOEXEC);
+    if (fd < 0) {
+        return nullptr;
+    }
+    if (ftruncate(fd, RAMSize) != 0) {
+        close(fd);
+        return nullptr;
+    }
+
+    // Reserve both halves first so the two views end up adjacent.
+    void* base = mmap(nullptr, 2 * RAMSize, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (base == MAP_FAILED) {
+        close(fd);
+        return nullptr;
+    }
+
+    uint8_t* ram = static_cast<uint8_t*>(base);
+    void* low = mmap(ram, RAMSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0);
+    void* high = mmap(ram + RAMSize, RAMSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0);
+    close(fd);
+    if (low == MAP_FAILED || high == MAP_FAILED) {
+        munmap(base, 2 * RAMSize);
+        return nullptr;
+    }
+
+    mirrored = true;
+    return ram;
+#else
+    return nullptr;
+#endif
 }
 
 bool Memory::LoadFromFile(const std::string& path) 
@@ -24,33 +96,325 @@ bool Memory::LoadFromFile(const std::string& path)
         return false;
     }
 
-    if (!file.read((char*)data, fileSize)) {
+    if (!file.read((char*)BuiltInRAM(), fileSize)) {
         file.close();
         return false;
     }
 
+    // Written behind the page tables, so every page counts as dirty.
+    dirtyPages.set();
+    for (uint32_t page = 0; page < PageCount; page++) {
+        UpdateWritePage(page);
+    }
+
     file.close();
     return true;
 }
 
+bool Memory::LoadImages(const std::vector<Image>& images)
+{
+    for (const Image& image : images) {
+        if (!LoadImage(image)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool Memory::LoadImage(const Image& image)
+{
+    if (image.address % PageSize != 0) {
+        return false;
+    }
+
+#if OTWO_HAVE_MMAP
+    int fd = open(image.path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return false;
+    }
+
+    struct stat info;
+    if (fstat(fd, &info) != 0 || info.st_size <= 0 ||
+        static_cast<size_t>(info.st_size) > RAMSize - image.address) {
+        close(fd);
+        return false;
+    }
+
+    // Bytes past the end of the file in its last page read as zero.
+    size_t fileSize = info.st_size;
+    int protection = image.writable ? PROT_READ | PROT_WRITE : PROT_READ;
+    void* host = mmap(nullptr, fileSize, protection, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (host == MAP_FAILED) {
+        return false;
+    }
+    imageMappings.push_back({ host, fileSize });
+    uint8_t* bytes = static_cast<uint8_t*>(host);
+#else
+    std::ifstream file(image.path, std::ios::binary | std::ios::ate);
+    if (!file.is_open()) {
+        return false;
+    }
+
+    std::streamsize streamSize = file.tellg();
+    if (streamSize <= 0 || static_cast<size_t>(streamSize) > RAMSize - image.address) {
+        return false;
+    }
+
+    size_t fileSize = static_cast<size_t>(streamSize);
+    imageBuffers.push_back(std::make_unique<uint8_t[]>((fileSize + PageSize - 1) / PageSize * PageSize));
+    uint8_t* bytes = imageBuffers.back().get();
+    file.seekg(0, std::ios::beg);
+    if (!file.read((char*)bytes, streamSize)) {
+        return false;
+    }
+#endif
+
+    uint32_t mappedSize = (fileSize + PageSize - 1) / PageSize * PageSize;
+    if (image.writable) {
+        return MapRAM(image.address, mappedSize, bytes);
+    }
+    return MapROM(image.address, mappedSize, bytes);
+}
+
 Memory::~Memory()
 {
+#if OTWO_HAVE_MMAP
+    for (const Mapping& mapping : imageMappings) {
+        munmap(mapping.address, mapping.size);
+    }
+#endif
+#if defined(__linux__)
+    if (mirrored) {
+        munmap(data, 2 * RAMSize);
+        return;
+    }
+#endif
     delete[] data;
 }
 
+bool Memory::IsPageAligned(uint16_t address, uint32_t size)
+{
+    return (address % PageSize) == 0 && (size % PageSize) == 0 &&
+           size > 0 && address + size <= PageCount * PageSize;
+}
+
+bool Memory::MapRAM(uint16_t address, uint32_t size, uint8_t* host)
+{
+    if (!IsPageAligned(address, size)) {
+        return false;
+    }
 
-uint8_t Memory::ReadByte(uint16_t index) {
-    return data[index];
+    for (uint32_t offset = 0; offset < size; offset += PageSize) {
+        RemapPage((address + offset) / PageSize, host + offset, host + offset, nullptr);
+    }
+    UpdateWordPages();
+    return true;
 }
 
-void Memory::WriteByte(uint16_t index, uint8_t value) {
-    data[index] = value;
+bool Memory::MapROM(uint16_t address, uint32_t size, const uint8_t* host)
+{
+    if (!IsPageAligned(address, size)) {
+        return false;
+    }
+
+    for (uint32_t offset = 0; offset < size; offset += PageSize) {
+        RemapPage((address + offset) / PageSize, host + offset, nullptr, nullptr);
+    }
+    UpdateWordPages();
+    return true;
+}
+
+bool Memory::MapIO(uint16_t address, uint32_t size, ReadHandler read, WriteHandler write)
+{
+    if (!IsPageAligned(address, size)) {
+        return false;
+    }
+
+    devices.push_back(std::make_unique<IOHandlers>(IOHandlers{ std::move(read), std::move(write) }));
+    for (uint32_t offset = 0; offset < size; offset += PageSize) {
+        RemapPage((address + offset) / PageSize, nullptr, nullptr, devices.back().get());
+    }
+    UpdateWordPages();
+    return true;
+}
+
+void Memory::RemapPage(uint32_t page, const uint8_t* read, uint8_t* write, const IOHandlers* io)
+{
+    if (codePages.test(page) && codeWriteHandler) {
+        codeWriteHandler(page * PageSize, PageSize);
+    }
+    sharedPages.reset(page);
+    writablePages[page] = write != nullptr;
+    dirtyPages.set(page);
+    readPages[page] = read;
+    ramPages[page] = write;
+    ioPages[page] = io;
+    UpdateWritePage(page);
+}
+
+void Memory::SetCodeWriteHandler(CodeWriteHandler handler)
+{
+    codeWriteHandler = std::move(handler);
+}
+
+void Memory::MarkCode(uint8_t page, bool code)
+{
+    codePages.set(page, code);
+    UpdateWritePage(page);
+}
+
+void Memory::UpdateWritePage(uint32_t page)
+{
+    writePages[page] = codePages.test(page) || !dirtyPages.test(page) ? nullptr : ramPages[page];
+}
+
+void Memory::UpdateWordPages()
+{
+    for (uint32_t page = 0; page < PageCount; page++) {
+        const uint8_t* current = readPages[page];
+        const uint8_t* following = readPages[(page + 1) % PageCount];
+        if (!current || !following) {
+            wordPages[page] = nullptr;
+            continue;
+        }
+
+        // With the mirror, the last page of the built-in RAM runs on into
+        // its first page.
+        const uint8_t* end = current + PageSize;
+        bool contiguous = end == following || (mirrored && end == data + RAMSize && following == data);
+        wordPages[page] = contiguous ? current : nullptr;
+    }
 }
 
-uint16_t Memory::ReadWord(uint16_t index) {
-    return *(reinterpret_cast<uint16_t*>(data + index));
+bool Memory::Unmap(uint16_t address, uint32_t size)
+{
+    return MapRAM(address, size, BuiltInRAM() + address);
+}
+
+std::shared_ptr<const Memory::BaseImage> Memory::Share() const
+{
+    auto image = std::make_shared<BaseImage>();
+    image->bytes = std::make_unique<uint8_t[]>(RAMSize);
+    for (uint32_t page = 0; page < PageCount; page++) {
+        if (readPages[page]) {
+            std::memcpy(image->bytes.get() + page * PageSize, readPages[page], PageSize);
+        }
+        image->rom[page] = readPages[page] && !ramPages[page] && !sharedPages[page];
+    }
+    return image;
+}
+
+// Moves a page off the base image before its first write. The contents do
+// not change, so code decoded from the page stays valid.
+void Memory::CopySharedPage(uint32_t page)
+{
+    if (privatePageCount % PrivateChunkPages == 0) {
+        privateChunks.push_back(std::make_unique<uint8_t[]>(PrivateChunkPages * PageSize));
+    }
+    uint8_t* copy = privateChunks.back().get() + privatePageCount % PrivateChunkPages * PageSize;
+    privatePageCount++;
+
+    std::memcpy(copy, readPages[page], PageSize);
+    sharedPages.reset(page);
+    readPages[page] = copy;
+    ramPages[page] = copy;
+    UpdateWritePage(page);
+    UpdateWordPages();
+}
+
+std::shared_ptr<const Memory::Snapshot> Memory::SaveState()
+{
+    if (lastSnapshot && dirtyPages.none()) {
+        return lastSnapshot;
+    }
+
+    std::bitset<PageCount> stored = dirtyPages & writablePages;
+    size_t deltaBytes = stored.count() * PageSize + sizeof(Snapshot);
+    auto snapshot = std::make_shared<Snapshot>();
+    if (lastSnapshot && lastSnapshot->deltaBytes + deltaBytes <= RAMSize) {
+        // A page that is not dirty has not been remapped either, so the
+        // parent's entry for it still holds.
+        snapshot->parent = lastSnapshot;
+        snapshot->pages = lastSnapshot->pages;
+        snapshot->deltaBytes = lastSnapshot->deltaBytes + deltaBytes;
+    } else {
+        stored = writablePages;
+        snapshot->deltaBytes = 0;
+    }
+
+    snapshot->bytes = std::make_unique_for_overwrite<uint8_t[]>(stored.count() * PageSize);
+    uint8_t* next = snapshot->bytes.get();
+    for (uint32_t page = 0; page < PageCount; page++) {
+        if (stored[page]) {
+            std::memcpy(next, readPages[page], PageSize);
+            snapshot->pages[page] = next;
+            next += PageSize;
+        } else if (!writablePages[page]) {
+            snapshot->pages[page] = nullptr;
+        }
+        if (dirtyPages[page]) {
+            dirtyPages[page] = false;
+            UpdateWritePage(page);
+        }
+    }
+    lastSnapshot = snapshot;
+    return snapshot;
+}
+
+void Memory::LoadState(std::shared_ptr<const Snapshot> snapshot)
+{
+    for (uint32_t page = 0; page < PageCount; page++) {
+        const uint8_t* saved = snapshot->pages[page];
+        if (!writablePages[page] || !saved) {
+            continue;
+        }
+
+        dirtyPages[page] = false;
+        if (std::memcmp(readPages[page], saved, PageSize) != 0) {
+            if (sharedPages.test(page)) {
+                CopySharedPage(page);
+            }
+            if (codePages.test(page) && codeWriteHandler) {
+                codeWriteHandler(page * PageSize, PageSize);
+            }
+            std::memcpy(ramPages[page], saved, PageSize);
+        }
+        UpdateWritePage(page);
+    }
+    lastSnapshot = std::move(snapshot);
+}
+
+uint8_t Memory::ReadIO(uint16_t index)
+{
+    const IOHandlers* io = ioPages[index >> 8];
+    if (io && io->read) {
+        return io->read(index);
+    }
+    return 0xFF; // open bus
 }
 
-void Memory::WriteWord(uint16_t index, uint16_t value) {
-    *(reinterpret_cast<uint16_t*>(data + index)) = value;
+void Memory::WriteSlow(uint16_t index, uint8_t value)
+{
+    if (sharedPages.test(index >> 8)) {
+        CopySharedPage(index >> 8);
+    }
+    uint8_t* ram = ramPages[index >> 8];
+    if (ram) {
+        if (!dirtyPages.test(index >> 8)) {
+            dirtyPages.set(index >> 8);
+            UpdateWritePage(index >> 8);
+        }
+        if (codePages.test(index >> 8) && codeWriteHandler) {
+            codeWriteHandler(index, 1);
+        }
+        ram[index & 0xFF] = value;
+        return;
+    }
+
+    const IOHandlers* io = ioPages[index >> 8];
+    if (io && io->write) {
+        io->write(index, value);
+    }
+    // Writes to ROM pages are dropped.
 }
@@ -1,20 +1,250 @@
 #pragma once
+#include <array>
+#include <bitset>
 #include <cstdint>
+#include <cstring>
+#include <functional>
+#include <memory>
 #include <string>
+#include <vector>
 
+// The 64K address space is split into 256 pages of 256 bytes. Each page
+// either points straight at host memory (RAM, ROM) or is routed to the
+// read/write callbacks of a memory-mapped device.
 class Memory {
 
 public:
+	using ReadHandler = std::function<uint8_t(uint16_t address)>;
+	using WriteHandler = std::function<void(uint16_t address, uint8_t value)>;
+	// Told that [address, address + size) is about to change under code
+	// that was decoded from it.
+	using CodeWriteHandler = std::function<void(uint16_t address, uint32_t size)>;
+
+	static constexpr uint32_t PageSize = 256;
+	static constexpr uint32_t PageCount = 256;
+
+	// A file mapped into the address space at a page-aligned address.
+	// Read-only images become ROM pages. Writable images are mapped
+	// copy-on-write, so writes never reach the file.
+	struct Image {
+		std::string path;
+		uint16_t address = 0;
+		bool writable = false;
+	};
+
+	// A frozen copy of every page that forked Memory instances share.
+	struct BaseImage {
+		std::unique_ptr<uint8_t[]> bytes; // PageCount * PageSize
+		std::bitset<PageCount> rom;
+	};
+
+	// The contents of the writable pages at one point in time. A snapshot
+	// stores only the pages written since its parent was taken and points
+	// into its ancestors for the rest.
+	struct Snapshot {
+		std::shared_ptr<const Snapshot> parent;
+		// Null for pages that were not writable.
+		std::array<const uint8_t*, PageCount> pages;
+		std::unique_ptr<uint8_t[]> bytes;
+		// Bytes held by this snapshot and its ancestors back to the last
+		// one that stored every page, not counting that one.
+		size_t deltaBytes;
+	};
+
 	Memory();
+	// Forks an address space from a base image without copying it. RAM
+	// pages are copied on their first write, so a fork only holds the
+	// pages it has written; ROM pages stay shared for good.
+	explicit Memory(std::shared_ptr<const BaseImage> base);
 	~Memory();
 
+	Memory(const Memory&) = delete;
+	Memory& operator=(const Memory&) = delete;
+
 	bool LoadFromFile(const std::string& path);
+	// Maps each image in order without copying it; later images overlay
+	// earlier ones where they overlap.
+	bool LoadImages(const std::vector<Image>& images);
+
+	// Mapping functions take a page-aligned address and size and return
+	// false otherwise. Host memory passed in must outlive the mapping.
+	bool MapRAM(uint16_t address, uint32_t size, uint8_t* host);
+	bool MapROM(uint16_t address, uint32_t size, const uint8_t* host);
+	bool MapIO(uint16_t address, uint32_t size, ReadHandler read, WriteHandler write);
+	// Restores the built-in RAM behind the given range.
+	bool Unmap(uint16_t address, uint32_t size);
+
+	// Freezes the current contents into a base image for forks. ROM pages
+	// stay ROM in the forks; device pages become zeroed RAM, since devices
+	// are not shared.
+	std::shared_ptr<const BaseImage> Share() const;
+
+	// Writes mark their page dirty, and SaveState stores the pages that
+	// are dirty since the last SaveState or LoadState against the snapshot
+	// that call dealt with, or returns that snapshot again when nothing
+	// was written. Once the snapshots since the last full one hold as many
+	// bytes as the address space, the next one stores every page again, so
+	// a chain never holds much more than twice that. Only writes through this class are tracked, not writes to
+	// host memory passed to MapRAM.
+	std::shared_ptr<const Snapshot> SaveState();
+	// Pages whose contents already match are left alone, so code decoded
+	// from them stays valid.
+	void LoadState(std::shared_ptr<const Snapshot> snapshot);
+
+	// Pages this instance has copied from its base image.
+	size_t PrivatePageCount() const
+	{
+		return privatePageCount;
+	}
+
+	// What backs a page: a device, ROM, or RAM (including pages still
+	// shared with the base image), which is what SaveState stores.
+	enum class PageKind : uint8_t {
+		Device,
+		ROM,
+		RAM,
+	};
+
+	PageKind KindOf(uint8_t page) const
+	{
+		if (writablePages[page])
+			return PageKind::RAM;
+		return readPages[page] ? PageKind::ROM : PageKind::Device;
+	}
+
+	// True when the address is backed by RAM or ROM rather than a device,
+	// so its contents only change through writes.
+	bool IsDirect(uint16_t address) const
+	{
+		return readPages[address >> 8] != nullptr;
+	}
+
+	// Writes to a RAM page marked as code take the slow path and call the
+	// code write handler first. Remapping a code page calls it too.
+	void SetCodeWriteHandler(CodeWriteHandler handler);
+	void MarkCode(uint8_t page, bool code);
 
-	uint8_t ReadByte(uint16_t index);
-	void WriteByte(uint16_t index, uint8_t value);
-	uint16_t ReadWord(uint16_t index);
-	void WriteWord(uint16_t index, uint16_t value);
+	// The page tables behind ReadByte and WriteByte, for code that
+	// inlines those fast paths.
+	const uint8_t* const* ReadPageTable() const
+	{
+		return readPages;
+	}
+
+	uint8_t* const* WritePageTable() const
+	{
+		return writePages;
+	}
+
+	inline uint8_t ReadByte(uint16_t index)
+	{
+		const uint8_t* page = readPages[index >> 8];
+		if (page)
+			return page[index & 0xFF];
+		return ReadIO(index);
+	}
+
+	inline void WriteByte(uint16_t index, uint8_t value)
+	{
+		uint8_t* page = writePages[index >> 8];
+		if (page)
+			page[index & 0xFF] = value;
+		else
+			WriteSlow(index, value);
+	}
+
+	// Reads without side effects, for diagnostics: device pages read as
+	// zero instead of going to the device.
+	uint8_t Peek(uint16_t index) const
+	{
+		const uint8_t* page = readPages[index >> 8];
+		return page ? page[index & 0xFF] : 0;
+	}
+
+	// Little-endian hosts only, like the rest of the emulator.
+	inline uint16_t ReadWord(uint16_t index)
+	{
+		const uint8_t* page = wordPages[index >> 8];
+		if (page) {
+			uint16_t value;
+			std::memcpy(&value, page + (index & 0xFF), sizeof(value));
+			return value;
+		}
+		return ReadByte(index) | (ReadByte(index + 1) << 8);
+	}
+
+	// Reads a pointer from the zero page; the high byte of a pointer at
+	// 0xFF comes from 0x00.
+	inline uint16_t ReadZPWord(uint8_t index)
+	{
+		return ReadByte(index) | (ReadByte(uint8_t(index + 1)) << 8);
+	}
+
+	inline void WriteWord(uint16_t index, uint16_t value)
+	{
+		WriteByte(index, value & 0xFF);
+		WriteByte(index + 1, value >> 8);
+	}
 
 private:
-	uint8_t* data;
+	struct IOHandlers {
+		ReadHandler read;
+		WriteHandler write;
+	};
+
+	static bool IsPageAligned(uint16_t address, uint32_t size);
+
+	uint8_t* AllocateMirroredRAM();
+	uint8_t* BuiltInRAM();
+	void CopySharedPage(uint32_t page);
+	bool LoadImage(const Image& image);
+	void UpdateWordPages();
+	void UpdateWritePage(uint32_t page);
+
+	uint8_t ReadIO(uint16_t index);
+	void WriteSlow(uint16_t index, uint8_t value);
+	void RemapPage(uint32_t page, const uint8_t* read, uint8_t* write, const IOHandlers* io);
+
+	// Allocated on first use, so that forks which never unmap anything
+	// go without it.
+	uint8_t* data = nullptr;
+	// The built-in RAM is mapped twice back to back, so data[0x10000 + i]
+	// aliases data[i] and a word read at 0xFFFF wraps without a branch.
+	bool mirrored = false;
+
+	// Direct host pointers per page; null sends the access to ioPages,
+	// and a page with neither (ROM) ignores writes.
+	const uint8_t* readPages[PageCount];
+	uint8_t* writePages[PageCount];
+	// The writable host memory behind each page, also for pages whose
+	// fast write path is disabled to watch them: those holding code, and
+	// those not yet written since the last snapshot.
+	uint8_t* ramPages[PageCount];
+	std::bitset<PageCount> codePages;
+	// RAM pages, including those still shared with the base image.
+	std::bitset<PageCount> writablePages;
+	std::bitset<PageCount> dirtyPages;
+	std::shared_ptr<const Snapshot> lastSnapshot;
+	CodeWriteHandler codeWriteHandler;
+	const IOHandlers* ioPages[PageCount];
+	// Set when a word read anywhere in the page can use one host load:
+	// the page and the one after it are readable and contiguous in host
+	// memory (page 0xFF is followed by page 0x00).
+	const uint8_t* wordPages[PageCount];
+	std::vector<std::unique_ptr<IOHandlers>> devices;
+
+	struct Mapping {
+		void* address;
+		size_t size;
+	};
+	std::vector<Mapping> imageMappings;
+	std::vector<std::unique_ptr<uint8_t[]>> imageBuffers;
+
+	// Pages still read from the base image; writing one copies it.
+	std::shared_ptr<const BaseImage> base;
+	std::bitset<PageCount> sharedPages;
+	// Copied pages, allocated PrivateChunkPages at a time.
+	static constexpr size_t PrivateChunkPages = 16;
+	std::vector<std::unique_ptr<uint8_t[]>> privateChunks;
+	size_t privatePageCount = 0;
 };
@@ -0,0 +1,191 @@
+#pragma once
+
+#include "defines.h"
+
+// Every implemented opcode, the CPU handler that executes it, its length in
+// bytes and its base cycle count. OPCODE(opcode, handler, bytes, cycles) is
+// expanded once per entry; the handler is specialized on its addressing mode
+// so it never has to decode the opcode. Page-crossing and taken-branch
+// penalties are charged by the handlers themselves.
+#define OTWO_OPCODES(OPCODE)                                    \
+	OPCODE(ADC_IMM, ADC<&CPU::FetchByte>, 2, 2)                 \
+	OPCODE(ADC_ZP, ADC<&CPU::FetchByteZP>, 2, 3)                \
+	OPCODE(ADC_ZPX, ADC<&CPU::FetchByteZPX>, 2, 4)              \
+	OPCODE(ADC_ABS, ADC<&CPU::FetchByteAbsolute>, 3, 4)         \
+	OPCODE(ADC_ABSX, ADC<&CPU::FetchByteAbsoluteX>, 3, 4)       \
+	OPCODE(ADC_ABSY, ADC<&CPU::FetchByteAbsoluteY>, 3, 4)       \
+	OPCODE(ADC_INDX, ADC<&CPU::FetchByteIndirectX>, 2, 6)       \
+	OPCODE(ADC_INDY, ADC<&CPU::FetchByteIndirectY>, 2, 5)       \
+                                                                \
+	OPCODE(SBC_IMM, SBC<&CPU::FetchByte>, 2, 2)                 \
+	OPCODE(SBC_ZP, SBC<&CPU::FetchByteZP>, 2, 3)                \
+	OPCODE(SBC_ZPX, SBC<&CPU::FetchByteZPX>, 2, 4)              \
+	OPCODE(SBC_ABS, SBC<&CPU::FetchByteAbsolute>, 3, 4)         \
+	OPCODE(SBC_ABSX, SBC<&CPU::FetchByteAbsoluteX>, 3, 4)       \
+	OPCODE(SBC_ABSY, SBC<&CPU::FetchByteAbsoluteY>, 3, 4)       \
+	OPCODE(SBC_INDX, SBC<&CPU::FetchByteIndirectX>, 2, 6)       \
+	OPCODE(SBC_INDY, SBC<&CPU::FetchByteIndirectY>, 2, 5)       \
+                                                                \
+	OPCODE(LDA_IMM, LDA<&CPU::FetchByte>, 2, 2)                 \
+	OPCODE(LDA_ZP, LDA<&CPU::FetchByteZP>, 2, 3)                \
+	OPCODE(LDA_ZPX, LDA<&CPU::FetchByteZPX>, 2, 4)              \
+	OPCODE(LDA_ABS, LDA<&CPU::FetchByteAbsolute>, 3, 4)         \
+	OPCODE(LDA_ABSX, LDA<&CPU::FetchByteAbsoluteX>, 3, 4)       \
+	OPCODE(LDA_ABSY, LDA<&CPU::FetchByteAbsoluteY>, 3, 4)       \
+	OPCODE(LDA_INDX, LDA<&CPU::FetchByteIndirectX>, 2, 6)       \
+	OPCODE(LDA_INDY, LDA<&CPU::FetchByteIndirectY>, 2, 5)       \
+                                                                \
+	OPCODE(LDX_IMM, LDX<&CPU::FetchByte>, 2, 2)                 \
+	OPCODE(LDX_ZP, LDX<&CPU::FetchByteZP>, 2, 3)                \
+	OPCODE(LDX_ZPY, LDX<&CPU::FetchByteZPY>, 2, 4)              \
+	OPCODE(LDX_ABS, LDX<&CPU::FetchByteAbsolute>, 3, 4)         \
+	OPCODE(LDX_ABSY, LDX<&CPU::FetchByteAbsoluteY>, 3, 4)       \
+                                                                \
+	OPCODE(LDY_IMM, LDY<&CPU::FetchByte>, 2, 2)                 \
+	OPCODE(LDY_ZP, LDY<&CPU::FetchByteZP>, 2, 3)                \
+	OPCODE(LDY_ZPX, LDY<&CPU::FetchByteZPX>, 2, 4)              \
+	OPCODE(LDY_ABS, LDY<&CPU::FetchByteAbsolute>, 3, 4)         \
+	OPCODE(LDY_ABSX, LDY<&CPU::FetchByteAbsoluteX>, 3, 4)       \
+                                                                \
+	OPCODE(AND_IMM, AND<&CPU::FetchByte>, 2, 2)                 \
+	OPCODE(AND_ZP, AND<&CPU::FetchByteZP>, 2, 3)                \
+	OPCODE(AND_ZPX, AND<&CPU::FetchByteZPX>, 2, 4)              \
+	OPCODE(AND_ABS, AND<&CPU::FetchByteAbsolute>, 3, 4)         \
+	OPCODE(AND_ABSX, AND<&CPU::FetchByteAbsoluteX>, 3, 4)       \
+	OPCODE(AND_ABSY, AND<&CPU::FetchByteAbsoluteY>, 3, 4)       \
+	OPCODE(AND_INDX, AND<&CPU::FetchByteIndirectX>, 2, 6)       \
+	OPCODE(AND_INDY, AND<&CPU::FetchByteIndirectY>, 2, 5)       \
+                                                                \
+	OPCODE(ORA_IMM, ORA<&CPU::FetchByte>, 2, 2)                 \
+	OPCODE(ORA_ZP, ORA<&CPU::FetchByteZP>, 2, 3)                \
+	OPCODE(ORA_ZPX, ORA<&CPU::FetchByteZPX>, 2, 4)              \
+	OPCODE(ORA_ABS, ORA<&CPU::FetchByteAbsolute>, 3, 4)         \
+	OPCODE(ORA_ABSX, ORA<&CPU::FetchByteAbsoluteX>, 3, 4)       \
+	OPCODE(ORA_ABSY, ORA<&CPU::FetchByteAbsoluteY>, 3, 4)       \
+	OPCODE(ORA_INDX, ORA<&CPU::FetchByteIndirectX>, 2, 6)       \
+	OPCODE(ORA_INDY, ORA<&CPU::FetchByteIndirectY>, 2, 5)       \
+                                                                \
+	OPCODE(EOR_IMM, EOR<&CPU::FetchByte>, 2, 2)                 \
+	OPCODE(EOR_ZP, EOR<&CPU::FetchByteZP>, 2, 3)                \
+	OPCODE(EOR_ZPX, EOR<&CPU::FetchByteZPX>, 2, 4)              \
+	OPCODE(EOR_ABS, EOR<&CPU::FetchByteAbsolute>, 3, 4)         \
+	OPCODE(EOR_ABSX, EOR<&CPU::FetchByteAbsoluteX>, 3, 4)       \
+	OPCODE(EOR_ABSY, EOR<&CPU::FetchByteAbsoluteY>, 3, 4)       \
+	OPCODE(EOR_INDX, EOR<&CPU::FetchByteIndirectX>, 2, 6)       \
+	OPCODE(EOR_INDY, EOR<&CPU::FetchByteIndirectY>, 2, 5)       \
+                                                                \
+	OPCODE(BCC_REL, BCC, 2, 2)                                  \
+	OPCODE(BCS_REL, BCS, 2, 2)                                  \
+	OPCODE(BEQ_REL, BEQ, 2, 2)                                  \
+	OPCODE(BNE_REL, BNE, 2, 2)                                  \
+	OPCODE(BMI_REL, BMI, 2, 2)                                  \
+	OPCODE(BPL_REL, BPL, 2, 2)                                  \
+	OPCODE(BVC_REL, BVC, 2, 2)                                  \
+	OPCODE(BVS_REL, BVS, 2, 2)                                  \
+                                                                \
+	OPCODE(BIT_ZP, BIT<&CPU::FetchByteZP>, 2, 3)                \
+	OPCODE(BIT_ABS, BIT<&CPU::FetchByteAbsolute>, 3, 4)         \
+                                                                \
+	OPCODE(BRK_IMP, BRK, 1, 7)                                  \
+	OPCODE(NOP_IMP, NOP, 1, 2)                                  \
+                                                                \
+	OPCODE(PHA_IMP, PHA, 1, 3)                                  \
+	OPCODE(PHP_IMP, PHP, 1, 3)                                  \
+	OPCODE(PLA_IMP, PLA, 1, 4)                                  \
+	OPCODE(PLP_IMP, PLP, 1, 4)                                  \
+                                                                \
+	OPCODE(JMP_ABS, JMP<&CPU::FetchWord>, 3, 3)                 \
+	OPCODE(JMP_IND, JMP<&CPU::FetchIndirectAddress>, 3, 5)      \
+                                                                \
+	OPCODE(ASL_ACC, ASLAccumulator, 1, 2)                       \
+	OPCODE(ASL_ZP, ASL<&CPU::AddressZP>, 2, 5)                  \
+	OPCODE(ASL_ZPX, ASL<&CPU::AddressZPX>, 2, 6)                \
+	OPCODE(ASL_ABS, ASL<&CPU::AddressAbsolute>, 3, 6)           \
+	OPCODE(ASL_ABSX, ASL<&CPU::AddressAbsoluteX>, 3, 7)         \
+                                                                \
+	OPCODE(LSR_ACC, LSRAccumulator, 1, 2)                       \
+	OPCODE(LSR_ZP, LSR<&CPU::AddressZP>, 2, 5)                  \
+	OPCODE(LSR_ZPX, LSR<&CPU::AddressZPX>, 2, 6)                \
+	OPCODE(LSR_ABS, LSR<&CPU::AddressAbsolute>, 3, 6)           \
+	OPCODE(LSR_ABSX, LSR<&CPU::AddressAbsoluteX>, 3, 7)         \
+                                                                \
+	OPCODE(ROL_ACC, ROLAccumulator, 1, 2)                       \
+	OPCODE(ROL_ZP, ROL<&CPU::AddressZP>, 2, 5)                  \
+	OPCODE(ROL_ZPX, ROL<&CPU::AddressZPX>, 2, 6)                \
+	OPCODE(ROL_ABS, ROL<&CPU::AddressAbsolute>, 3, 6)           \
+	OPCODE(ROL_ABSX, ROL<&CPU::AddressAbsoluteX>, 3, 7)         \
+                                                                \
+	OPCODE(ROR_ACC, RORAccumulator, 1, 2)                       \
+	OPCODE(ROR_ZP, ROR<&CPU::AddressZP>, 2, 5)                  \
+	OPCODE(ROR_ZPX, ROR<&CPU::AddressZPX>, 2, 6)                \
+	OPCODE(ROR_ABS, ROR<&CPU::AddressAbsolute>, 3, 6)           \
+	OPCODE(ROR_ABSX, ROR<&CPU::AddressAbsoluteX>, 3, 7)         \
+                                                                \
+	OPCODE(CLC_IMP, CLC, 1, 2)                                  \
+	OPCODE(CLD_IMP, CLD, 1, 2)                                  \
+	OPCODE(CLI_IMP, CLI, 1, 2)                                  \
+	OPCODE(CLV_IMP, CLV, 1, 2)                                  \
+                                                                \
+	OPCODE(CMP_IMM, CMP<&CPU::FetchByte>, 2, 2)                 \
+	OPCODE(CMP_ZP, CMP<&CPU::FetchByteZP>, 2, 3)                \
+	OPCODE(CMP_ZPX, CMP<&CPU::FetchByteZPX>, 2, 4)              \
+	OPCODE(CMP_ABS, CMP<&CPU::FetchByteAbsolute>, 3, 4)         \
+	OPCODE(CMP_ABSX, CMP<&CPU::FetchByteAbsoluteX>, 3, 4)       \
+	OPCODE(CMP_ABSY, CMP<&CPU::FetchByteAbsoluteY>, 3, 4)       \
+	OPCODE(CMP_INDX, CMP<&CPU::FetchByteIndirectX>, 2, 6)       \
+	OPCODE(CMP_INDY, CMP<&CPU::FetchByteIndirectY>, 2, 5)       \
+                                                                \
+	OPCODE(CPX_IMM, CPX<&CPU::FetchByte>, 2, 2)                 \
+	OPCODE(CPX_ZP, CPX<&CPU::FetchByteZP>, 2, 3)                \
+	OPCODE(CPX_ABS, CPX<&CPU::FetchByteAbsolute>, 3, 4)         \
+                                                                \
+	OPCODE(CPY_IMM, CPY<&CPU::FetchByte>, 2, 2)                 \
+	OPCODE(CPY_ZP, CPY<&CPU::FetchByteZP>, 2, 3)                \
+	OPCODE(CPY_ABS, CPY<&CPU::FetchByteAbsolute>, 3, 4)         \
+                                                                \
+	OPCODE(DEC_ZP, DEC<&CPU::AddressZP>, 2, 5)                  \
+	OPCODE(DEC_ZPX, DEC<&CPU::AddressZPX>, 2, 6)                \
+	OPCODE(DEC_ABS, DEC<&CPU::AddressAbsolute>, 3, 6)           \
+	OPCODE(DEC_ABSX, DEC<&CPU::AddressAbsoluteX>, 3, 7)         \
+                                                                \
+	OPCODE(DEX_IMP, DEX, 1, 2)                                  \
+	OPCODE(DEY_IMP, DEY, 1, 2)                                  \
+                                                                \
+	OPCODE(INC_ZP, INC<&CPU::AddressZP>, 2, 5)                  \
+	OPCODE(INC_ZPX, INC<&CPU::AddressZPX>, 2, 6)                \
+	OPCODE(INC_ABS, INC<&CPU::AddressAbsolute>, 3, 6)           \
+	OPCODE(INC_ABSX, INC<&CPU::AddressAbsoluteX>, 3, 7)         \
+                                                                \
+	OPCODE(INX_IMP, INX, 1, 2)                                  \
+	OPCODE(INY_IMP, INY, 1, 2)                                  \
+                                                                \
+	OPCODE(JSR_ABS, JSR, 3, 6)                                  \
+	OPCODE(RTS_IMP, RTS, 1, 6)                                  \
+	OPCODE(RTI_IMP, RTI, 1, 6)                                  \
+                                                                \
+	OPCODE(SEC_IMP, SEC, 1, 2)                                  \
+	OPCODE(SED_IMP, SED, 1, 2)                                  \
+	OPCODE(SEI_IMP, SEI, 1, 2)                                  \
+                                                                \
+	OPCODE(STA_ZP, STA<&CPU::AddressZP>, 2, 3)                  \
+	OPCODE(STA_ZPX, STA<&CPU::AddressZPX>, 2, 4)                \
+	OPCODE(STA_ABS, STA<&CPU::AddressAbsolute>, 3, 4)           \
+	OPCODE(STA_ABSX, STA<&CPU::AddressAbsoluteX>, 3, 5)         \
+	OPCODE(STA_ABSY, STA<&CPU::AddressAbsoluteY>, 3, 5)         \
+	OPCODE(STA_INDX, STA<&CPU::AddressIndirectX>, 2, 6)         \
+	OPCODE(STA_INDY, STA<&CPU::AddressIndirectY>, 2, 6)         \
+                                                                \
+	OPCODE(STX_ZP, STX<&CPU::AddressZP>, 2, 3)                  \
+	OPCODE(STX_ZPY, STX<&CPU::AddressZPY>, 2, 4)                \
+	OPCODE(STX_ABS, STX<&CPU::AddressAbsolute>, 3, 4)           \
+                                                                \
+	OPCODE(STY_ZP, STY<&CPU::AddressZP>, 2, 3)                  \
+	OPCODE(STY_ZPX, STY<&CPU::AddressZPX>, 2, 4)                \
+	OPCODE(STY_ABS, STY<&CPU::AddressAbsolute>, 3, 4)           \
+                                                                \
+	OPCODE(TAX_IMP, TAX, 1, 2)                                  \
+	OPCODE(TAY_IMP, TAY, 1, 2)                                  \
+	OPCODE(TSX_IMP, TSX, 1, 2)                                  \
+	OPCODE(TXA_IMP, TXA, 1, 2)                                  \
+	OPCODE(TXS_IMP, TXS, 1, 2)                                  \
+	OPCODE(TYA_IMP, TYA, 1, 2)
@@ -0,0 +1,132 @@
+#include "profiler.h"
+#include <algorithm>
+#include <array>
+#include <cstdio>
+#include <fstream>
+#include <numeric>
+
+#include "opcodes.h"
+
+namespace {
+
+constexpr const char* UnknownName = "unknown";
+
+constexpr std::array<const char*, 256> BuildOpcodeNames()
+{
+    std::array<const char*, 256> names{};
+    names.fill(UnknownName);
+#define OTWO_OPCODE_NAME(opcode, handler, bytes, base_cycles) names[opcode] = #opcode;
+    OTWO_OPCODES(OTWO_OPCODE_NAME)
+#undef OTWO_OPCODE_NAME
+    return names;
+}
+
+constexpr std::array<const char*, 256> OpcodeNames = BuildOpcodeNames();
+
+std::string AddressName(uint16_t address)
+{
+    char name[6];
+    std::snprintf(name, sizeof(name), "$%04X", address);
+    return name;
+}
+
+// Indices of the largest counts, largest first.
+std::vector<size_t> Hottest(const std::vector<uint64_t>& counts, size_t count)
+{
+    std::vector<size_t> indices(counts.size());
+    std::iota(indices.begin(), indices.end(), 0);
+    count = std::min(count, indices.size());
+    std::partial_sort(indices.begin(), indices.begin() + count, indices.end(),
+        [&counts](size_t a, size_t b) { return counts[a] > counts[b]; });
+    indices.resize(count);
+    while (!indices.empty() && counts[indices.back()] == 0) {
+        indices.pop_back();
+    }
+    return indices;
+}
+
+}
+
+Profiler::Profiler()
+    : addressCounts(0x10000), opcodeCounts(256), pairCounts(0x10000), nodes(1, Node{ 0, 0 })
+{
+}
+
+void Profiler::Call(uint16_t target, uint8_t stackPointer)
+{
+    // A frame at or below the new return address was left without a
+    // return, by code that popped its return address itself.
+    while (!frames.empty() && frames.back().stackPointer <= stackPointer) {
+        frames.pop_back();
+    }
+    if (frames.size() == MaxDepth) {
+        Enter(frames.back().node);
+        return;
+    }
+
+    uint32_t parent = frames.empty() ? 0 : frames.back().node;
+    auto [child, inserted] = children.try_emplace((uint64_t(parent) << 16) | target, uint32_t(nodes.size()));
+    if (inserted) {
+        nodes.push_back({ parent, target });
+    }
+    frames.push_back({ child->second, stackPointer });
+    Enter(child->second);
+}
+
+void Profiler::WriteFolded(std::ostream& out)
+{
+    Enter(current);
+    std::vector<uint16_t> chain;
+    for (uint32_t i = 0; i < nodes.size(); i++) {
+        if (nodes[i].instructions == 0) {
+            continue;
+        }
+        chain.clear();
+        for (uint32_t node = i; node != 0; node = nodes[node].parent) {
+            chain.push_back(nodes[node].address);
+        }
+        chain.push_back(nodes[0].address);
+
+        for (size_t j = chain.size(); j-- > 0;) {
+            out << AddressName(chain[j]) << (j == 0 ? ' ' : ';');
+        }
+        out << nodes[i].instructions << '\n';
+    }
+}
+
+bool Profiler::WriteFolded(const std::string& path)
+{
+    std::ofstream file(path);
+    WriteFolded(file);
+    return static_cast<bool>(file);
+}
+
+void Profiler::WritePairs(std::ostream& out) const
+{
+    for (uint32_t pair = 0; pair < pairCounts.size(); pair++) {
+        const char* first = OpcodeNames[pair >> 8];
+        const char* second = OpcodeNames[pair & 0xFF];
+        if (pairCounts[pair] != 0 && first != UnknownName && second != UnknownName) {
+            out << first << ' ' << second << ' ' << pairCounts[pair] << '\n';
+        }
+    }
+}
+
+bool Profiler::WritePairs(const std::string& path) const
+{
+    std::ofstream file(path);
+    WritePairs(file);
+    return static_cast<bool>(file);
+}
+
+void Profiler::WriteSummary(std::ostream& out, size_t count) const
+{
+    out << "Hottest addresses:\n";
+    for (size_t address : Hottest(addressCounts, count)) {
+        out << "  " << AddressName(address) << ' ' << addressCounts[address] << '\n';
+    }
+    out << "Hottest opcodes:\n";
+    for (size_t opcode : Hottest(opcodeCounts, count)) {
+        out << "  " << OpcodeNames[opcode] << ' ' << opcodeCounts[opcode] << '\n';
+    }
+}
@@ -0,0 +1,129 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <ostream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "defines.h"
+
+// Counts where a guest program spends its instructions: how often each
+// address, each opcode and each pair of opcodes run one after the other
+// is executed, and under which chain of calls.
+// The CPU reports every instruction through Count, and every JSR, BRK,
+// interrupt, RTS and RTI through Call and Return; it only does so when built with a
+// policy that has Profiling on (see cpupolicy.h).
+//
+// Calls are followed on a shadow stack. Each frame remembers the stack
+// pointer just after the call pushed its return address, and a return
+// drops every frame whose return address it has popped, so code that
+// discards stack frames or jumps through RTS does not leave the shadow
+// stack out of step. Each distinct chain of calls is a node of a tree, and
+// instructions are counted against the node they ran under.
+class Profiler {
+
+public:
+	Profiler();
+
+	Profiler(const Profiler&) = delete;
+	Profiler& operator=(const Profiler&) = delete;
+
+	// Called by the CPU as it starts reporting, with its PC, which names the
+	// outermost routine.
+	void Start(uint16_t pc)
+	{
+		if (counted == 0 && frames.empty())
+			nodes[0].address = pc;
+	}
+
+	inline void Count(uint16_t pc, uint8_t opcode)
+	{
+		addressCounts[pc]++;
+		opcodeCounts[opcode]++;
+		pairCounts[(previous << 8) | opcode]++;
+		previous = opcode;
+		counted++;
+	}
+
+	// After a JSR, BRK or interrupt, with the stack pointer once the
+	// return address (and for the others, the status) has been pushed.
+	void Call(uint16_t target, uint8_t stackPointer);
+
+	// After an RTS or RTI, with the stack pointer once it has popped.
+	void Return(uint8_t stackPointer)
+	{
+		while (!frames.empty() && frames.back().stackPointer < stackPointer)
+			frames.pop_back();
+		Enter(frames.empty() ? 0 : frames.back().node);
+	}
+
+	uint64_t AddressCount(uint16_t address) const
+	{
+		return addressCounts[address];
+	}
+
+	uint64_t OpcodeCount(uint8_t opcode) const
+	{
+		return opcodeCounts[opcode];
+	}
+
+	// How often second ran right after first.
+	uint64_t PairCount(uint8_t first, uint8_t second) const
+	{
+		return pairCounts[(first << 8) | second];
+	}
+
+	// One line per chain of calls that ran instructions: the routines from
+	// the outermost in, separated by semicolons, and the instructions run
+	// in the innermost. Flame graph tools read this format.
+	void WriteFolded(std::ostream& out);
+	bool WriteFolded(const std::string& path);
+
+	// One line per pair of implemented opcodes that ran one after the
+	// other: the two opcode names and the count. OTwoFuse reads this.
+	void WritePairs(std::ostream& out) const;
+	bool WritePairs(const std::string& path) const;
+
+	// The most executed addresses and opcodes, count of each.
+	void WriteSummary(std::ostream& out, size_t count) const;
+
+private:
+	// A routine in a chain of calls.
+	struct Node {
+		uint32_t parent;
+		uint16_t address;
+		uint64_t instructions = 0;
+	};
+
+	struct Frame {
+		uint32_t node;
+		uint8_t stackPointer;
+	};
+
+	// A stack that wraps around is not followed deeper than this.
+	static constexpr size_t MaxDepth = 256;
+
+	// Charges the instructions counted since the last call or return to
+	// the node they ran under, so that Count only has to bump a counter.
+	void Enter(uint32_t node)
+	{
+		nodes[current].instructions += counted - enteredAt;
+		enteredAt = counted;
+		current = node;
+	}
+
+	std::vector<uint64_t> addressCounts;
+	std::vector<uint64_t> opcodeCounts;
+	std::vector<uint64_t> pairCounts;
+	std::vector<Node> nodes;
+	// Keyed by the parent node and the address called.
+	std::unordered_map<uint64_t, uint32_t> children;
+	std::vector<Frame> frames;
+	uint32_t current = 0;
+	uint64_t counted = 0;
+	uint64_t enteredAt = 0;
+	// BRK ends every block, so the pair counted with the first instruction
+	// is never one the decoder could fuse.
+	uint8_t previous = BRK_IMP;
+};
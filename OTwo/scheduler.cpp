@@ -0,0 +1,37 @@
+#include "scheduler.h"
+#include <algorithm>
+
+Scheduler::EventId Scheduler::Schedule(uint64_t cycle, Action action)
+{
+    EventId id = nextId++;
+    events.push_back({ cycle, id, std::move(action) });
+    std::push_heap(events.begin(), events.end(), Later);
+    return id;
+}
+
+void Scheduler::Cancel(EventId id)
+{
+    auto event = std::find_if(events.begin(), events.end(), [id](const Event& e) { return e.id == id; });
+    if (event == events.end()) {
+        return;
+    }
+    events.erase(event);
+    std::make_heap(events.begin(), events.end(), Later);
+}
+
+void Scheduler::Clear()
+{
+    events.clear();
+}
+
+void Scheduler::RunDue(uint64_t cycle)
+{
+    while (!events.empty() && events.front().cycle <= cycle) {
+        // Taken off the heap first, so that the action can schedule and
+        // cancel freely.
+        std::pop_heap(events.begin(), events.end(), Later);
+        Event event = std::move(events.back());
+        events.pop_back();
+        event.action(event.cycle);
+    }
+}
@@ -0,0 +1,58 @@
+#pragma once
+#include <cstdint>
+#include <functional>
+#include <vector>
+
+// Device events keyed by the CPU cycle they are due at. The CPU runs
+// straight up to the earliest one and runs it between instructions, so
+// devices are never polled per instruction. Events are kept in a binary
+// min-heap: scheduling and running one costs O(log n) in the number of
+// pending events, cancelling one O(n).
+class Scheduler {
+
+public:
+	// Called with the cycle the event was due at. The CPU only stops
+	// between instructions, so its cycle counter may be a few past that;
+	// periodic devices reschedule from the due cycle to avoid drifting.
+	using Action = std::function<void(uint64_t cycle)>;
+	using EventId = uint64_t;
+
+	static constexpr uint64_t Never = UINT64_MAX;
+
+	// Events due at the same cycle run in the order they were scheduled.
+	EventId Schedule(uint64_t cycle, Action action);
+	// Does nothing when the event has already run or been cancelled.
+	void Cancel(EventId id);
+	void Clear();
+
+	// The cycle the earliest event is due at, or Never.
+	uint64_t NextCycle() const
+	{
+		return events.empty() ? Never : events.front().cycle;
+	}
+
+	bool Empty() const
+	{
+		return events.empty();
+	}
+
+	// Runs every event due at or before cycle, earliest first, including
+	// those that actions schedule on the way.
+	void RunDue(uint64_t cycle);
+
+private:
+	struct Event {
+		uint64_t cycle;
+		EventId id;
+		Action action;
+	};
+
+	// The heap order, which puts the earliest event at the front.
+	static bool Later(const Event& a, const Event& b)
+	{
+		return a.cycle != b.cycle ? a.cycle > b.cycle : a.id > b.id;
+	}
+
+	std::vector<Event> events;
+	EventId nextId = 1;
+};
@@ -0,0 +1,27 @@
+# Runs the job list JOBS through PROGRAM with --batch and with --lockstep
+# and fails unless both report the same results. Jobs finish in any order,
+# so the lines are compared sorted.
+#
+#   cmake -DPROGRAM=... -DJOBS=... -P compare_batch.cmake
+
+foreach (mode batch lockstep)
+  execute_process (COMMAND ${PROGRAM} --${mode} "${JOBS}" RESULT_VARIABLE result OUTPUT_VARIABLE output)
+  if (NOT result EQUAL 0)
+    message (FATAL_ERROR "${PROGRAM} --${mode} exited with ${result}:\n${output}")
+  endif ()
+  string (REPLACE "\n" ";" lines "${output}")
+  list (SORT lines)
+  set (${mode} "${lines}")
+endforeach ()
+
+if (NOT batch STREQUAL lockstep)
+  foreach (line IN LISTS lockstep)
+    list (FIND batch "${line}" found)
+    if (found LESS 0)
+      message ("Only --lockstep gives: ${line}")
+    endif ()
+  endforeach ()
+  message (FATAL_ERROR "--batch and --lockstep give different results")
+endif ()
+list (LENGTH batch count)
+message ("${count} lines the same")
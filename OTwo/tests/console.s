@@ -0,0 +1,75 @@
+; Writes through the console device (see console.h) at $D000:
+;
+;   OTwo --console 0xd000 --image tests/console.bin@0x400 1000000 0x403
+;
+; It prints "Hi" and flushes it through FlushOut, then "interval", which
+; the flush scheduled for 100000 cycles after the first byte writes out
+; while the program waits, and then "wrapped" through BlockOut from a
+; block that wraps from $FFFF to $0000. That takes three writes, the last
+; again from the interval flush, which the trap at success ($0403) waits
+; for. console.bin is this file assembled.
+
+CONSOLE       = $D000
+CHAR_OUT      = CONSOLE + 0
+FLUSH_OUT     = CONSOLE + 1
+BLOCK_ADDRESS = CONSOLE + 2
+BLOCK_LENGTH  = CONSOLE + 4
+BLOCK_OUT     = CONSOLE + 6
+
+        .org $0400
+        JMP start
+success:
+        JMP success
+
+start:
+        LDX #0
+hi:
+        LDA hiText,X
+        BEQ hiDone
+        STA CHAR_OUT
+        INX
+        BNE hi
+hiDone:
+        STA FLUSH_OUT
+
+        LDX #0
+interval:
+        LDA intervalText,X
+        BEQ intervalDone
+        STA CHAR_OUT
+        INX
+        BNE interval
+intervalDone:
+
+; About 150000 cycles.
+        LDY #120
+        LDX #0
+delay:
+        DEX
+        BNE delay
+        DEY
+        BNE delay
+
+        LDX #7
+copy:
+        LDA wrappedText,X
+        STA $FFFC,X
+        DEX
+        BPL copy
+        LDA #$FC
+        STA BLOCK_ADDRESS
+        LDA #$FF
+        STA BLOCK_ADDRESS + 1
+        LDA #8
+        STA BLOCK_LENGTH
+        LDA #0
+        STA BLOCK_LENGTH + 1
+        STA BLOCK_OUT
+        JMP success
+
+hiText:
+        .byte 'H, 'i, 10, 0
+intervalText:
+        .byte 'i, 'n, 't, 'e, 'r, 'v, 'a, 'l, 10, 0
+wrappedText:
+        .byte 'w, 'r, 'a, 'p, 'p, 'e, 'd, 10
@@ -0,0 +1,43 @@
+; Echoes its input to the console from an IRQ handler, with the input
+; device (see inputqueue.h) at $D100 on IRQ line 0 and the console at
+; $D000:
+;
+;   OTwo --console 0xd000 --input 0xd100 --image tests/echo.bin@0x400 10000000000 0x403 <tests/echo.txt
+;
+; The program idles on a jump to itself at success ($0403). That only
+; traps once no event is pending: while the input is open, the device
+; polls for it every 1000 cycles and raises the IRQ when bytes arrive,
+; and once it is closed and drained the polls stop. echo.bin is this file
+; assembled.
+
+CONSOLE       = $D000
+CHAR_OUT      = CONSOLE + 0
+INPUT         = $D100
+DATA          = INPUT + 0
+CONTROL       = INPUT + 1
+INTERRUPTS_ON = $80
+
+        .org $0400
+        JMP start
+success:
+        JMP success
+
+start:
+        LDX #$FF
+        TXS
+        LDA #<irq
+        STA $FFFE
+        LDA #>irq
+        STA $FFFF
+        LDA #INTERRUPTS_ON
+        STA CONTROL
+        CLI
+        JMP success
+
+; Taken again for as long as bytes are waiting.
+irq:
+        PHA
+        LDA DATA
+        STA CHAR_OUT
+        PLA
+        RTI
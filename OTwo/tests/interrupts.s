@@ -0,0 +1,235 @@
+; Checks how the CPU runs events and takes interrupts, with the timer
+; device (see timer.h) at $D000 driving IRQ line 1:
+;
+;   OTwo --timer 0xd000 --image tests/interrupts.bin@0x400 1000000 0x403
+;
+; A check that fails traps on a branch to itself. The checks run 40 times,
+; so that their blocks get hot and translated, and then the program traps
+; at success ($0403). interrupts.bin is this file assembled.
+
+TIMER       = $D000
+DELAY       = TIMER + 0
+SCHEDULE    = TIMER + 2
+LOG         = TIMER + 3
+ACKNOWLEDGE = TIMER + 4
+PENDING     = TIMER + 5
+RAISE_IRQ   = $80
+RAISE_NMI   = $40
+
+iterations  = $10
+irqCount    = $11
+irqSeenX    = $12       ; X when the IRQ was last taken
+irqHold     = $13       ; IRQs to take before acknowledging one
+nmiCount    = $14
+nmiEscape   = $15       ; where the NMI returns to, when the high byte is set
+
+        .org $0400
+        JMP start
+success:
+        JMP success
+
+start:
+        LDX #$FF
+        TXS
+        LDA #<irq
+        STA $FFFE
+        LDA #>irq
+        STA $FFFF
+        LDA #<nmi
+        STA $FFFA
+        LDA #>nmi
+        STA $FFFB
+        LDA #40
+        STA iterations
+        LDA #0
+        STA DELAY + 1
+        STA nmiEscape + 1
+
+loop:
+        LDA #0
+        STA irqCount
+        STA nmiCount
+        STA irqHold
+
+; A level IRQ raised while I is set waits, and CLI lets it in before the
+; next instruction. Holding the line up twice more makes the handler run
+; three times in a row.
+        SEI
+        LDA #20
+        LDY #RAISE_IRQ + 1
+        JSR fire
+        LDA LOG
+        CMP #RAISE_IRQ + 1
+        BNE *
+        LDA irqCount
+        BNE *
+        LDA #2
+        STA irqHold
+        LDX #0
+        CLI
+        INX
+        LDA irqCount
+        CMP #3
+        BNE *
+        LDA irqSeenX
+        BNE *
+
+; The same after PLP.
+        SEI
+        LDA #20
+        LDY #RAISE_IRQ + 2
+        JSR fire
+        LDA LOG
+        CMP #RAISE_IRQ + 2
+        BNE *
+        LDA irqCount
+        CMP #3
+        BNE *
+        LDA #0
+        PHA
+        LDX #0
+        PLP
+        INX
+        LDA irqCount
+        CMP #4
+        BNE *
+        LDA irqSeenX
+        BNE *
+
+; The same after RTI.
+        SEI
+        LDA #20
+        LDY #RAISE_IRQ + 3
+        JSR fire
+        LDA LOG
+        CMP #RAISE_IRQ + 3
+        BNE *
+        LDA irqCount
+        CMP #4
+        BNE *
+        LDA #>returned
+        PHA
+        LDA #<returned
+        PHA
+        LDA #0
+        PHA
+        LDX #0
+        RTI
+returned:
+        INX
+        LDA irqCount
+        CMP #5
+        BNE *
+        LDA irqSeenX
+        BNE *
+
+; An NMI is taken whatever I is, and once per trigger.
+        SEI
+        LDA #20
+        LDY #RAISE_NMI + 4
+        JSR fire
+        LDA LOG
+        CMP #RAISE_NMI + 4
+        BNE *
+        LDA nmiCount
+        CMP #1
+        BNE *
+
+; Events due on the same cycle fire in the order they were scheduled,
+; after those due earlier. The writes to SCHEDULE are 12 cycles apart, so
+; the first two events fall due on the same cycle and the third 11 cycles
+; before them.
+        LDA #40
+        STA DELAY
+        LDA #5
+        STA SCHEDULE
+        LDA #28
+        STA DELAY
+        LDA #6
+        STA SCHEDULE
+        LDA #5
+        STA DELAY
+        LDA #7
+        STA SCHEDULE
+drain:
+        LDA PENDING
+        BNE drain
+        LDA LOG
+        CMP #7
+        BNE *
+        LDA LOG
+        CMP #5
+        BNE *
+        LDA LOG
+        CMP #6
+        BNE *
+        LDA LOG
+        BNE *
+
+; A jump to itself does not stop the program while an event is pending;
+; the NMI it raises leaves the loop for escaped.
+        LDA #<escaped
+        STA nmiEscape
+        LDA #>escaped
+        STA nmiEscape + 1
+        LDA #100
+        STA DELAY
+        LDA #RAISE_NMI + 8
+        STA SCHEDULE
+trapped:
+        JMP trapped
+escaped:
+        LDA nmiCount
+        CMP #2
+        BNE *
+        LDA LOG
+        CMP #RAISE_NMI + 8
+        BNE *
+
+        DEC iterations
+        BEQ done
+        JMP loop
+done:
+        JMP success
+
+; Schedules an event tagged Y for A cycles later and waits for it.
+fire:
+        STA DELAY
+        STY SCHEDULE
+wait:
+        LDA PENDING
+        BNE wait
+        RTS
+
+irq:
+        STX irqSeenX
+        INC irqCount
+        PHA
+        LDA irqHold
+        BEQ acknowledge
+        DEC irqHold
+        PLA
+        RTI
+acknowledge:
+        STA ACKNOWLEDGE
+        PLA
+        RTI
+
+nmi:
+        INC nmiCount
+        PHA
+        TXA
+        PHA
+        LDA nmiEscape + 1
+        BEQ resume
+        TSX                     ; X, A, P, PCL, PCH from $0101,X up
+        STA $0105,X
+        LDA nmiEscape
+        STA $0104,X
+        LDA #0
+        STA nmiEscape + 1
+resume:
+        PLA
+        TAX
+        PLA
+        RTI
@@ -0,0 +1,17 @@
+# Runs PROGRAM with ARGS and the file INPUT, if any, on stdin, and fails
+# when it exits with an error or when its output does not match the
+# regular expression EXPECT.
+#
+#   cmake -DPROGRAM=... -DARGS=a;b [-DINPUT=...] [-DEXPECT=...] -P run_with_input.cmake
+
+if (INPUT)
+  set (input INPUT_FILE "${INPUT}")
+endif ()
+execute_process (COMMAND ${PROGRAM} ${ARGS} ${input} RESULT_VARIABLE result OUTPUT_VARIABLE output)
+message ("${output}")
+if (NOT result EQUAL 0)
+  message (FATAL_ERROR "${PROGRAM} exited with ${result}")
+endif ()
+if (EXPECT AND NOT output MATCHES "${EXPECT}")
+  message (FATAL_ERROR "The output does not match ${EXPECT}")
+endif ()
@@ -0,0 +1,112 @@
+#include "threadpool.h"
+#include <algorithm>
+
+namespace {
+// The pool and queue of the worker running on this thread, if any.
+thread_local const ThreadPool* currentPool = nullptr;
+thread_local size_t currentQueue = 0;
+}
+
+ThreadPool::ThreadPool(unsigned threadCount)
+{
+    if (threadCount == 0) {
+        threadCount = std::max(1u, std::thread::hardware_concurrency());
+    }
+    for (unsigned i = 0; i < threadCount; i++) {
+        queues.push_back(std::make_unique<Queue>());
+    }
+    for (unsigned i = 0; i < threadCount; i++) {
+        threads.emplace_back(&ThreadPool::Work, this, i);
+    }
+}
+
+ThreadPool::~ThreadPool()
+{
+    Wait();
+    {
+        std::lock_guard<std::mutex> lock(stateMutex);
+        stopping = true;
+    }
+    taskQueued.notify_all();
+    for (std::thread& thread : threads) {
+        thread.join();
+    }
+}
+
+void ThreadPool::Submit(std::function<void()> task)
+{
+    size_t target;
+    {
+        std::lock_guard<std::mutex> lock(stateMutex);
+        target = currentPool == this ? currentQueue : nextQueue++ % queues.size();
+        unfinished++;
+    }
+    {
+        std::lock_guard<std::mutex> lock(queues[target]->mutex);
+        queues[target]->tasks.push_back(std::move(task));
+    }
+    {
+        // Counted only once it can be taken, so a woken worker finds it.
+        std::lock_guard<std::mutex> lock(stateMutex);
+        queued++;
+    }
+    taskQueued.notify_one();
+}
+
+void ThreadPool::Wait()
+{
+    std::unique_lock<std::mutex> lock(stateMutex);
+    allDone.wait(lock, [this] { return unfinished == 0; });
+}
+
+bool ThreadPool::Take(size_t self, std::function<void()>& task)
+{
+    {
+        Queue& own = *queues[self];
+        std::lock_guard<std::mutex> lock(own.mutex);
+        if (!own.tasks.empty()) {
+            task = std::move(own.tasks.back());
+            own.tasks.pop_back();
+            return true;
+        }
+    }
+    for (size_t i = 1; i < queues.size(); i++) {
+        Queue& victim = *queues[(self + i) % queues.size()];
+        std::lock_guard<std::mutex> lock(victim.mutex);
+        if (!victim.tasks.empty()) {
+            task = std::move(victim.tasks.front());
+            victim.tasks.pop_front();
+            return true;
+        }
+    }
+    return false;
+}
+
+void ThreadPool::Work(size_t self)
+{
+    currentPool = this;
+    currentQueue = self;
+    for (;;) {
+        {
+            std::unique_lock<std::mutex> lock(stateMutex);
+            taskQueued.wait(lock, [this] { return stopping || queued > 0; });
+            if (queued == 0) {
+                return;
+            }
+            // Claimed here so that no other worker waits for it; the task
+            // itself may still be in any queue.
+            queued--;
+        }
+
+        std::function<void()> task;
+        while (!Take(self, task)) {
+            std::this_thread::yield();
+        }
+        task();
+
+        std::lock_guard<std::mutex> lock(stateMutex);
+        if (--unfinished == 0) {
+            allDone.notify_all();
+        }
+    }
+}
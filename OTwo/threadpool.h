@@ -0,0 +1,56 @@
+#pragma once
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// A fixed set of worker threads with a task queue each. A worker runs the
+// newest task of its own queue and, once that is empty, steals the oldest
+// task of another, so workers that drew short tasks take over the rest
+// instead of idling.
+class ThreadPool {
+
+public:
+	// Zero means one thread per hardware thread.
+	explicit ThreadPool(unsigned threadCount = 0);
+	// Finishes every submitted task first.
+	~ThreadPool();
+
+	ThreadPool(const ThreadPool&) = delete;
+	ThreadPool& operator=(const ThreadPool&) = delete;
+
+	// Tasks submitted from a worker go to its own queue, others are
+	// spread across the workers in turn.
+	void Submit(std::function<void()> task);
+	// Blocks until every task submitted so far has finished.
+	void Wait();
+
+	size_t ThreadCount() const
+	{
+		return threads.size();
+	}
+
+private:
+	struct Queue {
+		std::mutex mutex;
+		std::deque<std::function<void()>> tasks;
+	};
+
+	bool Take(size_t self, std::function<void()>& task);
+	void Work(size_t self);
+
+	std::vector<std::unique_ptr<Queue>> queues;
+	std::vector<std::thread> threads;
+
+	std::mutex stateMutex;
+	std::condition_variable taskQueued;
+	std::condition_variable allDone;
+	size_t queued = 0;     // in a queue, not yet taken
+	size_t unfinished = 0; // submitted, not yet finished
+	size_t nextQueue = 0;
+	bool stopping = false;
+};
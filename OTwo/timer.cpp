@@ -0,0 +1,54 @@
+#include "timer.h"
+#include <algorithm>
+
+uint8_t Timer::Read(uint8_t offset)
+{
+    switch (offset) {
+    case Delay:
+        return delay & 0xFF;
+    case Delay + 1:
+        return delay >> 8;
+    case Log: {
+        if (log.empty()) {
+            return 0;
+        }
+        uint8_t tag = log.front();
+        log.pop_front();
+        return tag;
+    }
+    case Pending:
+        return uint8_t(std::min<size_t>(pending, 0xFF));
+    }
+    return 0;
+}
+
+void Timer::Write(uint8_t offset, uint8_t value)
+{
+    switch (offset) {
+    case Delay:
+        delay = (delay & 0xFF00) | value;
+        break;
+    case Delay + 1:
+        delay = (delay & 0x00FF) | (value << 8);
+        break;
+    case Schedule:
+        pending++;
+        scheduleEvent(value);
+        break;
+    case Acknowledge:
+        setIRQ(false);
+        break;
+    }
+}
+
+void Timer::Fire(uint8_t tag)
+{
+    pending--;
+    log.push_back(tag);
+    if (tag & RaiseIRQ) {
+        setIRQ(true);
+    }
+    if (tag & RaiseNMI) {
+        triggerNMI();
+    }
+}
@@ -0,0 +1,71 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+
+#include "machine.h"
+
+// A memory-mapped device that lets guest programs schedule events, so
+// test images can check how the CPU runs them and takes interrupts. An
+// event fires Delay cycles after the write to Schedule that set it up and
+// appends its tag to a log the program reads back. A tag with RaiseIRQ set
+// also asserts the device's IRQ line, which stays asserted until the
+// program writes to Acknowledge; one with RaiseNMI set triggers an NMI.
+//
+// Registers, from the page-aligned address the device is attached at:
+//
+//   +0,1  Delay           read/write, little-endian
+//   +2    Schedule        write: schedules an event with the byte as tag
+//   +3    Log             read: the oldest tag not read yet, or zero
+//   +4    Acknowledge     write: releases the IRQ line
+//   +5    Pending         read: events scheduled that have not fired
+//
+// The rest of the page reads as zero and ignores writes.
+class Timer {
+
+public:
+	static constexpr uint8_t Delay = 0;
+	static constexpr uint8_t Schedule = 2;
+	static constexpr uint8_t Log = 3;
+	static constexpr uint8_t Acknowledge = 4;
+	static constexpr uint8_t Pending = 5;
+
+	static constexpr uint8_t RaiseIRQ = 0b10000000;
+	static constexpr uint8_t RaiseNMI = 0b01000000;
+
+	Timer() = default;
+
+	Timer(const Timer&) = delete;
+	Timer& operator=(const Timer&) = delete;
+
+	// Maps the device over the page at address, which must be page-aligned,
+	// and drives irqLine of the machine's CPU. The timer has to outlive
+	// every run of the machine, since its memory and scheduler call back
+	// into it.
+	template <typename Policy>
+	bool Attach(BasicMachine<Policy>& machine, uint16_t address, unsigned irqLine = 1)
+	{
+		BasicCPU<Policy>& cpu = machine.cpu;
+		setIRQ = [&cpu, irqLine](bool asserted) { cpu.SetIRQ(irqLine, asserted); };
+		triggerNMI = [&cpu] { cpu.TriggerNMI(); };
+		scheduleEvent = [this, &cpu](uint8_t tag) {
+			cpu.ScheduleEvent(cpu.Cycles() + delay, [this, tag](uint64_t) { Fire(tag); });
+		};
+		return machine.memory.MapIO(address, Memory::PageSize, [this](uint16_t port) { return Read(port & 0xFF); },
+									[this](uint16_t port, uint8_t value) { Write(port & 0xFF, value); });
+	}
+
+private:
+	uint8_t Read(uint8_t offset);
+	void Write(uint8_t offset, uint8_t value);
+	void Fire(uint8_t tag);
+
+	uint16_t delay = 0;
+	size_t pending = 0;
+	std::deque<uint8_t> log;
+
+	std::function<void(bool asserted)> setIRQ;
+	std::function<void()> triggerNMI;
+	std::function<void(uint8_t tag)> scheduleEvent;
+};
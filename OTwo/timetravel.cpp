@@ -0,0 +1,135 @@
+#include "timetravel.h"
+#include <algorithm>
+
+namespace {
+
+// What a snapshot adds to the ones it shares pages with.
+size_t StoredBytes(const Memory::Snapshot& snapshot)
+{
+    if (snapshot.parent) {
+        return snapshot.deltaBytes - snapshot.parent->deltaBytes;
+    }
+    size_t pages = std::count_if(snapshot.pages.begin(), snapshot.pages.end(), [](const uint8_t* page) { return page != nullptr; });
+    return pages * Memory::PageSize + sizeof(Memory::Snapshot);
+}
+
+}
+
+TimeTravel::TimeTravel(DebugMachine& machine, size_t memoryCap, uint64_t interval)
+    : machine(machine), memoryCap(memoryCap), interval(std::max<uint64_t>(interval, 1)), latest(machine.cpu.Instructions())
+{
+    TakeCheckpoint();
+}
+
+void TimeTravel::TakeCheckpoint()
+{
+    MachineState state = machine.SaveState();
+    // Nothing written since the last checkpoint gives back its snapshot.
+    bool shared = !checkpoints.empty() && checkpoints.back().state.memory == state.memory;
+    size_t bytes = (shared ? 0 : StoredBytes(*state.memory)) + sizeof(Checkpoint);
+    checkpoints.push_back({ std::move(state), bytes });
+    memoryUsed += bytes;
+    while (memoryUsed > memoryCap && checkpoints.size() > 1) {
+        memoryUsed -= checkpoints.front().bytes;
+        checkpoints.pop_front();
+    }
+}
+
+RunResult TimeTravel::RunFor(uint64_t maxCycles, uint64_t maxInstructions)
+{
+    DebugCPU& cpu = machine.cpu;
+    while (checkpoints.size() > 1 && checkpoints.back().state.cpu.instructions > cpu.Instructions()) {
+        memoryUsed -= checkpoints.back().bytes;
+        checkpoints.pop_back();
+    }
+
+    RunResult result{};
+    while (true) {
+        uint64_t next = checkpoints.back().state.cpu.instructions + interval;
+        uint64_t instructions = next > cpu.Instructions() ? next - cpu.Instructions() : 1;
+        instructions = std::min(instructions, maxInstructions - result.instructions);
+        RunResult run = cpu.RunFor(maxCycles - result.cycles, instructions);
+        result.reason = run.reason;
+        result.address = run.address;
+        result.cycles += run.cycles;
+        result.instructions += run.instructions;
+        latest = cpu.Instructions();
+        if (cpu.Instructions() >= next) {
+            TakeCheckpoint();
+        }
+        // Stopped by the instruction count alone when the budgets are left.
+        bool checkpointOnly = run.reason == StopReason::BudgetExhausted && result.cycles < maxCycles && result.instructions < maxInstructions;
+        if (!checkpointOnly) {
+            return result;
+        }
+    }
+}
+
+void TimeTravel::Replay(uint64_t instruction)
+{
+    DebugCPU& cpu = machine.cpu;
+    // Traps, unknown opcodes and breakpoints stop RunFor on the way.
+    while (cpu.Instructions() < instruction) {
+        cpu.RunFor(UINT64_MAX, instruction - cpu.Instructions());
+    }
+}
+
+bool TimeTravel::Seek(uint64_t instruction)
+{
+    if (instruction < OldestInstruction() || instruction > latest) {
+        return false;
+    }
+
+    // Runs forward from here when the target is ahead and no checkpoint
+    // lies in between.
+    auto after = std::upper_bound(checkpoints.begin(), checkpoints.end(), instruction,
+        [](uint64_t value, const Checkpoint& checkpoint) { return value < checkpoint.state.cpu.instructions; });
+    const Checkpoint& checkpoint = *(after - 1);
+    uint64_t now = machine.cpu.Instructions();
+    if (now > instruction || now < checkpoint.state.cpu.instructions) {
+        machine.LoadState(checkpoint.state);
+    }
+    Replay(instruction);
+    return true;
+}
+
+bool TimeTravel::ReverseStep(uint64_t count)
+{
+    uint64_t now = machine.cpu.Instructions();
+    return count <= now && Seek(now - count);
+}
+
+bool TimeTravel::ReverseContinue()
+{
+    DebugCPU& cpu = machine.cpu;
+    uint64_t end = cpu.Instructions();
+    for (size_t i = checkpoints.size(); i-- > 0;) {
+        const Checkpoint& checkpoint = checkpoints[i];
+        if (checkpoint.state.cpu.instructions >= end) {
+            continue;
+        }
+
+        // Runs through the interval and keeps the last breakpoint hit. RunFor
+        // does not check one before its first instruction, so the
+        // checkpoint itself is checked here.
+        machine.LoadState(checkpoint.state);
+        uint64_t hit = UINT64_MAX;
+        if (cpu.IsBreakpoint(cpu.ProgramCounter())) {
+            hit = cpu.Instructions();
+        }
+        while (cpu.Instructions() < end) {
+            RunResult run = cpu.RunFor(UINT64_MAX, end - cpu.Instructions());
+            if (run.reason == StopReason::Breakpoint) {
+                hit = cpu.Instructions();
+            }
+        }
+        if (hit != UINT64_MAX) {
+            Seek(hit);
+            return true;
+        }
+        end = checkpoint.state.cpu.instructions;
+    }
+
+    machine.LoadState(checkpoints.front().state);
+    return false;
+}
@@ -0,0 +1,85 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+
+#include "machine.h"
+
+// Lets a debugger step a machine backwards. Running forward through this
+// class takes a checkpoint every interval instructions; each is a machine
+// state whose memory snapshot only holds the pages written since the one
+// before (see Memory::SaveState), so that is the undo log for memory.
+// Going back restores the last checkpoint before the target and runs
+// forward again to it, counting instructions.
+//
+// Checkpoints are kept in a ring: the oldest are dropped once they hold
+// more than memoryCap bytes. Snapshots they share with newer ones stay,
+// which adds at most two full address spaces.
+//
+// Replaying assumes the machine is deterministic, so devices must return
+// the same values when read again. Going back to breakpoints needs them
+// compiled in, so this takes a DebugMachine.
+class TimeTravel {
+
+public:
+	static constexpr size_t DefaultMemoryCap = 64 << 20;
+	static constexpr uint64_t DefaultInterval = 100000;
+
+	explicit TimeTravel(DebugMachine& machine, size_t memoryCap = DefaultMemoryCap, uint64_t interval = DefaultInterval);
+
+	TimeTravel(const TimeTravel&) = delete;
+	TimeTravel& operator=(const TimeTravel&) = delete;
+
+	// Runs like CPU::RunFor, taking checkpoints on the way. After going
+	// back, the checkpoints past the current instruction are dropped
+	// first, since the run from here may differ.
+	RunResult RunFor(uint64_t maxCycles, uint64_t maxInstructions = UINT64_MAX);
+
+	// Goes back count instructions. Returns false and stays put when that
+	// is further back than the oldest checkpoint.
+	bool ReverseStep(uint64_t count = 1);
+
+	// Goes back to the last point before the current one where the PC is
+	// at one of the CPU's breakpoints. Returns false when there is none as
+	// far back as the oldest checkpoint, and goes back to that instead.
+	bool ReverseContinue();
+
+	// Moves to the point after the given number of instructions since
+	// power-on, which may be anywhere from the oldest checkpoint to the
+	// latest instruction run. Returns false and stays put otherwise.
+	bool Seek(uint64_t instruction);
+
+	uint64_t OldestInstruction() const
+	{
+		return checkpoints.front().state.cpu.instructions;
+	}
+
+	size_t CheckpointCount() const
+	{
+		return checkpoints.size();
+	}
+
+	// Bytes held by the checkpoints in the ring.
+	size_t MemoryUsed() const
+	{
+		return memoryUsed;
+	}
+
+private:
+	struct Checkpoint {
+		MachineState state;
+		size_t bytes;
+	};
+
+	void TakeCheckpoint();
+	// Runs forward from the current state to the given instruction.
+	void Replay(uint64_t instruction);
+
+	DebugMachine& machine;
+	size_t memoryCap;
+	uint64_t interval;
+	std::deque<Checkpoint> checkpoints;
+	size_t memoryUsed = 0;
+	// The furthest the machine has run; Seek can go anywhere up to it.
+	uint64_t latest;
+};
@@ -0,0 +1,352 @@
+#include "trace.h"
+#include <algorithm>
+#include <bit>
+#include <chrono>
+#include <cstring>
+#include <vector>
+
+#ifdef OTWO_ZLIB
+#include <deque>
+#include <future>
+#include <zlib.h>
+
+#include "threadpool.h"
+#endif
+
+namespace {
+
+constexpr char Magic[8] = { 'O', 'T', 'W', 'O', 'T', 'R', 'C', '1' };
+constexpr char CompressedMagic[8] = { 'O', 'T', 'W', 'O', 'T', 'R', 'Z', '1' };
+
+// Flags: one bit per register stored, in this order, and one for a record
+// after a gap.
+constexpr uint8_t RegisterA = 1 << 0;
+constexpr uint8_t RegisterX = 1 << 1;
+constexpr uint8_t RegisterY = 1 << 2;
+constexpr uint8_t RegisterS = 1 << 3;
+constexpr uint8_t RegisterP = 1 << 4;
+constexpr uint8_t Gap = 1 << 5;
+
+// The writer gives slots back to the CPU thread this often, and writes to
+// the file once this much is encoded.
+constexpr size_t ChunkRecords = 4096;
+constexpr size_t FlushBytes = 64 * 1024;
+
+// A compressed trace is deflated this much at a time, in frames that each
+// start with a header.
+constexpr size_t FrameBytes = 256 * 1024;
+constexpr size_t FrameHeaderBytes = 8;
+
+// The reader takes this much from the file at a time.
+constexpr size_t ReadBytes = 64 * 1024;
+
+uint64_t Zigzag(int64_t value)
+{
+    return (static_cast<uint64_t>(value) << 1) ^ static_cast<uint64_t>(value >> 63);
+}
+
+int64_t Unzigzag(uint64_t value)
+{
+    return static_cast<int64_t>(value >> 1) ^ -static_cast<int64_t>(value & 1);
+}
+
+// A flags byte, a 16-bit and a 64-bit varint, the opcode and five registers.
+constexpr size_t MaxRecordBytes = 1 + 3 + 10 + 1 + 5;
+
+uint8_t* PutVarint(uint8_t* out, uint64_t value)
+{
+    while (value >= 0x80) {
+        *out++ = static_cast<uint8_t>(value) | 0x80;
+        value >>= 7;
+    }
+    *out++ = static_cast<uint8_t>(value);
+    return out;
+}
+
+// Writes at most MaxRecordBytes and returns the end.
+uint8_t* Encode(uint8_t* out, TraceRecord& last, const TraceRecord& record)
+{
+    if (record.gap) {
+        last = TraceRecord{};
+    }
+    uint8_t* flags = out++;
+    *flags = record.gap ? Gap : 0;
+    out = PutVarint(out, Zigzag(static_cast<int16_t>(record.pc - last.pc)));
+    *out++ = record.opcode;
+    const uint8_t registers[] = { record.a, record.x, record.y, record.s, record.p };
+    const uint8_t lastRegisters[] = { last.a, last.x, last.y, last.s, last.p };
+    for (int i = 0; i < 5; i++) {
+        if (registers[i] != lastRegisters[i]) {
+            *flags |= RegisterA << i;
+            *out++ = registers[i];
+        }
+    }
+    // Cycles can go back when a state is loaded.
+    out = PutVarint(out, Zigzag(static_cast<int64_t>(record.cycles - last.cycles)));
+    last = record;
+    return out;
+}
+
+#ifdef OTWO_ZLIB
+// Deflates a frame of encoded records on its own and puts the frame header
+// in front: the deflated and the encoded size, 32-bit little-endian.
+std::vector<uint8_t> DeflateFrame(const std::vector<uint8_t>& encoded)
+{
+    uLongf size = compressBound(static_cast<uLong>(encoded.size()));
+    std::vector<uint8_t> frame(FrameHeaderBytes + size);
+    // The fastest level, so that few workers keep up with the CPU.
+    if (compress2(frame.data() + FrameHeaderBytes, &size, encoded.data(), static_cast<uLong>(encoded.size()),
+                  Z_BEST_SPEED) != Z_OK) {
+        return {};
+    }
+    const uint32_t sizes[] = { static_cast<uint32_t>(size), static_cast<uint32_t>(encoded.size()) };
+    for (size_t i = 0; i < FrameHeaderBytes; i++) {
+        frame[i] = static_cast<uint8_t>(sizes[i / 4] >> (i % 4 * 8));
+    }
+    frame.resize(FrameHeaderBytes + size);
+    return frame;
+}
+#endif
+
+// Writes the encoded records to the file. For a compressed trace, frames
+// are deflated on a pool of threads and written in order. When the pool
+// falls behind, Write waits for the oldest frame, so the ring fills up and
+// the CPU thread drops records, as it does whenever the writer is slow.
+class Output {
+public:
+    Output(std::ofstream& file, bool compress)
+        : file(file)
+    {
+#ifdef OTWO_ZLIB
+        if (compress) {
+            // The CPU thread and the encoding thread are busy already.
+            unsigned threads = std::max(std::thread::hardware_concurrency(), 3u) - 2;
+            pool = std::make_unique<ThreadPool>(threads);
+            maxFrames = 2 * threads;
+        }
+#else
+        (void)compress;
+#endif
+    }
+
+    ~Output()
+    {
+#ifdef OTWO_ZLIB
+        while (!frames.empty()) {
+            WriteFrame();
+        }
+#endif
+    }
+
+    Output(const Output&) = delete;
+    Output& operator=(const Output&) = delete;
+
+    void Write(const uint8_t* bytes, size_t size)
+    {
+        if (size == 0) {
+            return;
+        }
+#ifdef OTWO_ZLIB
+        if (pool) {
+            auto task = std::make_shared<std::packaged_task<std::vector<uint8_t>()>>(
+                [encoded = std::vector<uint8_t>(bytes, bytes + size)] { return DeflateFrame(encoded); });
+            frames.push_back(task->get_future());
+            pool->Submit([task] { (*task)(); });
+            while (!frames.empty() && (frames.size() > maxFrames ||
+                                       frames.front().wait_for(std::chrono::seconds(0)) == std::future_status::ready)) {
+                WriteFrame();
+            }
+            return;
+        }
+#endif
+        file.write(reinterpret_cast<const char*>(bytes), size);
+    }
+
+private:
+#ifdef OTWO_ZLIB
+    void WriteFrame()
+    {
+        std::vector<uint8_t> frame = frames.front().get();
+        frames.pop_front();
+        file.write(reinterpret_cast<const char*>(frame.data()), frame.size());
+    }
+#endif
+
+    std::ofstream& file;
+#ifdef OTWO_ZLIB
+    std::unique_ptr<ThreadPool> pool;
+    std::deque<std::future<std::vector<uint8_t>>> frames;
+    size_t maxFrames = 0;
+#endif
+};
+
+}
+
+Tracer::Tracer(const std::string& path, size_t capacity, bool compress)
+    : capacity(std::bit_ceil(std::max<size_t>(capacity, 2))), ring(std::make_unique<TraceRecord[]>(this->capacity)),
+      compress(compress && CanCompress), file(path, std::ios::binary)
+{
+    if (!file.is_open() || !file.write(this->compress ? CompressedMagic : Magic, sizeof(Magic))) {
+        return;
+    }
+    writer = std::thread([this] { Write(); });
+}
+
+Tracer::~Tracer()
+{
+    if (writer.joinable()) {
+        stopping.store(true, std::memory_order_release);
+        writer.join();
+    }
+}
+
+void Tracer::Write()
+{
+    size_t flushBytes = compress ? FrameBytes : FlushBytes;
+    std::vector<uint8_t> buffer(flushBytes + ChunkRecords * MaxRecordBytes);
+    uint8_t* out = buffer.data();
+    TraceRecord last{};
+    {
+        Output output(file, compress);
+        while (true) {
+            // Read before head, so that the last pass sees every record.
+            bool stop = stopping.load(std::memory_order_acquire);
+            size_t end = head.load(std::memory_order_acquire);
+            size_t position = tail.load(std::memory_order_relaxed);
+            if (position == end) {
+                if (stop) {
+                    break;
+                }
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+                continue;
+            }
+
+            while (position != end) {
+                size_t chunkEnd = std::min(end, position + ChunkRecords);
+                for (; position != chunkEnd; position++) {
+                    out = Encode(out, last, ring[position & (capacity - 1)]);
+                }
+                tail.store(position, std::memory_order_release);
+                if (out - buffer.data() >= static_cast<ptrdiff_t>(flushBytes)) {
+                    output.Write(buffer.data(), out - buffer.data());
+                    out = buffer.data();
+                }
+            }
+        }
+        output.Write(buffer.data(), out - buffer.data());
+    }
+    file.flush();
+}
+
+TraceReader::TraceReader(const std::string& path)
+    : file(path, std::ios::binary), buffer(ReadBytes)
+{
+    char magic[sizeof(Magic)];
+    if (!file.read(magic, sizeof(magic))) {
+        return;
+    }
+    open = std::memcmp(magic, Magic, sizeof(Magic)) == 0;
+#ifdef OTWO_ZLIB
+    compressed = std::memcmp(magic, CompressedMagic, sizeof(CompressedMagic)) == 0;
+    open = open || compressed;
+#endif
+}
+
+bool TraceReader::Refill()
+{
+    position = 0;
+    size = 0;
+#ifdef OTWO_ZLIB
+    if (compressed) {
+        uint8_t header[FrameHeaderBytes];
+        if (!file.read(reinterpret_cast<char*>(header), sizeof(header))) {
+            return false;
+        }
+        uint32_t sizes[2] = {};
+        for (size_t i = 0; i < FrameHeaderBytes; i++) {
+            sizes[i / 4] |= static_cast<uint32_t>(header[i]) << (i % 4 * 8);
+        }
+        // No writer makes frames this big, so the file is damaged.
+        if (sizes[1] > 2 * FrameBytes || sizes[0] > compressBound(sizes[1])) {
+            return false;
+        }
+        packed.resize(sizes[0]);
+        buffer.resize(sizes[1]);
+        uLongf length = sizes[1];
+        if (!file.read(reinterpret_cast<char*>(packed.data()), sizes[0]) ||
+            uncompress(buffer.data(), &length, packed.data(), sizes[0]) != Z_OK || length != sizes[1]) {
+            return false;
+        }
+        size = length;
+        return size > 0;
+    }
+#endif
+    file.read(reinterpret_cast<char*>(buffer.data()), buffer.size());
+    size = file.gcount();
+    return size > 0;
+}
+
+bool TraceReader::ReadByte(uint8_t& value)
+{
+    if (position == size && !Refill()) {
+        return false;
+    }
+    value = buffer[position++];
+    return true;
+}
+
+bool TraceReader::ReadVarint(uint64_t& value)
+{
+    value = 0;
+    uint8_t byte = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+        if (!ReadByte(byte)) {
+            return false;
+        }
+        value |= static_cast<uint64_t>(byte & 0x7F) << shift;
+        if (!(byte & 0x80)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool TraceReader::Next(TraceRecord& record)
+{
+    uint8_t flags = 0;
+    uint64_t pcDelta = 0;
+    uint64_t cyclesDelta = 0;
+    if (!open || !ReadByte(flags)) {
+        return false;
+    }
+    if (flags & Gap) {
+        last = TraceRecord{};
+    }
+
+    record = last;
+    record.gap = (flags & Gap) != 0;
+    bool complete = ReadVarint(pcDelta) && ReadByte(record.opcode);
+    record.pc = static_cast<uint16_t>(last.pc + Unzigzag(pcDelta));
+    if (complete && (flags & RegisterA)) {
+        complete = ReadByte(record.a);
+    }
+    if (complete && (flags & RegisterX)) {
+        complete = ReadByte(record.x);
+    }
+    if (complete && (flags & RegisterY)) {
+        complete = ReadByte(record.y);
+    }
+    if (complete && (flags & RegisterS)) {
+        complete = ReadByte(record.s);
+    }
+    if (complete && (flags & RegisterP)) {
+        complete = ReadByte(record.p);
+    }
+    if (!complete || !ReadVarint(cyclesDelta)) {
+        open = false;
+        return false;
+    }
+    record.cycles = last.cycles + Unzigzag(cyclesDelta);
+    last = record;
+    return true;
+}
@@ -0,0 +1,138 @@
+#pragma once
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <fstream>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+// The CPU as an instruction was about to execute.
+struct TraceRecord {
+	uint64_t cycles : 63;
+	uint64_t gap : 1; // records were dropped just before this one
+	uint16_t pc;
+	uint8_t opcode;
+	uint8_t a;
+	uint8_t x;
+	uint8_t y;
+	uint8_t s;
+	uint8_t p; // as CPU::Status() returns it
+};
+
+// Writes an instruction trace to a file. The CPU thread puts records into
+// a single-producer, single-consumer ring and never waits: when the ring
+// is full the record is dropped, and the next one is marked as following a
+// gap. A thread of its own drains the ring, delta-encodes the records and
+// writes them out.
+//
+// Each record is stored as a byte of flags, the PC as a zigzag varint
+// difference from the last one, the opcode, the registers that changed and
+// the cycles as a varint difference. The record after a gap is stored as a
+// difference from zero, so a reader can pick up again there.
+//
+// Built with OTWO_ZLIB, the stream is also cut into frames that a pool of
+// threads deflates, which makes a trace of the functional test about
+// twelve times smaller. The CPU thread still never waits: while the pool
+// is behind, the ring fills and records are dropped. The file's magic says
+// whether it is compressed.
+class Tracer {
+
+public:
+	static constexpr size_t DefaultCapacity = 1 << 20;
+#ifdef OTWO_ZLIB
+	static constexpr bool CanCompress = true;
+#else
+	static constexpr bool CanCompress = false;
+#endif
+
+	// The capacity is rounded up to a power of two. Compression is ignored
+	// without OTWO_ZLIB.
+	explicit Tracer(const std::string& path, size_t capacity = DefaultCapacity, bool compress = CanCompress);
+	// Writes out whatever is left in the ring.
+	~Tracer();
+
+	Tracer(const Tracer&) = delete;
+	Tracer& operator=(const Tracer&) = delete;
+
+	bool IsOpen() const
+	{
+		return writer.joinable();
+	}
+
+	inline void Record(TraceRecord record)
+	{
+		size_t position = head.load(std::memory_order_relaxed);
+		if (position - cachedTail == capacity) {
+			cachedTail = tail.load(std::memory_order_acquire);
+			if (position - cachedTail == capacity) {
+				dropped.store(dropped.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+				gap = true;
+				return;
+			}
+		}
+		record.gap = gap;
+		gap = false;
+		ring[position & (capacity - 1)] = record;
+		head.store(position + 1, std::memory_order_release);
+	}
+
+	// Records lost to a full ring so far.
+	uint64_t Dropped() const
+	{
+		return dropped.load(std::memory_order_relaxed);
+	}
+
+private:
+	void Write();
+
+	size_t capacity;
+	std::unique_ptr<TraceRecord[]> ring;
+	// Written by the CPU thread only.
+	alignas(64) std::atomic<size_t> head{ 0 };
+	size_t cachedTail = 0;
+	bool gap = false;
+	std::atomic<uint64_t> dropped{ 0 };
+	// Written by the writer thread only.
+	alignas(64) std::atomic<size_t> tail{ 0 };
+
+	std::atomic<bool> stopping{ false };
+	bool compress;
+	std::ofstream file;
+	std::thread writer;
+};
+
+// Reads back a file written by Tracer.
+class TraceReader {
+
+public:
+	explicit TraceReader(const std::string& path);
+
+	TraceReader(const TraceReader&) = delete;
+	TraceReader& operator=(const TraceReader&) = delete;
+
+	// False when the file is missing, is not a trace, or is compressed and
+	// this build has no OTWO_ZLIB.
+	bool IsOpen() const
+	{
+		return open;
+	}
+
+	// Returns false at the end of the trace.
+	bool Next(TraceRecord& record);
+
+private:
+	bool Refill();
+	bool ReadByte(uint8_t& value);
+	bool ReadVarint(uint64_t& value);
+
+	std::ifstream file;
+	bool compressed = false;
+	std::vector<uint8_t> packed; // a compressed frame as read
+	std::vector<uint8_t> buffer;
+	size_t position = 0;
+	size_t size = 0;
+	bool open = false;
+	TraceRecord last{};
+};
@@ -0,0 +1,244 @@
+#include "warmstart.h"
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <random>
+#include <sstream>
+#include <vector>
+
+namespace {
+
+// A state file holds a header, a bitmap of the pages it stores and then
+// those pages in order. Fields are in host byte order, like the rest of
+// the emulator assumes little-endian.
+constexpr char Magic[8] = { 'O', 'T', 'W', 'O', 'W', 'A', 'R', 'M' };
+constexpr uint32_t Version = 1;
+constexpr size_t BitmapSize = Memory::PageCount / 8;
+constexpr size_t HeaderSize = sizeof(Magic) + sizeof(uint32_t) + 7 + 2 * sizeof(uint64_t) + BitmapSize;
+
+// 64-bit FNV-1a.
+class Hash {
+
+public:
+    void Add(const void* data, size_t size)
+    {
+        const uint8_t* bytes = static_cast<const uint8_t*>(data);
+        for (size_t i = 0; i < size; i++) {
+            value = (value ^ bytes[i]) * 0x100000001B3;
+        }
+    }
+
+    uint64_t Value() const
+    {
+        return value;
+    }
+
+private:
+    uint64_t value = 0xCBF29CE484222325;
+};
+
+template <typename T>
+void Put(std::vector<uint8_t>& out, T value)
+{
+    const uint8_t* bytes = reinterpret_cast<const uint8_t*>(&value);
+    out.insert(out.end(), bytes, bytes + sizeof(value));
+}
+
+template <typename T>
+T Get(const uint8_t*& in)
+{
+    T value;
+    std::memcpy(&value, in, sizeof(value));
+    in += sizeof(value);
+    return value;
+}
+
+void PutState(std::vector<uint8_t>& out, const CPUState& state)
+{
+    Put(out, state.PC);
+    Put(out, state.A);
+    Put(out, state.X);
+    Put(out, state.Y);
+    Put(out, state.S);
+    Put(out, state.P);
+    Put(out, state.cycles);
+    Put(out, state.instructions);
+}
+
+CPUState GetState(const uint8_t*& in)
+{
+    CPUState state{};
+    state.PC = Get<uint16_t>(in);
+    state.A = Get<uint8_t>(in);
+    state.X = Get<uint8_t>(in);
+    state.Y = Get<uint8_t>(in);
+    state.S = Get<uint8_t>(in);
+    state.P = Get<uint8_t>(in);
+    state.cycles = Get<uint64_t>(in);
+    state.instructions = Get<uint64_t>(in);
+    return state;
+}
+
+// Names the state after everything a run from here depends on: the
+// registers, and the kind and contents of every page. Device pages only
+// count by position, since their contents come from outside.
+std::string StateName(const CPUState& state, Memory& memory, uint16_t mark)
+{
+    Hash hash;
+    std::vector<uint8_t> registers;
+    PutState(registers, state);
+    hash.Add(registers.data(), registers.size());
+    hash.Add(&mark, sizeof(mark));
+
+    // Only looks at the pages, so that the snapshot chain and the dirty
+    // pages are left as they were.
+    uint8_t page[Memory::PageSize];
+    for (uint32_t index = 0; index < Memory::PageCount; index++) {
+        uint16_t address = index * Memory::PageSize;
+        uint8_t kind = static_cast<uint8_t>(memory.KindOf(index));
+        hash.Add(&kind, sizeof(kind));
+        if (kind != static_cast<uint8_t>(Memory::PageKind::Device)) {
+            for (uint32_t i = 0; i < Memory::PageSize; i++) {
+                page[i] = memory.ReadByte(address + i);
+            }
+            hash.Add(page, sizeof(page));
+        }
+    }
+
+    std::ostringstream name;
+    name << std::hex;
+    name.width(16);
+    name.fill('0');
+    name << hash.Value() << ".warm";
+    return name.str();
+}
+
+bool ReadState(const std::string& path, MachineState& state)
+{
+    std::ifstream file(path, std::ios::binary);
+    if (!file.is_open()) {
+        return false;
+    }
+    std::vector<uint8_t> data((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+    if (data.size() < HeaderSize || std::memcmp(data.data(), Magic, sizeof(Magic)) != 0) {
+        return false;
+    }
+
+    const uint8_t* in = data.data() + sizeof(Magic);
+    if (Get<uint32_t>(in) != Version) {
+        return false;
+    }
+    state.cpu = GetState(in);
+    const uint8_t* bitmap = in;
+    in += BitmapSize;
+
+    auto snapshot = std::make_shared<Memory::Snapshot>();
+    size_t pageCount = (data.size() - HeaderSize) / Memory::PageSize;
+    snapshot->bytes = std::make_unique<uint8_t[]>(pageCount * Memory::PageSize);
+    snapshot->deltaBytes = 0;
+    std::memcpy(snapshot->bytes.get(), in, pageCount * Memory::PageSize);
+    size_t stored = 0;
+    for (uint32_t page = 0; page < Memory::PageCount; page++) {
+        snapshot->pages[page] = nullptr;
+        if (bitmap[page / 8] & (1 << (page % 8))) {
+            if (stored == pageCount) {
+                return false;
+            }
+            snapshot->pages[page] = snapshot->bytes.get() + stored++ * Memory::PageSize;
+        }
+    }
+    if (stored != pageCount || data.size() != HeaderSize + pageCount * Memory::PageSize) {
+        return false;
+    }
+    state.memory = std::move(snapshot);
+    return true;
+}
+
+}
+
+WarmStart::WarmStart(uint16_t mark, std::string directory)
+    : mark(mark), directory(std::move(directory))
+{
+}
+
+template <typename Policy>
+bool WarmStart::Resume(BasicMachine<Policy>& machine, uint64_t maxCycles)
+{
+    path = (std::filesystem::path(directory) / StateName(machine.cpu.GetState(), machine.memory, mark)).string();
+
+    // A run whose budget ends before the mark never gets there.
+    MachineState state;
+    if (!ReadState(path, state) || state.cpu.cycles >= maxCycles) {
+        return false;
+    }
+    machine.LoadState(state);
+    resumed = true;
+    done = true;
+    return true;
+}
+
+template <typename Policy>
+RunResult WarmStart::RunFor(BasicMachine<Policy>& machine, uint64_t maxCycles)
+{
+    BasicCPU<Policy>& cpu = machine.cpu;
+    if (done || path.empty()) {
+        return cpu.RunFor(maxCycles);
+    }
+
+    RunResult run = cpu.RunUntil([this](const BasicCPU<Policy>& cpu) { return cpu.ProgramCounter() == mark; }, maxCycles);
+    if (run.reason != StopReason::ConditionMet) {
+        return run;
+    }
+    saved = Save(machine.SaveState());
+    done = true;
+
+    RunResult rest = cpu.RunFor(maxCycles - run.cycles);
+    rest.cycles += run.cycles;
+    rest.instructions += run.instructions;
+    return rest;
+}
+
+// Writes to a file of its own and renames it into place, so that runs
+// racing to save the same state never see half of one.
+bool WarmStart::Save(const MachineState& state) const
+{
+    std::vector<uint8_t> data(Magic, Magic + sizeof(Magic));
+    Put(data, Version);
+    PutState(data, state.cpu);
+    uint8_t bitmap[BitmapSize] = {};
+    for (uint32_t page = 0; page < Memory::PageCount; page++) {
+        if (state.memory->pages[page]) {
+            bitmap[page / 8] |= 1 << (page % 8);
+        }
+    }
+    data.insert(data.end(), bitmap, bitmap + BitmapSize);
+    for (uint32_t page = 0; page < Memory::PageCount; page++) {
+        if (state.memory->pages[page]) {
+            data.insert(data.end(), state.memory->pages[page], state.memory->pages[page] + Memory::PageSize);
+        }
+    }
+
+    std::error_code error;
+    std::filesystem::create_directories(directory, error);
+    std::string temporary = path + "." + std::to_string(std::random_device()()) + ".tmp";
+    {
+        std::ofstream file(temporary, std::ios::binary);
+        if (!file.write(reinterpret_cast<const char*>(data.data()), data.size())) {
+            return false;
+        }
+    }
+    std::filesystem::rename(temporary, path, error);
+    if (error) {
+        std::filesystem::remove(temporary, error);
+        return false;
+    }
+    return true;
+}
+
+template bool WarmStart::Resume(Machine&, uint64_t);
+template bool WarmStart::Resume(DebugMachine&, uint64_t);
+template RunResult WarmStart::RunFor(Machine&, uint64_t);
+template RunResult WarmStart::RunFor(DebugMachine&, uint64_t);
+template bool WarmStart::Resume(ProfileMachine&, uint64_t);
+template RunResult WarmStart::RunFor(ProfileMachine&, uint64_t);
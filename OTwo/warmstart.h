@@ -0,0 +1,55 @@
+#pragma once
+#include <cstdint>
+#include <string>
+
+#include "machine.h"
+
+// Skips initialization that every run from the same image goes through.
+// The first run to reach a marked PC saves the machine there, and later
+// runs that start from the same memory contents and registers load that
+// state instead of running up to it. States are kept as files in a
+// directory, named after a hash of the starting memory, registers and mark.
+//
+// Until the mark is reached the CPU runs one instruction at a time, as
+// under RunUntil, so a run that saves a state is slower than a plain one.
+class WarmStart {
+
+public:
+	static constexpr const char* DefaultDirectory = "otwo-warm";
+
+	explicit WarmStart(uint16_t mark, std::string directory = DefaultDirectory);
+
+	// Call before the machine has run. Loads the saved state and returns
+	// true when there is one that a run with the given total cycle budget
+	// reaches. Defined for the machines in machine.h.
+	template <typename Policy>
+	bool Resume(BasicMachine<Policy>& machine, uint64_t maxCycles);
+
+	// Runs like CPU::RunFor, saving the machine when it first reaches the
+	// mark unless it was resumed.
+	template <typename Policy>
+	RunResult RunFor(BasicMachine<Policy>& machine, uint64_t maxCycles);
+
+	bool Resumed() const
+	{
+		return resumed;
+	}
+
+	// True once this run has written a state file.
+	bool Saved() const
+	{
+		return saved;
+	}
+
+private:
+	bool Save(const MachineState& state) const;
+
+	uint16_t mark;
+	std::string directory;
+	std::string path;
+	bool resumed = false;
+	bool saved = false;
+	// Set once the mark can no longer be saved: after resuming, saving, or
+	// failing to save.
+	bool done = false;
+};